@@ -0,0 +1,463 @@
+/**
+ * @file bench.c Microbenchmarks for the turnperf hot paths
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include "../src/turnperf.h"
+
+
+/*
+ * Each benchmark runs until it has taken at least BENCH_MIN_US, and
+ * prints one JSON object per line on stdout:
+ *
+ *   {"bench":"protocol_encode","n":1048576,"ns_per_op":21.3,
+ *    "allocs_per_op":0.00}
+ *
+ * Allocations are counted by wrapping the libre allocators at link
+ * time (-Wl,--wrap), so only calls made from turnperf code count.
+ */
+
+
+enum {
+	BENCH_MIN_US = 200000,
+	PSIZE = 160,
+	PTIME = 20,
+	TCP_SEGSZ = 1400,
+};
+
+
+typedef void (bench_h)(void *arg, uint64_t n);
+
+static uint64_t n_allocs;
+
+
+void *__real_mem_alloc(size_t size, mem_destroy_h *dh);
+void *__real_mem_zalloc(size_t size, mem_destroy_h *dh);
+struct mbuf *__real_mbuf_alloc(size_t size);
+void *__wrap_mem_alloc(size_t size, mem_destroy_h *dh);
+void *__wrap_mem_zalloc(size_t size, mem_destroy_h *dh);
+struct mbuf *__wrap_mbuf_alloc(size_t size);
+
+
+void *__wrap_mem_alloc(size_t size, mem_destroy_h *dh)
+{
+	++n_allocs;
+	return __real_mem_alloc(size, dh);
+}
+
+
+void *__wrap_mem_zalloc(size_t size, mem_destroy_h *dh)
+{
+	++n_allocs;
+	return __real_mem_zalloc(size, dh);
+}
+
+
+/* an mbuf is two allocations, the struct and the buffer */
+struct mbuf *__wrap_mbuf_alloc(size_t size)
+{
+	n_allocs += 2;
+	return __real_mbuf_alloc(size);
+}
+
+
+static void bench_run(const char *name, bench_h *bh, void *arg)
+{
+	uint64_t n = 1024, start, elapsed, allocs;
+
+	for (;;) {
+		allocs = n_allocs;
+		start  = time_usec();
+
+		bh(arg, n);
+
+		elapsed = time_usec() - start;
+		allocs  = n_allocs - allocs;
+
+		if (elapsed >= BENCH_MIN_US)
+			break;
+
+		n *= 2;
+	}
+
+	re_printf("{\"bench\":\"%s\",\"n\":%llu,\"ns_per_op\":%.1f,"
+		  "\"allocs_per_op\":%.2f}\n",
+		  name, (unsigned long long)n,
+		  1000.0 * elapsed / n, (double)allocs / n);
+}
+
+
+static void bench_encode(void *arg, uint64_t n)
+{
+	struct mbuf *mb = arg;
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		mb->pos = mb->end = 0;
+		protocol_encode(mb, 0x1234, 1, (uint32_t)i, i,
+				PSIZE - HDR_SIZE, PATTERN);
+	}
+}
+
+
+static void bench_decode(void *arg, uint64_t n)
+{
+	struct mbuf *mb = arg;
+	struct hdr hdr;
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		mb->pos = 0;
+		protocol_decode(&hdr, mb);
+	}
+}
+
+
+struct recv_bench {
+	struct receiver recv;
+	struct mbuf *mb;
+	struct sa src;
+};
+
+
+static void bench_receiver(void *arg, uint64_t n)
+{
+	struct recv_bench *rb = arg;
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+
+		/* patch the sequence number, so packets are in order */
+		rb->mb->pos = 12;
+		mbuf_write_u32(rb->mb, htonl(rb->recv.last_seq + 1));
+		rb->mb->pos = 0;
+
+		receiver_recv(&rb->recv, &rb->src, rb->mb);
+	}
+}
+
+
+struct sender_bench {
+	struct allocator *allocator;
+	struct sender *snd;
+	unsigned count;
+	uint64_t now;                 /* simulated pacing clock [us] */
+};
+
+
+/* one due packet per tick, i.e. one send_packet() per op */
+static void bench_send(void *arg, uint64_t n)
+{
+	struct sender_bench *sb = arg;
+	uint64_t i, now;
+
+	for (i = 0; i < n; i++) {
+		now = time_usec();
+		sb->snd->ts = now;
+		sender_tick(sb->snd, now, &sb->allocator->slip);
+	}
+}
+
+
+/* pacing loop with no packets due, this is the cost of every tick */
+static void bench_check_senders(void *arg, uint64_t n)
+{
+	struct sender_bench *sb = arg;
+	uint64_t i;
+
+	for (i = 0; i < n; i++)
+		allocator_check_senders(sb->allocator, 0);
+}
+
+
+/*
+ * pacing loop where the senders are spread over the ptime, so that
+ * every tick one PACING_INTERVAL_MS / PTIME share of them is due and
+ * sends one packet to the sink
+ */
+static void bench_due_senders(void *arg, uint64_t n)
+{
+	struct sender_bench *sb = arg;
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		allocator_check_senders(sb->allocator, sb->now);
+		sb->now += PACING_INTERVAL_MS * 1000;
+	}
+}
+
+
+static int frame_handler(struct mbuf *mb, void *arg)
+{
+	unsigned *count = arg;
+	(void)mb;
+
+	++*count;
+
+	return 0;
+}
+
+
+struct tcp_bench {
+	struct mbuf *stream;
+	unsigned frames;
+};
+
+
+/* one op is one TCP segment, split at arbitrary frame boundaries */
+static void bench_tcp(void *arg, uint64_t n)
+{
+	struct tcp_bench *tb = arg;
+	struct mbuf *mb_pkt, *mb = NULL;
+	uint64_t i;
+	size_t pos = 0;
+
+	mb_pkt = __real_mbuf_alloc(TCP_SEGSZ);
+	if (!mb_pkt)
+		return;
+
+	for (i = 0; i < n; i++) {
+
+		size_t len = min(TCP_SEGSZ, tb->stream->end - pos);
+
+		mb_pkt->pos = mb_pkt->end = 0;
+		mbuf_write_mem(mb_pkt, tb->stream->buf + pos, len);
+		mb_pkt->pos = 0;
+
+		if (tcp_reassemble(&mb, mb_pkt, frame_handler, &tb->frames))
+			break;
+
+		pos += len;
+		if (pos >= tb->stream->end)
+			pos = 0;
+	}
+
+	mem_deref(mb);
+	mem_deref(mb_pkt);
+}
+
+
+static int setup_senders(struct allocator *allocator, struct sender_bench *sb,
+			 struct allocation *alloc, unsigned count, bool due)
+{
+	const unsigned slots = PTIME / PACING_INTERVAL_MS;
+	unsigned i;
+	int err;
+
+	allocator->num_allocations = count;
+	allocator->num_sent        = count;
+
+	err = allocator_arena_alloc(allocator);
+	if (err)
+		return err;
+
+	for (i = 0; i < count; i++) {
+		err = sender_init(&allocator->senderv[i], alloc, 0x1234, i,
+				  64000, PTIME, PSIZE);
+		if (err)
+			return err;
+
+		/* never due, or due in one of the ticks of a ptime */
+		if (due) {
+			allocator->senderv[i].ts =
+				(i % slots) * PACING_INTERVAL_MS * 1000ULL;
+		}
+		else {
+			allocator->senderv[i].ts = ~0ULL;
+		}
+	}
+
+	sb->allocator = allocator;
+	sb->count     = count;
+	sb->now       = 0;
+
+	return 0;
+}
+
+
+static int bench_senders(void)
+{
+	static const unsigned countv[] = {1000, 10000, 100000};
+	static const unsigned duev[] = {1000, 10000};
+	struct allocator allocator;
+	struct sender_bench sb;
+	struct allocation *alloc = NULL;
+	struct udp_sock *sink = NULL;
+	struct sa laddr;
+	unsigned i;
+	char name[64];
+	int err;
+
+	/* packets are sent to a local socket that never reads */
+	sa_set_str(&laddr, "127.0.0.1", 0);
+
+	err = udp_listen(&sink, &laddr, NULL, NULL);
+	if (err)
+		return err;
+
+	udp_local_get(sink, &laddr);
+
+	memset(&allocator, 0, sizeof(allocator));
+	allocator.num_allocations = 1;
+	allocator.sockbuf = SOCKBUF_DEFAULT;
+
+	err = allocator_arena_alloc(&allocator);
+	if (err)
+		goto out;
+
+	err = allocation_create_direct(&alloc, &allocator, 0, &laddr);
+	if (err)
+		goto out;
+
+	err = sender_init(&allocator.senderv[0], alloc, 0x1234, 0,
+			  64000, PTIME, PSIZE);
+	if (err)
+		goto out;
+
+	sb.allocator = &allocator;
+	sb.snd       = &allocator.senderv[0];
+
+	bench_run("send_packet", bench_send, &sb);
+
+	for (i = 0; i < ARRAY_SIZE(countv); i++) {
+
+		struct allocator many;
+
+		memset(&many, 0, sizeof(many));
+
+		err = setup_senders(&many, &sb, alloc, countv[i], false);
+		if (!err) {
+			re_snprintf(name, sizeof(name),
+				    "check_all_senders_%u", countv[i]);
+			bench_run(name, bench_check_senders, &sb);
+		}
+
+		many.senderv = mem_deref(many.senderv);
+		many.recvv   = mem_deref(many.recvv);
+		if (err)
+			goto out;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(duev); i++) {
+
+		struct allocator many;
+
+		memset(&many, 0, sizeof(many));
+
+		err = setup_senders(&many, &sb, alloc, duev[i], true);
+		if (!err) {
+			re_snprintf(name, sizeof(name),
+				    "check_due_senders_%u", duev[i]);
+			bench_run(name, bench_due_senders, &sb);
+		}
+
+		many.senderv = mem_deref(many.senderv);
+		many.recvv   = mem_deref(many.recvv);
+		if (err)
+			goto out;
+	}
+
+ out:
+	mem_deref(alloc);
+	allocator_reset(&allocator);
+	mem_deref(sink);
+
+	return err;
+}
+
+
+static int bench_protocol(void)
+{
+	struct recv_bench rb;
+	struct mbuf *mb;
+	int err;
+
+	mb = __real_mbuf_alloc(1024);
+	if (!mb)
+		return ENOMEM;
+
+	bench_run("protocol_encode", bench_encode, mb);
+
+	mb->pos = 0;
+	bench_run("protocol_decode", bench_decode, mb);
+
+	receiver_init(&rb.recv, 0x1234, 1, NULL, NULL);
+	sa_set_str(&rb.src, "127.0.0.1", 1234);
+	rb.mb = mb;
+
+	mb->pos = mb->end = 0;
+	err = protocol_encode(mb, 0x1234, 1, 1, 0, PSIZE - HDR_SIZE,
+			      PATTERN);
+	if (!err)
+		bench_run("receiver_recv", bench_receiver, &rb);
+
+	mem_deref(mb);
+
+	return err;
+}
+
+
+static int bench_framing(void)
+{
+	struct tcp_bench tb;
+	unsigned i;
+	int err = 0;
+
+	memset(&tb, 0, sizeof(tb));
+
+	/* a stream of padded ChannelData frames with turnperf packets */
+	tb.stream = __real_mbuf_alloc(64 * 1024);
+	if (!tb.stream)
+		return ENOMEM;
+
+	for (i = 0; i < 256; i++) {
+
+		err |= mbuf_write_u16(tb.stream, htons(0x4000));
+		err |= mbuf_write_u16(tb.stream, htons(PSIZE + 2));
+		err |= protocol_encode(tb.stream, 0x1234, 1, i, 0,
+				       PSIZE - HDR_SIZE, PATTERN);
+		err |= mbuf_fill(tb.stream, 0, 2);
+		while (tb.stream->end & 0x03)
+			err |= mbuf_write_u8(tb.stream, 0);
+	}
+
+	if (!err)
+		bench_run("tcp_recv_handler_framing", bench_tcp, &tb);
+
+	mem_deref(tb.stream);
+
+	return err;
+}
+
+
+int main(void)
+{
+	int err;
+
+	err = libre_init();
+	if (err)
+		return err;
+
+	err = bench_protocol();
+	if (err)
+		goto out;
+
+	err = bench_framing();
+	if (err)
+		goto out;
+
+	err = bench_senders();
+	if (err)
+		goto out;
+
+ out:
+	if (err)
+		re_fprintf(stderr, "bench failed (%m)\n", err);
+
+	libre_close();
+
+	return err;
+}
@@ -5,18 +5,53 @@
  */
 
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/udp.h>
+#include <string.h>
+#ifdef __linux__
+#include <linux/sock_diag.h>
+#endif
 #include <re.h>
 #include "turnperf.h"
 
 
 enum {
 	TURN_LAYER = 0,
+	SRV_LAYER = -10,              /* below TURN, sees its responses */
 	DTLS_LAYER = -100,
 };
 
+/* per-packet headers, for the estimated wire throughput [bytes] */
+enum {
+	IP4_HDR = 20,
+	IP6_HDR = 40,
+	UDP_HDR = 8,
+	TCP_HDR = 32,                 /* with timestamps */
+	TLS_REC = 29,                 /* record header, AES-GCM nonce, tag */
+	DTLS_REC = 37,
+	CHANDATA_HDR = 4,
+	STUN_HDR = 20,
+	STUN_ATTR_HDR = 4,
+};
+
 enum {
 	PING_INTERVAL = 5000,
 	REDIRC_MAX = 16,
+	RETRY_BASE = 100,             /* first retry backoff [ms] */
+	RETRY_MAX = 5000,             /* max retry backoff [ms] */
+	DEALLOC_TICK = 10,            /* [ms] */
+	DEALLOC_TIMEOUT = 5000,       /* wait for responses [ms] */
+};
+
+
+/* a peer of an allocation, that sends to the relayed address */
+struct peer {
+	struct udp_sock *us;
+	struct sa laddr;              /* local address of the socket */
+	struct sa addr;               /* as seen by the TURN server */
+	int fd;                       /* connected to relay, for io_uring */
+	uint64_t ts_setup;            /* permission/channel requested [us] */
+	double setup;                 /* [ms] */
 };
 
 
@@ -25,36 +60,58 @@ struct allocation {
 	struct allocator *allocator;  /* pointer to container */
 	struct udp_sock *us;
 	struct turnc *turnc;
+	struct udp_helper *uh;        /* UDP, until the allocation is ok */
 	struct timeval sent;
 	int proto;
 	bool secure;
 	struct sa srv;
-	const char *user;
-	const char *pass;
+	struct sa srv_rx;             /* last response came from [UDP] */
+	unsigned srvix;               /* index into allocator servers */
+	struct sa laddr;              /* local address, port is zero */
+	char *user;                   /* own credentials */
+	char *pass;
+	uint64_t ts_challenge;        /* last 401 from the server [us] */
+	double auth;                  /* challenge to success [ms] */
 	struct sa relay;
-	struct sa peer;
+	struct peer *peerv;           /* one stream per peer */
+	unsigned peerc;
+	unsigned peers_ok;            /* with a permission or channel */
 	struct tcp_conn *tc;
 	struct tls_conn *tlsc;
 	struct tls *tls;
 	struct dtls_sock *dtls_sock;
 	struct mbuf *mb;              /* TCP re-assembly buffer */
-	struct sender *sender;
-	struct receiver recv;
-	struct udp_sock *us_tx;
-	struct sa laddr_tx;
+	struct sender *sender;        /* first stream in allocator arena */
+	struct receiver *recv;        /* first stream in allocator arena */
 	struct tmr tmr_ping;
+	struct tmr tmr_retry;
+	struct tmr tmr_teardown;
 	double atime;                 /* ms */
+	unsigned group;
+	uint64_t ts_dealloc;          /* Refresh(0) was sent [us] */
+	bool dealloc_done;
+	uint32_t drops_start;         /* socket drops, measurement window */
+	uint32_t drops_stop;
+	bool drops_frozen;
 	unsigned ix;
 	bool ok;
+	bool established;             /* reported as ok to the application */
+	bool failed;                  /* reported as failed */
 	bool turn_ind;
 	unsigned redirc;
+	unsigned retries;
 	int err;
+	uint16_t scode;
 	allocation_h *alloch;
 	void *arg;
 };
 
 
 static int start(struct allocation *alloc);
+static void allocation_fail(struct allocation *alloc, int err,
+			    uint16_t scode, const char *reason);
+static void dealloc_done(struct allocation *alloc, int err,
+			 uint16_t scode, const char *reason);
 
 
 /*
@@ -72,6 +129,39 @@ static int print_bitrate(struct re_printf *pf, double *val)
 }
 
 
+static struct server *alloc_server(const struct allocation *alloc)
+{
+	struct allocator *allocator = alloc->allocator;
+
+	if (alloc->srvix >= allocator->serverc)
+		return NULL;
+
+	return &allocator->serverv[alloc->srvix];
+}
+
+
+/* the allocation moved to another server, which has its own statistics */
+static void server_redirect(struct allocation *alloc, const struct sa *srv)
+{
+	struct server *from = alloc_server(alloc);
+	unsigned ix;
+
+	re_printf("[%u] redirecting to new server %J\n", alloc->ix, srv);
+
+	alloc->srv = *srv;
+
+	if (from)
+		++from->redirects;
+
+	/* if the table is full, the old server keeps the allocation */
+	if (allocator_server_add(alloc->allocator, srv, 0, &ix))
+		return;
+
+	alloc->srvix = ix;
+	++alloc->allocator->serverv[ix].redirected;
+}
+
+
 static void tmr_ping_handler(void *arg)
 {
 	struct allocation *alloc = arg;
@@ -87,41 +177,331 @@ static void tmr_ping_handler(void *arg)
 	mbuf_write_str(mb, "PING");
 	mb->pos = 48;
 
-	turnc_send(alloc->turnc, &alloc->peer, mb);
+	turnc_send(alloc->turnc, &alloc->peerv[0].addr, mb);
 
 	mem_deref(mb);
 }
 
 
-static void perm_handler(void *arg)
+static void established(struct allocation *alloc)
 {
-	struct allocation *alloc = arg;
+	struct server *srv;
+
+	if (alloc->peerc > 1) {
+		re_printf("%s to %u peers added.\n",
+			  alloc->turn_ind ? "Permissions" : "Channels",
+			  alloc->peerc);
+	}
+	else {
+		re_printf("%s to %J added.\n",
+			  alloc->turn_ind ? "Permission" : "Channel",
+			  &alloc->peerv[0].addr);
+	}
+
+	alloc->established = true;
 
-	re_printf("%s to %J added.\n",
-		  alloc->turn_ind ? "Permission" : "Channel",
-		  &alloc->peer);
+	srv = alloc_server(alloc);
+	if (srv) {
+		++srv->ok;
+		hist_add(&srv->atime, (uint64_t)(alloc->atime * 1000));
+	}
 
 	alloc->alloch(0, 0, "OK", &alloc->srv, &alloc->relay, alloc->arg);
 }
 
 
-static int set_peer(struct allocation *alloc, const struct sa *peer)
+/* permissions are per IP address, peers on one address share one */
+static bool perm_shared(const struct allocation *alloc, unsigned p)
 {
-	alloc->peer = *peer;
+	unsigned i;
+
+	for (i = 0; i < p; i++) {
+		if (sa_cmp(&alloc->peerv[i].addr, &alloc->peerv[p].addr,
+			   SA_ADDR))
+			return true;
+	}
+
+	return false;
+}
+
+
+static void perm_handler(void *arg);
 
-	tmr_start(&alloc->tmr_ping, PING_INTERVAL, tmr_ping_handler, alloc);
+
+/*
+ * Add the permission or channel of the next peer. The peers are added
+ * one at a time, so that the setup time is known per table size.
+ * Returns ENOENT if all peers were added.
+ */
+static int peer_next(struct allocation *alloc)
+{
+	struct peer *peer;
+
+	while (alloc->turn_ind && alloc->peers_ok < alloc->peerc &&
+	       perm_shared(alloc, alloc->peers_ok))
+		++alloc->peers_ok;
+
+	if (alloc->peers_ok >= alloc->peerc)
+		return ENOENT;
+
+	peer = &alloc->peerv[alloc->peers_ok];
+	peer->ts_setup = time_usec();
 
 	if (alloc->turn_ind)
-		return turnc_add_perm(alloc->turnc, peer, perm_handler, alloc);
+		return turnc_add_perm(alloc->turnc, &peer->addr,
+				      perm_handler, alloc);
 	else
-		return turnc_add_chan(alloc->turnc, peer, perm_handler, alloc);
+		return turnc_add_chan(alloc->turnc, &peer->addr,
+				      perm_handler, alloc);
+}
+
+
+static void perm_handler(void *arg)
+{
+	struct allocation *alloc = arg;
+	struct allocator *allocator = alloc->allocator;
+	struct peer *peer = &alloc->peerv[alloc->peers_ok];
+	uint64_t setup = time_usec() - peer->ts_setup;
+	int err;
+
+	++alloc->peers_ok;
+
+	peer->setup = setup / 1000.0;
+	hist_add(&allocator->fanout_setup[fanout_bucket(alloc->peers_ok)],
+		 setup);
+
+	err = peer_next(alloc);
+	if (err == ENOENT)
+		established(alloc);
+	else if (err)
+		allocation_fail(alloc, err, 0, NULL);
+}
+
+
+static int set_peers(struct allocation *alloc)
+{
+	tmr_start(&alloc->tmr_ping, PING_INTERVAL, tmr_ping_handler, alloc);
+
+	alloc->peers_ok = 0;
+
+	return peer_next(alloc);
+}
+
+
+/*
+ * The io_uring datapath writes to the peer socket without an address,
+ * so it must be connected to the relayed address.
+ */
+static int connect_tx(struct allocation *alloc, struct peer *peer)
+{
+	peer->fd = udp_sock_fd(peer->us, sa_af(&alloc->relay));
+	if (peer->fd < 0)
+		return EBADF;
+
+	if (0 != connect(peer->fd, &alloc->relay.u.sa, alloc->relay.len))
+		return errno;
+
+	return 0;
+}
+
+
+/*
+ * Number of packets the kernel dropped on the receive queue of the
+ * TURN socket. These were lost on the client host, not in the server.
+ */
+static uint32_t sock_drops(const struct allocation *alloc)
+{
+#if defined(__linux__) && defined(SO_MEMINFO)
+	uint32_t meminfo[SK_MEMINFO_VARS];
+	socklen_t len = sizeof(meminfo);
+	int fd;
+
+	if (!alloc || !alloc->us)
+		return 0;
+
+	fd = udp_sock_fd(alloc->us, sa_af(&alloc->laddr));
+	if (fd < 0)
+		return 0;
+
+	if (0 != getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len))
+		return 0;
+
+	if (len <= SK_MEMINFO_DROPS * sizeof(uint32_t))
+		return 0;
+
+	return meminfo[SK_MEMINFO_DROPS];
+#else
+	(void)alloc;
+	return 0;
+#endif
+}
+
+
+/* receive queue drops inside the measurement window */
+static uint32_t rx_drops(const struct allocation *alloc)
+{
+	if (!alloc)
+		return 0;
+
+	return (alloc->drops_frozen ? alloc->drops_stop : sock_drops(alloc))
+		- alloc->drops_start;
+}
+
+
+/* close the TURN client and its transport, but keep the state */
+static void teardown(struct allocation *alloc)
+{
+	tmr_cancel(&alloc->tmr_ping);
+
+	alloc->uh    = mem_deref(alloc->uh);
+	alloc->turnc = mem_deref(alloc->turnc);
+	alloc->tlsc  = mem_deref(alloc->tlsc);
+	alloc->tc    = mem_deref(alloc->tc);
+	alloc->dtls_sock = mem_deref(alloc->dtls_sock);
+	alloc->us    = mem_deref(alloc->us);
+	alloc->mb    = mem_deref(alloc->mb);
+
+	alloc->ok = false;
+}
+
+
+/*
+ * A failure is detected inside the handlers of the TURN client or the
+ * transport, which must not be freed there. Close them from a timer.
+ */
+static void tmr_teardown_handler(void *arg)
+{
+	struct allocation *alloc = arg;
+
+	teardown(alloc);
+}
+
+
+static void tmr_retry_handler(void *arg)
+{
+	struct allocation *alloc = arg;
+	int err;
+
+	tmr_cancel(&alloc->tmr_teardown);
+	teardown(alloc);
+
+	/* the time of the last attempt, without the retry backoff */
+	(void)gettimeofday(&alloc->sent, NULL);
+
+	err = start(alloc);
+	if (err)
+		allocation_fail(alloc, err, 0, NULL);
+}
+
+
+/*
+ * An allocation failed. If it was not established yet, it is retried
+ * with exponential backoff, until the retries are used up. The error
+ * is reported to the application only once.
+ */
+static void allocation_fail(struct allocation *alloc, int err,
+			    uint16_t scode, const char *reason)
+{
+	struct allocator *allocator = alloc->allocator;
+	struct server *srv = alloc_server(alloc);
+	uint32_t delay;
+
+	/* failed for good, or the attempt already failed and is retried */
+	if (alloc->failed || tmr_isrunning(&alloc->tmr_retry))
+		return;
+
+	if (alloc->ts_dealloc) {
+		dealloc_done(alloc, err, scode, reason);
+		return;
+	}
+
+	allocator_count_error(allocator, err, scode, reason);
+
+	if (!alloc->established && alloc->retries < allocator->retry_max) {
+
+		delay = min(RETRY_BASE << min(alloc->retries, 16), RETRY_MAX);
+		delay += rand_u32() % (delay / 2 + 1);
+
+		++alloc->retries;
+		++allocator->num_retries;
+
+		alloc->ok = false;
+		tmr_start(&alloc->tmr_teardown, 0, tmr_teardown_handler,
+			  alloc);
+		tmr_start(&alloc->tmr_retry, delay, tmr_retry_handler, alloc);
+		return;
+	}
+
+	alloc->failed = true;
+	alloc->err    = err;
+	alloc->scode  = scode;
+
+	/* an established allocation keeps its sender, and shows as loss */
+	if (alloc->established) {
+		++allocator->num_lost;
+		if (srv)
+			++srv->lost;
+	}
+	else {
+		++allocator->num_failed;
+		if (srv)
+			++srv->failed;
+
+		alloc->ok = false;
+		tmr_start(&alloc->tmr_teardown, 0, tmr_teardown_handler,
+			  alloc);
+	}
+
+	alloc->alloch(err, scode, reason, NULL, NULL, alloc->arg);
+}
+
+
+/* the Refresh(0) of an allocation was answered, or failed */
+static void dealloc_done(struct allocation *alloc, int err,
+			 uint16_t scode, const char *reason)
+{
+	struct dealloc *d = &alloc->allocator->dealloc;
+	const uint64_t now = time_usec();
+
+	if (alloc->dealloc_done)
+		return;
+
+	alloc->dealloc_done = true;
+
+	--d->pending;
+	d->ts_last = now;
+
+	if (err || scode) {
+		++d->n_failed;
+		d->last_err   = err;
+		d->last_scode = scode;
+		str_ncpy(d->last_reason, reason ? reason : "",
+			 sizeof(d->last_reason));
+		return;
+	}
+
+	++d->n_ok;
+	hist_add(&d->latency, now - alloc->ts_dealloc);
 }
 
 
-static bool is_connection_oriented(const struct allocation *alloc)
+/*
+ * The address of a peer as the TURN server sees it. A peer on the local
+ * address of the TURN socket is behind the same NAT, and gets the mapped
+ * address. Other local addresses are used as they are.
+ */
+static void peer_addr(const struct allocation *alloc, struct peer *peer,
+		      const struct sa *mapped)
 {
-	return alloc->proto == IPPROTO_TCP ||
-		(alloc->proto == IPPROTO_UDP && alloc->secure);
+	if (!sa_isset(&peer->laddr, SA_ADDR) ||
+	    sa_cmp(&peer->laddr, &alloc->laddr, SA_ADDR)) {
+
+		peer->addr = *mapped;
+		sa_set_port(&peer->addr, sa_port(&peer->laddr));
+	}
+	else {
+		peer->addr = peer->laddr;
+	}
 }
 
 
@@ -135,7 +515,7 @@ static void turnc_handler(int err, uint16_t scode, const char *reason,
 	struct allocation *alloc = arg;
 	struct allocator *allocator = alloc->allocator;
 	struct timeval now;
-	struct sa peer;
+	unsigned i;
 
 	if (err) {
 		(void)re_fprintf(stderr, "[%u] turn error: %m\n",
@@ -146,8 +526,7 @@ static void turnc_handler(int err, uint16_t scode, const char *reason,
 
 	if (scode) {
 
-		if (scode == 300 && is_connection_oriented(alloc) &&
-		    alloc->redirc++ < REDIRC_MAX) {
+		if (scode == 300 && alloc->redirc++ < REDIRC_MAX) {
 
 			const struct stun_attr *alt;
 
@@ -155,15 +534,13 @@ static void turnc_handler(int err, uint16_t scode, const char *reason,
 			if (!alt)
 				goto term;
 
-			re_printf("[%u] redirecting to new server %J\n",
-				  alloc->ix, &alt->v.alt_server);
-
-			alloc->srv = alt->v.alt_server;
+			server_redirect(alloc, &alt->v.alt_server);
 
 			alloc->turnc = mem_deref(alloc->turnc);
 			alloc->tlsc  = mem_deref(alloc->tlsc);
 			alloc->tc    = mem_deref(alloc->tc);
 			alloc->dtls_sock = mem_deref(alloc->dtls_sock);
+			alloc->uh    = mem_deref(alloc->uh);
 			alloc->us    = mem_deref(alloc->us);
 
 			err = start(alloc);
@@ -187,14 +564,44 @@ static void turnc_handler(int err, uint16_t scode, const char *reason,
 		goto term;
 	}
 
+	/*
+	 * The TURN client follows UDP redirects by itself, so the server
+	 * that we ended up on is the source of the last response
+	 */
+	if (alloc->uh) {
+		if (sa_isset(&alloc->srv_rx, SA_ALL) &&
+		    !sa_cmp(&alloc->srv_rx, &alloc->srv, SA_ALL))
+			server_redirect(alloc, &alloc->srv_rx);
+
+		alloc->uh = mem_deref(alloc->uh);
+	}
+
 	alloc->ok = true;
 	alloc->relay = *relay_addr;
 
+	for (i = 0; allocator->uring && i < alloc->peerc; i++) {
+
+		err = connect_tx(alloc, &alloc->peerv[i]);
+		if (err) {
+			re_fprintf(stderr, "[%u] could not connect peer"
+				   " socket to %J (%m)\n",
+				   alloc->ix, &alloc->relay, err);
+			goto term;
+		}
+	}
+
 	(void)gettimeofday(&now, NULL);
 
 	alloc->atime  = (double)(now.tv_sec - alloc->sent.tv_sec) * 1000;
 	alloc->atime += (double)(now.tv_usec - alloc->sent.tv_usec) / 1000;
 
+	if (alloc->ts_challenge) {
+		uint64_t auth = time_usec() - alloc->ts_challenge;
+
+		alloc->auth = auth / 1000.0;
+		hist_add(&allocator->auth, auth);
+	}
+
 	/* save information from the TURN server */
 	if (!allocator->server_info) {
 
@@ -219,17 +626,17 @@ static void turnc_handler(int err, uint16_t scode, const char *reason,
 		}
 	}
 
-	peer = *mapped_addr;
-	sa_set_port(&peer, sa_port(&alloc->laddr_tx));
+	for (i = 0; i < alloc->peerc; i++)
+		peer_addr(alloc, &alloc->peerv[i], mapped_addr);
 
-	err = set_peer(alloc, &peer);
+	err = set_peers(alloc);
 	if (err)
 		goto term;
 
 	return;
 
  term:
-	alloc->alloch(err, scode, reason, NULL, NULL, alloc->arg);
+	allocation_fail(alloc, err, scode, reason);
 }
 
 
@@ -237,21 +644,30 @@ static void turnc_handler(int err, uint16_t scode, const char *reason,
 static void data_handler(struct allocation *alloc, const struct sa *src,
 			 struct mbuf *mb)
 {
-	int err;
+	struct allocator *allocator = alloc->allocator;
+	struct peer *peer;
+	uint32_t id;
+	unsigned p = 0, n;
 
 	if (!alloc->ok) {
-		re_fprintf(stderr, "allocation not ready"
-			   " -- ignore %zu bytes from %J\n",
-			   mbuf_get_left(mb), src);
+		events_add(&allocator->events, EVENT_NOT_READY,
+			   alloc->ix, src, mb, 0, 0, 0);
 		return;
 	}
 
-	if (!sa_cmp(src, &alloc->peer, SA_ALL)) {
+	/* the stream number tells which peer sent the packet */
+	if (alloc->peerc > 1 && 0 == protocol_peek_id(mb, &id) &&
+	    id / alloc->peerc == alloc->ix)
+		p = id % alloc->peerc;
+
+	peer = &alloc->peerv[p];
 
-		re_printf("updating peer address:  %J  -->  %J\n",
-			  &alloc->peer, src);
+	if (!sa_cmp(src, &peer->addr, SA_ALL)) {
 
-		alloc->peer = *src;
+		events_add(&allocator->events, EVENT_PEER_ADDR,
+			   alloc->ix, src, NULL, 0, 0, 0);
+
+		peer->addr = *src;
 
 		if (!alloc->turn_ind)
 			turnc_add_chan(alloc->turnc, src, NULL, NULL);
@@ -260,141 +676,199 @@ static void data_handler(struct allocation *alloc, const struct sa *src,
 			  tmr_ping_handler, alloc);
 	}
 
-	err = receiver_recv(&alloc->recv, src, mb);
-	if (err) {
-		re_fprintf(stderr, "corrupt packet coming from %J (%m)\n",
-			   src, err);
-	}
-}
+	/* errors are counted as events by the receiver */
+	(void)receiver_recv(&alloc->recv[p], src, mb);
 
+	/* flood mode is clocked by the arrivals, the window moved */
+	if (!alloc->sender || !allocator->flood.window)
+		return;
 
-static void udp_recv(const struct sa *src, struct mbuf *mb, void *arg)
-{
-	struct allocation *alloc = arg;
+	n = sender_flood(&alloc->sender[p], alloc->recv[p].max_seq,
+			 allocator->flood.window, time_usec());
 
-	data_handler(alloc, src, mb);
+#ifdef USE_IO_URING
+	if (n && allocator->uring)
+		uring_submit(allocator->uring);
+#else
+	(void)n;
+#endif
 }
 
 
-static void tcp_recv_handler(struct mbuf *mb_pkt, void *arg)
+/*
+ * After the TURN client was closed, only the response to its last
+ * Refresh request is expected on the socket.
+ */
+static void dealloc_recv(struct allocation *alloc, struct mbuf *mb)
 {
-	struct allocation *alloc = arg;
-	int err = 0;
-
-	/* re-assembly of fragments */
-	if (alloc->mb) {
-		size_t pos;
-
-		pos = alloc->mb->pos;
-
-		alloc->mb->pos = alloc->mb->end;
-
-		err = mbuf_write_mem(alloc->mb,
-				     mbuf_buf(mb_pkt), mbuf_get_left(mb_pkt));
-		if (err)
-			goto out;
+	const struct stun_attr *ec;
+	struct stun_msg *msg;
 
-		alloc->mb->pos = pos;
-	}
-	else {
-		alloc->mb = mem_ref(mb_pkt);
-	}
+	if (stun_msg_decode(&msg, mb, NULL))
+		return;
 
-	for (;;) {
+	if (stun_msg_method(msg) != STUN_METHOD_REFRESH)
+		goto out;
 
-		size_t len, pos, end;
-		struct sa src;
-		uint16_t typ;
+	switch (stun_msg_class(msg)) {
 
-		if (mbuf_get_left(alloc->mb) < 4)
-			break;
+	case STUN_CLASS_SUCCESS_RESP:
+		dealloc_done(alloc, 0, 0, NULL);
+		break;
 
-		typ = ntohs(mbuf_read_u16(alloc->mb));
-		len = ntohs(mbuf_read_u16(alloc->mb));
+	case STUN_CLASS_ERROR_RESP:
+		ec = stun_msg_attr(msg, STUN_ATTR_ERR_CODE);
+		dealloc_done(alloc, ec ? 0 : EPROTO,
+			     ec ? ec->v.err_code.code : 0,
+			     ec ? ec->v.err_code.reason : NULL);
+		break;
 
-		if (typ < 0x4000)
-			len += STUN_HEADER_SIZE;
-		else if (typ < 0x8000)
-			len += 4;
-		else {
-			err = EBADMSG;
-			goto out;
-		}
+	default:
+		break;
+	}
 
-		alloc->mb->pos -= 4;
+ out:
+	mem_deref(msg);
+}
 
-		if (mbuf_get_left(alloc->mb) < len)
-			break;
 
-		pos = alloc->mb->pos;
-		end = alloc->mb->end;
+/*
+ * The server challenges the first Allocate with a 401 (or a 438 when
+ * the nonce is stale). The time from the challenge to the success is
+ * one authenticated request, with the credential lookup in the server.
+ */
+static void auth_peek(struct allocation *alloc, struct mbuf *mb)
+{
+	const struct stun_attr *ec;
+	struct stun_msg *msg;
+	size_t pos = mb->pos;
 
-		alloc->mb->end = pos + len;
+	if (alloc->ok || mbuf_get_left(mb) < STUN_HEADER_SIZE)
+		return;
 
-		/* forward packet to TURN client */
-		err = turnc_recv(alloc->turnc, &src, alloc->mb);
-		if (err)
-			goto out;
+	/* STUN messages start with two zero bits */
+	if (mbuf_buf(mb)[0] & 0xc0)
+		return;
 
-		if (mbuf_get_left(alloc->mb)) {
-			data_handler(alloc, &src, alloc->mb);
-		}
+	if (stun_msg_decode(&msg, mb, NULL)) {
+		mb->pos = pos;
+		return;
+	}
 
-		/* 4 byte alignment */
-		while (len & 0x03)
-			++len;
+	mb->pos = pos;
 
-		alloc->mb->pos = pos + len;
-		alloc->mb->end = end;
+	if (stun_msg_method(msg) != STUN_METHOD_ALLOCATE ||
+	    stun_msg_class(msg) != STUN_CLASS_ERROR_RESP)
+		goto out;
 
-		if (alloc->mb->pos >= alloc->mb->end) {
-			alloc->mb = mem_deref(alloc->mb);
-			break;
-		}
-	}
+	ec = stun_msg_attr(msg, STUN_ATTR_ERR_CODE);
+	if (ec && (ec->v.err_code.code == 401 || ec->v.err_code.code == 438))
+		alloc->ts_challenge = time_usec();
 
  out:
-	if (err) {
-		alloc->alloch(err, 0, NULL, NULL, NULL, alloc->arg);
-	}
+	mem_deref(msg);
 }
 
 
-static void tcp_estab_handler(void *arg)
+/* remember where the responses come from, the packet is not touched */
+static bool srv_recv_handler(struct sa *src, struct mbuf *mb, void *arg)
 {
 	struct allocation *alloc = arg;
-	int err;
 
-	alloc->mb = mem_deref(alloc->mb);
+	alloc->srv_rx = *src;
 
-	err = turnc_alloc(&alloc->turnc, NULL, IPPROTO_TCP, alloc->tc, 0,
-			  &alloc->srv, alloc->user, alloc->pass,
-			  TURN_DEFAULT_LIFETIME, turnc_handler, alloc);
-	if (err)
-		alloc->alloch(err, 0, NULL, NULL, NULL, alloc->arg);
+	auth_peek(alloc, mb);
+
+	return false;
 }
 
 
-static void tcp_close_handler(int err, void *arg)
+static void udp_recv(const struct sa *src, struct mbuf *mb, void *arg)
 {
 	struct allocation *alloc = arg;
 
-	alloc->alloch(err ? err : ECONNRESET, 0, NULL, NULL, NULL, alloc->arg);
+	if (alloc->ts_dealloc) {
+		dealloc_recv(alloc, mb);
+		return;
+	}
+
+	data_handler(alloc, src, mb);
 }
 
 
-static void dtls_estab_handler(void *arg)
+static int tcp_frame_handler(struct mbuf *mb, void *arg)
 {
 	struct allocation *alloc = arg;
+	struct sa src;
 	int err;
 
-	re_printf("allocation: DTLS established\n");
+	if (alloc->ts_dealloc) {
+		dealloc_recv(alloc, mb);
+		return 0;
+	}
 
-	err = turnc_alloc(&alloc->turnc, NULL, STUN_TRANSP_DTLS,
-			  alloc->tlsc, TURN_LAYER,
-			  &alloc->srv, alloc->user, alloc->pass,
-			  TURN_DEFAULT_LIFETIME, turnc_handler, alloc);
-	if (err) {
+	auth_peek(alloc, mb);
+
+	/* forward packet to TURN client */
+	err = turnc_recv(alloc->turnc, &src, mb);
+	if (err)
+		return err;
+
+	if (mbuf_get_left(mb)) {
+		data_handler(alloc, &src, mb);
+	}
+
+	return 0;
+}
+
+
+static void tcp_recv_handler(struct mbuf *mb_pkt, void *arg)
+{
+	struct allocation *alloc = arg;
+	int err;
+
+	err = tcp_reassemble(&alloc->mb, mb_pkt, tcp_frame_handler, alloc);
+	if (err) {
+		allocation_fail(alloc, err, 0, NULL);
+	}
+}
+
+
+static void tcp_estab_handler(void *arg)
+{
+	struct allocation *alloc = arg;
+	int err;
+
+	alloc->mb = mem_deref(alloc->mb);
+
+	err = turnc_alloc(&alloc->turnc, NULL, IPPROTO_TCP, alloc->tc, 0,
+			  &alloc->srv, alloc->user, alloc->pass,
+			  TURN_DEFAULT_LIFETIME, turnc_handler, alloc);
+	if (err)
+		allocation_fail(alloc, err, 0, NULL);
+}
+
+
+static void tcp_close_handler(int err, void *arg)
+{
+	struct allocation *alloc = arg;
+
+	allocation_fail(alloc, err ? err : ECONNRESET, 0, NULL);
+}
+
+
+static void dtls_estab_handler(void *arg)
+{
+	struct allocation *alloc = arg;
+	int err;
+
+	re_printf("allocation: DTLS established\n");
+
+	err = turnc_alloc(&alloc->turnc, NULL, STUN_TRANSP_DTLS,
+			  alloc->tlsc, TURN_LAYER,
+			  &alloc->srv, alloc->user, alloc->pass,
+			  TURN_DEFAULT_LIFETIME, turnc_handler, alloc);
+	if (err) {
 		re_fprintf(stderr, "allocation: failed to"
 			   " create TURN client"
 			   " (%m)\n", err);
@@ -403,7 +877,7 @@ static void dtls_estab_handler(void *arg)
 
  out:
 	if (err)
-		alloc->alloch(err, 0, NULL, NULL, NULL, alloc->arg);
+		allocation_fail(alloc, err, 0, NULL);
 }
 
 
@@ -413,10 +887,17 @@ static void dtls_recv_handler(struct mbuf *mb, void *arg)
 	struct sa src;
 	int err;
 
+	if (alloc->ts_dealloc) {
+		dealloc_recv(alloc, mb);
+		return;
+	}
+
+	auth_peek(alloc, mb);
+
 	/* forward packet to TURN-client */
 	err = turnc_recv(alloc->turnc, &src, mb);
 	if (err) {
-		alloc->alloch(err, 0, NULL, NULL, NULL, alloc->arg);
+		allocation_fail(alloc, err, 0, NULL);
 		return;
 	}
 
@@ -433,7 +914,7 @@ static void dtls_close_handler(int err, void *arg)
 
 	re_fprintf(stderr, "dtls: close (%m)\n", err);
 
-	alloc->alloch(err ? err : ECONNRESET, 0, NULL, NULL, NULL, alloc->arg);
+	allocation_fail(alloc, err ? err : ECONNRESET, 0, NULL);
 }
 
 
@@ -445,7 +926,9 @@ static int start(struct allocation *alloc)
 	if (!alloc)
 		return EINVAL;
 
-	sa_init(&laddr, sa_af(&alloc->srv));
+	laddr = alloc->laddr;
+
+	alloc->ts_challenge = 0;
 
 	switch (alloc->proto) {
 
@@ -458,7 +941,7 @@ static int start(struct allocation *alloc)
 			goto out;
 		}
 
-		udp_sockbuf_set(alloc->us, 524288);
+		udp_sockbuf_set(alloc->us, alloc->allocator->sockbuf);
 
 		if (alloc->secure) {
 
@@ -483,6 +966,14 @@ static int start(struct allocation *alloc)
 			}
 		}
 		else {
+			sa_init(&alloc->srv_rx, AF_UNSPEC);
+
+			err = udp_register_helper(&alloc->uh, alloc->us,
+						  SRV_LAYER, NULL,
+						  srv_recv_handler, alloc);
+			if (err)
+				goto out;
+
 			err = turnc_alloc(&alloc->turnc, NULL, IPPROTO_UDP,
 					  alloc->us, TURN_LAYER, &alloc->srv,
 					  alloc->user, alloc->pass,
@@ -498,8 +989,31 @@ static int start(struct allocation *alloc)
 		break;
 
 	case IPPROTO_TCP:
-		err = tcp_connect(&alloc->tc, &alloc->srv, tcp_estab_handler,
-				  tcp_recv_handler, tcp_close_handler, alloc);
+		if (sa_isset(&alloc->laddr, SA_ADDR)) {
+
+			err = tcp_conn_alloc(&alloc->tc, &alloc->srv,
+					     tcp_estab_handler,
+					     tcp_recv_handler,
+					     tcp_close_handler, alloc);
+			if (err)
+				break;
+
+			err = tcp_conn_bind(alloc->tc, &laddr);
+			if (err) {
+				re_fprintf(stderr, "allocation: failed to"
+					   " bind TCP socket to %j"
+					   " (%m)\n", &laddr, err);
+				break;
+			}
+
+			err = tcp_conn_connect(alloc->tc, &alloc->srv);
+		}
+		else {
+			err = tcp_connect(&alloc->tc, &alloc->srv,
+					  tcp_estab_handler,
+					  tcp_recv_handler,
+					  tcp_close_handler, alloc);
+		}
 		if (err)
 			break;
 
@@ -524,41 +1038,117 @@ static int start(struct allocation *alloc)
 static void destructor(void *arg)
 {
 	struct allocation *alloc = arg;
+	unsigned i;
 
 	list_unlink(&alloc->le);
 
 	tmr_cancel(&alloc->tmr_ping);
+	tmr_cancel(&alloc->tmr_retry);
+	tmr_cancel(&alloc->tmr_teardown);
 
-	mem_deref(alloc->sender);
+	for (i = 0; alloc->sender && i < alloc->peerc; i++)
+		sender_reset(&alloc->sender[i]);
 
 	/* note: order matters */
  	mem_deref(alloc->turnc);     /* close TURN client, to de-allocate */
+	mem_deref(alloc->uh);
 	mem_deref(alloc->dtls_sock);
 	mem_deref(alloc->us);        /* must be closed after TURN client */
 
 	mem_deref(alloc->tlsc);
 	mem_deref(alloc->tc);
 	mem_deref(alloc->mb);
-	mem_deref(alloc->us_tx);
+
+	for (i = 0; alloc->peerv && i < alloc->peerc; i++)
+		mem_deref(alloc->peerv[i].us);
+	mem_deref(alloc->peerv);
 
 	mem_deref(alloc->tls);
+
+	mem_deref(alloc->user);
+	mem_deref(alloc->pass);
+}
+
+
+/*
+ * Peer sockets, one per stream. With a pool of local addresses the
+ * peers are spread over it, so that they have their own permissions.
+ */
+static int peers_alloc(struct allocation *alloc, unsigned peerc)
+{
+	struct allocator *allocator = alloc->allocator;
+	unsigned i;
+	int err;
+
+	alloc->peerv = mem_zalloc(peerc * sizeof(*alloc->peerv), NULL);
+	if (!alloc->peerv)
+		return ENOMEM;
+
+	alloc->peerc = peerc;
+
+	for (i = 0; i < peerc; i++) {
+
+		struct peer *peer = &alloc->peerv[i];
+		struct sa laddr = alloc->laddr;
+
+		peer->fd = -1;
+
+		if (allocator->laddrc > 1) {
+
+			const struct sa *la;
+
+			la = &allocator->laddrv[(alloc->ix + i) %
+						allocator->laddrc];
+			if (sa_af(la) == sa_af(&alloc->laddr)) {
+				laddr = *la;
+				sa_set_port(&laddr, 0);
+			}
+		}
+
+		/* the peer socket shares the local address of the TURN
+		   socket, or uses another one from the pool */
+		err = udp_listen(&peer->us, &laddr, NULL, NULL);
+		if (err) {
+			re_fprintf(stderr, "allocation: failed to create UDP"
+				   " tx socket (%m)\n", err);
+			return err;
+		}
+
+		udp_sockbuf_set(peer->us, allocator->sockbuf);
+
+		udp_local_get(peer->us, &peer->laddr);
+	}
+
+	return 0;
 }
 
 
-int allocation_create(struct allocator *allocator, unsigned ix, int proto,
-		      const struct sa *srv,
+int allocation_create(struct allocator *allocator, unsigned ix,
+		      unsigned group, unsigned server, int proto,
+		      const struct sa *srv, const struct sa *laddr,
 		      const char *username, const char *password,
 		      struct tls *tls, bool turn_ind,
 		      allocation_h *alloch, void *arg)
 {
 	struct allocation *alloc;
-	struct sa laddr;
+	unsigned i, peerc;
 	int err;
 
 	if (!allocator || !proto || !srv)
 		return EINVAL;
 
-	sa_init(&laddr, sa_af(srv));
+	if (ix >= allocator->num_allocations)
+		return ERANGE;
+
+	if (group >= allocator->groupc || server >= allocator->serverc)
+		return EINVAL;
+
+	if (laddr && sa_af(laddr) != sa_af(srv)) {
+		re_fprintf(stderr, "allocation: local address %j does not"
+			   " match address-family of server %J\n",
+			   laddr, srv);
+		return EAFNOSUPPORT;
+	}
 
 	alloc = mem_zalloc(sizeof(*alloc), destructor);
 	if (!alloc)
@@ -566,31 +1156,54 @@ int allocation_create(struct allocator *allocator, unsigned ix, int proto,
 
 	list_append(&allocator->allocl, &alloc->le, alloc);
 
-	(void)gettimeofday(&alloc->sent, NULL);
-
 	alloc->atime     = -1;
 	alloc->ix        = ix;
+	alloc->group     = group;
+	alloc->srvix     = server;
 	alloc->allocator = allocator;
 	alloc->proto     = proto;
 	alloc->secure    = tls != NULL;
 	alloc->srv       = *srv;
-	alloc->user      = username;
-	alloc->pass      = password;
 	alloc->turn_ind  = turn_ind;
 	alloc->alloch    = alloch;
 	alloc->arg       = arg;
 	alloc->tls       = mem_ref(tls);
 
-	receiver_init(&alloc->recv, allocator->session_cookie, alloc->ix);
+	if (laddr) {
+		alloc->laddr = *laddr;
+		sa_set_port(&alloc->laddr, 0);
+	}
+	else {
+		sa_init(&alloc->laddr, sa_af(srv));
+	}
 
-	err = udp_listen(&alloc->us_tx, &laddr, NULL, NULL);
-	if (err) {
-		re_fprintf(stderr, "allocation: failed to create UDP tx socket"
-			   " (%m)\n", err);
+	err  = str_dup(&alloc->user, username);
+	err |= str_dup(&alloc->pass, password);
+	if (err)
 		goto out;
+
+	peerc = max(allocator->peers, 1);
+
+	alloc->recv = &allocator->recvv[ix * peerc];
+
+	for (i = 0; i < peerc; i++) {
+		receiver_init(&alloc->recv[i], allocator->session_cookie,
+			      ix * peerc + i,
+			      &allocator->groupv[group].latency,
+			      &allocator->events);
+
+		if (allocator->sketchv)
+			alloc->recv[i].sk =
+				&allocator->sketchv[ix * peerc + i];
 	}
 
-	udp_local_get(alloc->us_tx, &alloc->laddr_tx);
+	++allocator->serverv[server].allocs;
+
+	err = peers_alloc(alloc, peerc);
+	if (err)
+		goto out;
+
+	(void)gettimeofday(&alloc->sent, NULL);
 
 	err = start(alloc);
 	if (err)
@@ -604,14 +1217,192 @@ int allocation_create(struct allocator *allocator, unsigned ix, int proto,
 }
 
 
-int allocation_tx(struct allocation *alloc, struct mbuf *mb)
+/*
+ * Create an allocation without a TURN server, that sends its traffic
+ * directly to dst. This is used by the benchmarks.
+ */
+int allocation_create_direct(struct allocation **allocp,
+			     struct allocator *allocator, unsigned ix,
+			     const struct sa *dst)
+{
+	struct allocation *alloc;
+	int err;
+
+	if (!allocp || !allocator || !dst)
+		return EINVAL;
+
+	if (ix >= allocator->arena_size)
+		return ERANGE;
+
+	alloc = mem_zalloc(sizeof(*alloc), destructor);
+	if (!alloc)
+		return ENOMEM;
+
+	alloc->ix        = ix;
+	alloc->allocator = allocator;
+	alloc->proto     = IPPROTO_UDP;
+	alloc->relay     = *dst;
+	alloc->recv      = &allocator->recvv[ix];
+	alloc->ok        = true;
+
+	receiver_init(alloc->recv, allocator->session_cookie, ix,
+		      &allocator->groupv[0].latency, &allocator->events);
+
+	sa_init(&alloc->laddr, sa_af(dst));
+
+	err = peers_alloc(alloc, 1);
+	if (err)
+		goto out;
+
+	alloc->peerv[0].addr = *dst;
+
+ out:
+	if (err)
+		mem_deref(alloc);
+	else
+		*allocp = alloc;
+
+	return err;
+}
+
+
+int allocation_tx(struct allocation *alloc, unsigned peer, struct mbuf *mb)
 {
 	int err;
 
-	if (!alloc || mbuf_get_left(mb) < 4)
+	if (!alloc || peer >= alloc->peerc || mbuf_get_left(mb) < 4)
+		return EINVAL;
+
+#ifdef USE_IO_URING
+	/* all ring slots in flight, this packet takes the poll path */
+	if (alloc->allocator->uring) {
+		err = uring_send(alloc->allocator->uring,
+				 alloc->peerv[peer].fd,
+				 mbuf_buf(mb), mbuf_get_left(mb),
+				 alloc->sender ? &alloc->sender[peer] : NULL);
+		if (err != EBUSY)
+			return err;
+	}
+#endif
+
+	err = udp_send(alloc->peerv[peer].us, &alloc->relay, mb);
+
+	return err;
+}
+
+
+bool allocation_gso(const struct allocation *alloc)
+{
+	return alloc && alloc->allocator->gso && !alloc->allocator->uring;
+}
+
+
+#ifdef UDP_SEGMENT
+static int udp_gso_send(int fd, const struct sa *dst,
+			uint8_t *buf, size_t len, size_t segsz)
+{
+	char control[CMSG_SPACE(sizeof(uint16_t))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+
+	if (fd < 0)
+		return EBADF;
+
+	iov.iov_base = buf;
+	iov.iov_len  = len;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_name       = (void *)&dst->u.sa;
+	msg.msg_namelen    = dst->len;
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control;
+	msg.msg_controllen = sizeof(control);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type  = UDP_SEGMENT;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+	*(uint16_t *)(void *)CMSG_DATA(cmsg) = (uint16_t)segsz;
+
+	if (0 > sendmsg(fd, &msg, 0))
+		return errno;
+
+	return 0;
+}
+#endif
+
+
+/*
+ * Send a train of equal-size packets to the relay. The kernel splits
+ * the buffer into segsz datagrams if UDP GSO is enabled, otherwise
+ * the packets are sent one by one. The number of packets that were
+ * sent is returned in "sentp", also if an error stopped the train.
+ */
+int allocation_tx_train(struct allocation *alloc, unsigned peer,
+			struct mbuf *mb, size_t segsz, unsigned *sentp)
+{
+	struct allocator *allocator;
+	unsigned sent = 0;
+	size_t end;
+	int err = 0;
+
+	if (!alloc || peer >= alloc->peerc || !segsz ||
+	    mbuf_get_left(mb) < segsz || !sentp)
 		return EINVAL;
 
-	err = udp_send(alloc->us_tx, &alloc->relay, mb);
+	*sentp = 0;
+
+	allocator = alloc->allocator;
+
+#ifdef UDP_SEGMENT
+	if (allocation_gso(alloc)) {
+
+		err = udp_gso_send(udp_sock_fd(alloc->peerv[peer].us,
+					       sa_af(&alloc->relay)),
+				   &alloc->relay, mbuf_buf(mb),
+				   mbuf_get_left(mb), segsz);
+		switch (err) {
+
+		case EINVAL:
+		case EIO:
+		case ENOPROTOOPT:
+		case EOPNOTSUPP:
+			re_fprintf(stderr, "\nUDP GSO send failed (%m),"
+				   " falling back to one send per packet\n",
+				   err);
+			allocator->gso = false;
+			break;
+
+		case 0:
+			*sentp = (unsigned)((mbuf_get_left(mb) + segsz - 1) /
+					    segsz);
+			return 0;
+
+		default:
+			return err;
+		}
+	}
+#endif
+
+	end = mb->end;
+
+	while (mb->pos < end) {
+
+		mb->end = min(mb->pos + segsz, end);
+
+		err = allocation_tx(alloc, peer, mb);
+		if (err)
+			break;
+
+		++sent;
+		mb->pos = mb->end;
+	}
+
+	mb->end = end;
+	*sentp  = sent;
 
 	return err;
 }
@@ -627,73 +1418,198 @@ static void tmr_ui_handler(void *arg)
 
 	tmr_start(&allocator->tmr_ui, 50, tmr_ui_handler, allocator);
 
+	/* a slice of the streams per tick, the view once per second */
+	if (allocator->live) {
+		live_scan(allocator->live, allocator);
+		live_print(allocator->live, allocator, duration);
+		return;
+	}
+
 	re_fprintf(stderr, "\r%c %H", uiv[ uic++ % (sizeof(uiv)-1) ],
 		   fmt_human_time, &duration);
 }
 
 
-static void check_all_senders(struct allocator *allocator)
+void allocator_check_senders(struct allocator *allocator, uint64_t now)
 {
-	uint64_t now = tmr_jiffies();
-	struct le *le;
+	unsigned i;
 
-	for (le = allocator->allocl.head; le; le = le->next) {
-		struct allocation *alloc = le->data;
+	/* flood mode: start the windows that are not clocked yet */
+	if (allocator->flood.window) {
 
-		sender_tick(alloc->sender, now);
+		flood_tick(allocator);
+
+		for (i = 0; i < allocator_streams(allocator); i++) {
+			sender_flood(&allocator->senderv[i],
+				     allocator->recvv[i].max_seq,
+				     allocator->flood.window, now);
+		}
 	}
+	else {
+		/* walk the contiguous sender array, not the allocation list */
+		for (i = 0; i < allocator_streams(allocator); i++) {
+			sender_tick(&allocator->senderv[i], now,
+				    &allocator->slip);
+		}
+	}
+
+#ifdef USE_IO_URING
+	/* one syscall for all packets of this tick */
+	if (allocator->uring)
+		uring_submit(allocator->uring);
+#endif
 }
 
 
 static void tmr_pace_handler(void *arg)
 {
 	struct allocator *allocator = arg;
+	uint64_t start, end;
 
-	check_all_senders(allocator);
+	start = time_usec();
+
+	allocator_check_senders(allocator, start);
+
+	end = time_usec();
+
+	monitor_tick(&allocator->mon, allocator->ts_pace, start, end);
+
+	allocator->ts_pace = end + PACING_INTERVAL_MS * 1000;
 
 	tmr_start(&allocator->tmr_pace, PACING_INTERVAL_MS,
 		  tmr_pace_handler, allocator);
 }
 
 
-int allocator_start_senders(struct allocator *allocator, unsigned bitrate,
-			    size_t psize)
+int allocator_start_senders(struct allocator *allocator)
 {
 	struct le *le;
-	double tbps = allocator->num_allocations * bitrate;
-	unsigned ptime;
+	double tbps = 0;
+	unsigned ptimev[GROUPS_MAX];
+	unsigned i;
 	int err = 0;
 
-	ptime = calculate_ptime(bitrate, psize);
+	for (i = 0; i < allocator->groupc; i++) {
+
+		const struct group *grp = &allocator->groupv[i];
+		double duty = 1.0;
+
+		ptimev[i] = calculate_ptime(grp->bitrate, grp->psize);
+
+		if (grp->off_ms)
+			duty = (double)grp->on_ms / (grp->on_ms + grp->off_ms);
+
+		tbps += duty * grp->count * grp->bitrate;
 
-	re_printf("starting traffic generators:"
-		  " psize=%zu, ptime=%u (total target bitrate is %H)\n",
-		  psize, ptime, print_bitrate, &tbps);
+		if (allocator->groupc > 1) {
+			re_printf("group %s: psize=%zu, ptime=%u,"
+				  " start in %u ms\n", grp->name,
+				  grp->psize, ptimev[i], grp->start_ms);
+		}
+	}
+
+	re_printf("starting traffic generators:");
+	if (allocator->groupc == 1) {
+		re_printf(" psize=%zu, ptime=%u",
+			  allocator->groupv[0].psize, ptimev[0]);
+	}
+	re_printf(" (total target bitrate is %H)\n", print_bitrate, &tbps);
+
+	if (allocator->flood_window) {
+		re_printf("flood mode: unpaced, up to %u packets in flight"
+			  " per stream\n", allocator->flood_window);
+	}
+
+	/* the pacing summary has a requested bitrate only if it is unique */
+	allocator->bitrate = allocator->groupc ? allocator->groupv[0].bitrate
+		: 0;
+	for (i = 1; i < allocator->groupc; i++) {
+		if (allocator->groupv[i].bitrate != allocator->bitrate)
+			allocator->bitrate = 0;
+	}
+
+	hist_reset(&allocator->slip);
+	for (i = 0; i < GROUPS_MAX; i++)
+		hist_reset(&allocator->groupv[i].latency);
+
+	if (allocator->live_view && !allocator->live) {
+		err = live_alloc(&allocator->live, allocator->arena_size);
+		if (err)
+			return err;
+	}
+
+	/* the events must not break up the live view */
+	if (allocator->live) {
+		allocator->events.flushed  = allocator->events.total;
+		allocator->events.deferred = true;
+	}
+
+	stalls_init(&allocator->stalls);
+	flood_init(&allocator->flood, allocator->flood_window);
 
 	tmr_start(&allocator->tmr_ui, 1, tmr_ui_handler, allocator);
 
 	for (le = allocator->allocl.head; le; le = le->next) {
 		struct allocation *alloc = le->data;
+		const struct group *grp = &allocator->groupv[alloc->group];
+		unsigned p;
 
 		if (alloc->sender) {
 			re_fprintf(stderr, "sender already started\n");
 			return EALREADY;
 		}
 
-		err = sender_alloc(&alloc->sender, alloc,
-				   allocator->session_cookie,
-				   alloc->ix, bitrate, ptime, psize);
-		if (err)
-			return err;
+		/* failed for good and torn down, there is no relay */
+		if (!alloc->established)
+			continue;
 
-		err = sender_start(alloc->sender);
-		if (err) {
-			re_fprintf(stderr, "could not start sender (%m)", err);
-			return err;
+		/* one stream per peer, each with its own sequence */
+		for (p = 0; p < alloc->peerc; p++) {
+
+			unsigned s = alloc->ix * alloc->peerc + p;
+			struct sender *snd = &allocator->senderv[s];
+			struct receiver *recv = &allocator->recvv[s];
+
+			err = sender_init(snd, alloc,
+					  allocator->session_cookie, s,
+					  grp->bitrate, ptimev[alloc->group],
+					  grp->psize);
+			if (err)
+				return err;
+
+			snd->peer   = p;
+			snd->ev     = &allocator->events;
+			snd->on_ms  = grp->on_ms;
+			snd->off_ms = grp->off_ms;
+
+			/* an on/off stream is silent by design */
+			if (allocator->stall_ms && !grp->off_ms) {
+				recv->stalls    = &allocator->stalls;
+				recv->stall_min = STALL_PTIMES * snd->ptime;
+				recv->stall_min = max(recv->stall_min,
+						      allocator->stall_ms);
+			}
+
+			/* the warm-up traffic is outside of the window */
+			if (allocator->warmup)
+				receiver_window_stop(recv, 0);
+
+			err = sender_start(snd, grp->start_ms,
+					   !allocator->warmup);
+			if (err) {
+				re_fprintf(stderr, "could not start sender"
+					   " (%m)", err);
+				return err;
+			}
 		}
+
+		alloc->sender = &allocator->senderv[alloc->ix * alloc->peerc];
 	}
 
+	monitor_start(&allocator->mon);
+
 	/* start sending timer/thread */
+	allocator->ts_pace = time_usec() + PACING_INTERVAL_MS * 1000;
 	tmr_start(&allocator->tmr_pace, PACING_INTERVAL_MS,
 		  tmr_pace_handler, allocator);
 
@@ -703,7 +1619,8 @@ int allocator_start_senders(struct allocator *allocator, unsigned bitrate,
 
 void allocator_stop_senders(struct allocator *allocator)
 {
-	struct le *le;
+	uint64_t now = tmr_jiffies();
+	unsigned i;
 
 	if (!allocator)
 		return;
@@ -711,12 +1628,299 @@ void allocator_stop_senders(struct allocator *allocator)
 	tmr_cancel(&allocator->tmr_ui);
 	tmr_cancel(&allocator->tmr_pace);
 
-	for (le = allocator->allocl.head; le; le = le->next) {
-		struct allocation *alloc = le->data;
+	if (allocator->events.deferred) {
+		events_flush(&allocator->events);
+		allocator->events.deferred = false;
+	}
+
+	monitor_stop(&allocator->mon);
+
+	/* streams that received nothing since their last packet */
+	for (i = 0; i < allocator_streams(allocator); i++)
+		receiver_stall_flush(&allocator->recvv[i], now);
+
+	stalls_flush(&allocator->stalls);
+	flood_flush(allocator);
+
+	allocator_measure_stop(allocator);
+}
+
+
+/* restart all counters, traffic keeps flowing */
+void allocator_measure_start(struct allocator *allocator)
+{
+	unsigned i;
+
+	if (!allocator)
+		return;
+
+	for (i = 0; i < allocator_streams(allocator); i++) {
+
+		struct sender *snd = &allocator->senderv[i];
+
+		if (!snd->alloc)
+			continue;
+
+		sender_measure_start(snd);
+		receiver_window_start(&allocator->recvv[i], snd->seq);
+
+		if (snd->peer)
+			continue;
+
+		snd->alloc->drops_start  = sock_drops(snd->alloc);
+		snd->alloc->drops_frozen = false;
+	}
+
+	hist_reset(&allocator->slip);
+	for (i = 0; i < GROUPS_MAX; i++)
+		hist_reset(&allocator->groupv[i].latency);
+}
+
+
+/*
+ * Closing the TURN client sends a Refresh with lifetime zero. The socket
+ * is kept open, to receive the response.
+ */
+static bool dealloc_release(struct allocation *alloc)
+{
+	struct dealloc *d = &alloc->allocator->dealloc;
+
+	if (!alloc->ok || !alloc->turnc || alloc->ts_dealloc)
+		return false;
+
+	tmr_cancel(&alloc->tmr_ping);
+
+	alloc->ts_dealloc = time_usec();
+	alloc->turnc = mem_deref(alloc->turnc);
+
+	++d->pending;
+	++d->n_sent;
+
+	return true;
+}
+
+
+static void tmr_dealloc_handler(void *arg)
+{
+	struct allocator *allocator = arg;
+	struct dealloc *d = &allocator->dealloc;
+	const uint64_t now = time_usec();
+
+	if (d->rate > 0)
+		d->credit += d->rate * DEALLOC_TICK / 1000.0;
+
+	while (d->le && (d->rate <= 0 || d->credit >= 1.0)) {
+
+		struct allocation *alloc = d->le->data;
+
+		d->le = d->le->next;
+
+		if (dealloc_release(alloc) && d->rate > 0)
+			d->credit -= 1.0;
+	}
+
+	if (d->le) {
+		d->ts_last = now;
+	}
+	else {
+		if (!d->ts_deadline)
+			d->ts_deadline = now + DEALLOC_TIMEOUT * 1000;
+
+		if (!d->pending || now >= d->ts_deadline) {
+
+			d->n_timeout = d->pending;
+
+			if (d->doneh)
+				d->doneh(d->arg);
+			return;
+		}
+	}
+
+	tmr_start(&d->tmr, DEALLOC_TICK, tmr_dealloc_handler, allocator);
+}
+
+
+/*
+ * Release all allocations at "rate" per second, or all at once if the
+ * rate is zero, and call doneh when all responses are in.
+ */
+int allocator_dealloc_start(struct allocator *allocator, double rate,
+			    dealloc_h *doneh, void *arg)
+{
+	struct dealloc *d;
+
+	if (!allocator)
+		return EINVAL;
+
+	d = &allocator->dealloc;
+
+	if (d->ts_start)
+		return EALREADY;
+
+	tmr_cancel(&allocator->tmr);
+	hist_reset(&d->latency);
+
+	d->le       = allocator->allocl.head;
+	d->rate     = rate;
+	d->credit   = 1.0;
+	d->ts_start = time_usec();
+	d->doneh    = doneh;
+	d->arg      = arg;
+
+	re_printf("releasing %u allocations (%s)\n", allocator->num_received,
+		  rate > 0 ? "rate-limited" : "all at once");
+
+	tmr_start(&d->tmr, 0, tmr_dealloc_handler, allocator);
+
+	return 0;
+}
+
+
+void allocator_dealloc_print(const struct allocator *allocator)
+{
+	const struct dealloc *d;
+	double duration;
+
+	if (!allocator || !allocator->dealloc.ts_start)
+		return;
+
+	d = &allocator->dealloc;
+
+	duration = d->ts_last > d->ts_start
+		? (d->ts_last - d->ts_start) / 1000.0 : 0;
+
+	re_printf("deallocation summary:\n");
+	re_printf("released:             %u allocations in %.1f ms",
+		  d->n_sent, duration);
+	if (duration > 0)
+		re_printf(" (%.1f per second)", d->n_ok / (duration / 1000.0));
+	re_printf("\n");
+	re_printf("responses:            %u ok, %u failed, %u timed out\n",
+		  d->n_ok, d->n_failed, d->n_timeout);
+	if (d->n_failed) {
+		if (d->last_scode)
+			re_printf("last failure:         %u %s\n",
+				  d->last_scode, d->last_reason);
+		else
+			re_printf("last failure:         %m\n", d->last_err);
+	}
+	re_printf("latency:              %H\n", hist_print, &d->latency);
+	re_printf("\n");
+}
+
+
+/* freeze all counters, traffic keeps flowing */
+void allocator_measure_stop(struct allocator *allocator)
+{
+	unsigned i;
+
+	if (!allocator)
+		return;
+
+	for (i = 0; i < allocator_streams(allocator); i++) {
+
+		struct sender *snd = &allocator->senderv[i];
+
+		if (!snd->alloc)
+			continue;
+
+		/* stopped in the warm-up, the receiver window is closed */
+		if (!snd->measure) {
+			sender_stop(snd);
+			continue;
+		}
+
+		sender_stop(snd);
+		receiver_window_stop(&allocator->recvv[i], snd->seq);
+
+		if (snd->peer)
+			continue;
+
+		snd->alloc->drops_stop   = sock_drops(snd->alloc);
+		snd->alloc->drops_frozen = true;
+	}
+}
+
+
+/*
+ * Count one allocation error per errno or STUN error code, and remember
+ * how far the ramp had come when the error was seen first.
+ */
+void allocator_count_error(struct allocator *allocator, int err,
+			   uint16_t scode, const char *reason)
+{
+	struct alloc_error *ae = NULL;
+	unsigned i;
+
+	if (!allocator)
+		return;
+
+	for (i = 0; i < allocator->errorc; i++) {
+
+		if (allocator->errorv[i].err == err &&
+		    allocator->errorv[i].scode == scode) {
+			ae = &allocator->errorv[i];
+			break;
+		}
+	}
+
+	if (!ae) {
+		if (allocator->errorc >= ARRAY_SIZE(allocator->errorv)) {
+			++allocator->errors_other;
+			return;
+		}
 
-		sender_stop(alloc->sender);
+		ae = &allocator->errorv[allocator->errorc++];
+
+		ae->err        = err;
+		ae->scode      = scode;
+		ae->first_sent = allocator->num_sent;
+		ae->first_ok   = allocator->num_received;
+		ae->first_ms   = tmr_jiffies() - allocator->tick;
+		str_ncpy(ae->reason, reason ? reason : "",
+			 sizeof(ae->reason));
 	}
 
+	++ae->count;
+}
+
+
+static void print_errors(const struct allocator *allocator)
+{
+	unsigned i;
+
+	if (!allocator->errorc && !allocator->errors_other)
+		return;
+
+	re_printf("\nAllocation errors (%u failed, %u retries, %u lost"
+		  " after setup):\n",
+		  allocator->num_failed, allocator->num_retries,
+		  allocator->num_lost);
+
+	for (i = 0; i < allocator->errorc; i++) {
+
+		const struct alloc_error *ae = &allocator->errorv[i];
+
+		if (ae->scode) {
+			re_printf("%u %-28s", ae->scode, ae->reason);
+		}
+		else {
+			char buf[64];
+
+			re_snprintf(buf, sizeof(buf), "%m", ae->err);
+			re_printf("%-32s", buf);
+		}
+
+		re_printf(" %6u times, first after %u ok of %u sent"
+			  " (%.1f s into the ramp)\n",
+			  ae->count, ae->first_ok, ae->first_sent,
+			  ae->first_ms / 1000.0);
+	}
+
+	if (allocator->errors_other) {
+		re_printf("%-32s %6u times\n", "other errors",
+			  allocator->errors_other);
+	}
 }
 
 
@@ -725,6 +1929,7 @@ void allocator_print_statistics(const struct allocator *allocator)
 	struct le *le;
 	double amin = 99999999, amax = 0, asum = 0, aavg;
 	int ix_min = -1, ix_max = -1;
+	unsigned n = 0;
 
 	/* show allocation summary */
 	if (!allocator || !allocator->num_sent)
@@ -734,6 +1939,9 @@ void allocator_print_statistics(const struct allocator *allocator)
 
 		struct allocation *alloc = le->data;
 
+		if (alloc->atime < 0)
+			continue;
+
 		if (alloc->atime < amin) {
 			amin = alloc->atime;
 			ix_min = alloc->ix;
@@ -744,18 +1952,189 @@ void allocator_print_statistics(const struct allocator *allocator)
 		}
 
 		asum += alloc->atime;
+		++n;
 	}
 
-	aavg = asum / allocator->num_sent;
+	if (!n)
+		return;
+
+	aavg = asum / n;
 
 	re_printf("\nAllocation time statistics:\n");
 	re_printf("min: %.1f ms (allocation #%d)\n", amin, ix_min);
 	re_printf("avg: %.1f ms\n", aavg);
 	re_printf("max: %.1f ms (allocation #%d)\n", amax, ix_max);
+	if (allocator->auth.count) {
+		re_printf("auth: %H (%llu challenged)\n",
+			  hist_print, &allocator->auth,
+			  (unsigned long long)allocator->auth.count);
+	}
 	re_printf("\n");
 }
 
 
+/*
+ * Add a named group of allocations with the workload in cfg, the first
+ * group is number 0. There is at least one group.
+ */
+int allocator_group_add(struct allocator *allocator, const char *name,
+			const struct group *cfg)
+{
+	struct group *grp;
+
+	if (!allocator || !name || !cfg)
+		return EINVAL;
+
+	if (allocator->groupc >= GROUPS_MAX)
+		return EOVERFLOW;
+
+	grp = &allocator->groupv[allocator->groupc];
+
+	*grp = *cfg;
+	grp->count = 0;
+	hist_reset(&grp->latency);
+	str_ncpy(grp->name, name, sizeof(grp->name));
+
+	++allocator->groupc;
+
+	return 0;
+}
+
+
+/*
+ * Add a TURN server, or find it if it is known already. A server with
+ * zero weight gets no new allocations, only redirected ones.
+ */
+int allocator_server_add(struct allocator *allocator, const struct sa *addr,
+			 unsigned weight, unsigned *ixp)
+{
+	struct server *srv;
+	unsigned i;
+
+	if (!allocator || !addr)
+		return EINVAL;
+
+	for (i = 0; i < allocator->serverc; i++) {
+
+		if (sa_cmp(&allocator->serverv[i].addr, addr, SA_ALL)) {
+			if (ixp)
+				*ixp = i;
+			return 0;
+		}
+	}
+
+	if (allocator->serverc >= SERVERS_MAX)
+		return EOVERFLOW;
+
+	srv = &allocator->serverv[allocator->serverc];
+
+	memset(srv, 0, sizeof(*srv));
+	srv->addr   = *addr;
+	srv->weight = weight;
+
+	if (ixp)
+		*ixp = allocator->serverc;
+
+	++allocator->serverc;
+
+	return 0;
+}
+
+
+/*
+ * Pick the server for the next allocation, with smooth weighted
+ * round-robin. Without weights every server counts as one.
+ */
+unsigned allocator_server_next(struct allocator *allocator)
+{
+	int total = 0, best = -1;
+	unsigned i;
+
+	if (!allocator)
+		return 0;
+
+	for (i = 0; i < allocator->serverc; i++) {
+
+		struct server *srv = &allocator->serverv[i];
+
+		if (!srv->weight)
+			continue;
+
+		srv->cw += allocator->weighted ? (int)srv->weight : 1;
+		total   += allocator->weighted ? (int)srv->weight : 1;
+
+		if (best < 0 || srv->cw > allocator->serverv[best].cw)
+			best = i;
+	}
+
+	if (best < 0)
+		return 0;
+
+	allocator->serverv[best].cw -= total;
+
+	return best;
+}
+
+
+/* the fan-out bucket of peer number n, 1, 2, 3-4, 5-8, ... */
+unsigned fanout_bucket(unsigned peers)
+{
+	unsigned b = peers <= 1 ? 0 : 32 - __builtin_clz(peers - 1);
+
+	return min(b, FANOUT_BUCKETS - 1);
+}
+
+
+/* the number of senders and receivers in use, one per peer */
+unsigned allocator_streams(const struct allocator *allocator)
+{
+	return allocator->num_sent * max(allocator->peers, 1);
+}
+
+
+/*
+ * Allocate the hot per-stream state up front, as contiguous arrays
+ * sized by the number of allocations times the number of peers.
+ */
+int allocator_arena_alloc(struct allocator *allocator)
+{
+	unsigned n;
+
+	if (!allocator || !allocator->num_allocations)
+		return EINVAL;
+
+	if (allocator->senderv || allocator->recvv)
+		return EALREADY;
+
+	n = allocator->num_allocations * max(allocator->peers, 1);
+
+	allocator->senderv = mem_zalloc(n * sizeof(*allocator->senderv),
+					NULL);
+	allocator->recvv   = mem_zalloc(n * sizeof(*allocator->recvv),
+					NULL);
+	if (!allocator->senderv || !allocator->recvv) {
+		allocator->senderv = mem_deref(allocator->senderv);
+		allocator->recvv   = mem_deref(allocator->recvv);
+		return ENOMEM;
+	}
+
+	/* only for the per-allocation dump, about 400 bytes per stream */
+	if (allocator->dump) {
+		allocator->sketchv =
+			mem_zalloc(n * sizeof(*allocator->sketchv), NULL);
+		if (!allocator->sketchv) {
+			allocator->senderv = mem_deref(allocator->senderv);
+			allocator->recvv   = mem_deref(allocator->recvv);
+			return ENOMEM;
+		}
+	}
+
+	allocator->arena_size = n;
+
+	return 0;
+}
+
+
 void allocator_reset(struct allocator *allocator)
 {
 	if (!allocator)
@@ -764,7 +2143,17 @@ void allocator_reset(struct allocator *allocator)
 	tmr_cancel(&allocator->tmr);
 	tmr_cancel(&allocator->tmr_ui);
 	tmr_cancel(&allocator->tmr_pace);
+	tmr_cancel(&allocator->mon.tmr);
+	tmr_cancel(&allocator->dealloc.tmr);
 	list_flush(&allocator->allocl);
+
+	allocator->senderv = mem_deref(allocator->senderv);
+	allocator->recvv   = mem_deref(allocator->recvv);
+	allocator->sketchv = mem_deref(allocator->sketchv);
+	allocator->arena_size = 0;
+
+	allocator->uring = mem_deref(allocator->uring);
+	allocator->live  = mem_deref(allocator->live);
 }
 
 
@@ -780,52 +2169,669 @@ void allocator_show_summary(const struct allocator *allocator)
 
 		re_printf("timing summary: %u allocations created in %.1f ms"
 			  " (%.1f allocations per second)\n",
-			  allocator->num_sent,
+			  allocator->num_received,
 			  duration,
-			  1.0 * allocator->num_sent / (duration / 1000.0));
+			  1.0 * allocator->num_received / (duration / 1000.0));
+		if (allocator->num_failed) {
+			re_printf("                %u of %u allocations"
+				  " failed\n",
+				  allocator->num_failed, allocator->num_sent);
+		}
 	}
 	else {
 		re_fprintf(stderr, "duration was too short..\n");
 	}
 
-	if (allocator->num_sent)
+	if (allocator->num_received)
 		allocator_print_statistics(allocator);
+
+	print_errors(allocator);
 }
 
 
-void allocator_traffic_summary(struct allocator *allocator)
+static void pacing_summary(const struct allocator *allocator)
+{
+	double rate, rate_sum = 0, rate_min = -1;
+	double slip, slip_sum = 0, slip_worst = 0;
+	uint64_t slip_max = 0, backlog = 0;
+	int ix_min = -1, ix_worst = -1, ix_max = -1;
+	unsigned i, n = 0;
+
+	for (i = 0; i < allocator_streams(allocator); i++) {
+
+		const struct sender *snd = &allocator->senderv[i];
+
+		if (!snd->alloc || !sender_measured(snd))
+			continue;
+
+		rate = sender_get_bitrate(snd);
+		slip = sender_get_slip(snd);
+
+		rate_sum += rate;
+		if (rate_min < 0 || rate < rate_min) {
+			rate_min = rate;
+			ix_min = snd->alloc->ix;
+		}
+
+		slip_sum += slip;
+		if (slip > slip_worst) {
+			slip_worst = slip;
+			ix_worst = snd->alloc->ix;
+		}
+		if (snd->slip_max > slip_max) {
+			slip_max = snd->slip_max;
+			ix_max = snd->alloc->ix;
+		}
+
+		backlog += snd->backlog_ticks;
+		++n;
+	}
+
+	if (!n)
+		return;
+
+	re_printf("pacing summary:\n");
+	if (allocator->bitrate) {
+		re_printf("requested bitrate:    %u bit/s (per allocation)\n",
+			  allocator->bitrate);
+	}
+	re_printf("achieved bitrate:     %.1f bit/s avg,"
+		  " %.1f bit/s min (allocation #%d)\n",
+		  rate_sum / n, rate_min, ix_min);
+	re_printf("scheduling slip:      %H\n", hist_print, &allocator->slip);
+	re_printf("per-sender slip:      %.3f ms avg, worst avg %.3f ms"
+		  " (allocation #%d), worst max %.3f ms (allocation #%d)\n",
+		  slip_sum / n / 1000.0, slip_worst / 1000.0, ix_worst,
+		  slip_max / 1000.0, ix_max);
+	re_printf("ticks with backlog:   %llu\n",
+		  (unsigned long long)backlog);
+	re_printf("\n");
+}
+
+
+static size_t pad4(size_t len)
+{
+	return (4 - (len & 3)) & 3;
+}
+
+
+/*
+ * Estimated bytes on the wire per packet, on top of the turnperf packet,
+ * at the IP level. tx is from a peer to the relayed address, which is
+ * plain UDP. rx is from the TURN server to the client, with the TURN
+ * framing and the headers of the transport. TCP segments are assumed
+ * to carry one packet each, so TCP and TLS are upper bounds.
+ */
+static void wire_overhead(const struct allocation *alloc, size_t psize,
+			  size_t *tx, size_t *rx)
+{
+	bool ip6_peer = sa_af(&alloc->relay) == AF_INET6;
+	bool tcp = alloc->proto == IPPROTO_TCP;
+	size_t turn;
+
+	*tx = (ip6_peer ? IP6_HDR : IP4_HDR) + UDP_HDR;
+
+	if (alloc->turn_ind) {
+		/* XOR-PEER-ADDRESS and DATA attributes */
+		turn = STUN_HDR +
+			STUN_ATTR_HDR + (ip6_peer ? 20 : 8) +
+			STUN_ATTR_HDR + pad4(psize);
+	}
+	else {
+		/* ChannelData is padded to 4 bytes over TCP only */
+		turn = CHANDATA_HDR + (tcp ? pad4(psize) : 0);
+	}
+
+	*rx = (sa_af(&alloc->srv) == AF_INET6 ? IP6_HDR : IP4_HDR) +
+		(tcp ? TCP_HDR : UDP_HDR) + turn;
+
+	if (alloc->secure)
+		*rx += tcp ? TLS_REC : DTLS_REC;
+}
+
+
+static struct wire_result *wire_entry(struct result *res,
+				      const struct allocation *alloc)
+{
+	const char *proto = protocol_name(alloc->proto, alloc->secure);
+	struct wire_result *wr;
+	unsigned i;
+
+	for (i = 0; i < res->wirec; i++) {
+
+		wr = &res->wirev[i];
+
+		if (wr->turn_ind == alloc->turn_ind &&
+		    0 == str_cmp(wr->protocol, proto))
+			return wr;
+	}
+
+	if (res->wirec >= ARRAY_SIZE(res->wirev))
+		return NULL;
+
+	wr = &res->wirev[res->wirec++];
+
+	memset(wr, 0, sizeof(*wr));
+	wr->protocol = proto;
+	wr->turn_ind = alloc->turn_ind;
+
+	return wr;
+}
+
+
+/*
+ * Collect the measured results of a run. The configuration part of
+ * the result is left to the caller.
+ */
+void allocator_get_result(const struct allocator *allocator,
+			  struct result *res)
 {
-	size_t total_sent = 0;
-	size_t total_recv = 0;
-	double total_send_bitrate = 0;
-	double total_recv_bitrate = 0;
-	ssize_t lost;
 	struct le *le;
+	unsigned i;
+
+	if (!allocator || !res)
+		return;
 
+	res->allocs_ok = allocator->num_received;
+	res->allocs_failed = allocator->num_failed;
+	res->alloc_duration = allocator->tock > allocator->tick
+		? (double)(allocator->tock - allocator->tick) : 0;
+
+	hist_reset(&res->atime);
 	for (le = allocator->allocl.head; le; le = le->next) {
 
-		struct allocation *alloc = le->data;
+		const struct allocation *alloc = le->data;
+
+		if (alloc->atime > 0)
+			hist_add(&res->atime, (uint64_t)(alloc->atime * 1000));
+	}
+
+	res->sent = res->recv = res->txdrop = res->rxdrop = 0;
+	res->send_bitrate = res->recv_bitrate = 0;
+	res->send_wire = res->recv_wire = 0;
+	res->wirec = 0;
+
+	res->groupc = allocator->groupc > 1 ? allocator->groupc : 0;
+	for (i = 0; i < res->groupc; i++) {
+
+		struct group_result *gr = &res->groupv[i];
+
+		memset(gr, 0, sizeof(*gr));
+		gr->name     = allocator->groupv[i].name;
+		gr->protocol = protocol_name(allocator->groupv[i].proto,
+					     allocator->groupv[i].secure);
+		gr->bitrate  = allocator->groupv[i].bitrate;
+		gr->psize    = allocator->groupv[i].psize;
+		gr->turn_ind = allocator->groupv[i].turn_ind;
+		gr->latency  = allocator->groupv[i].latency;
+	}
+
+	res->serverc = allocator->serverc > 1 ? allocator->serverc : 0;
+	for (i = 0; i < res->serverc; i++) {
+
+		struct server_result *sr = &res->serverv[i];
+
+		memset(sr, 0, sizeof(*sr));
+		sr->srv = &allocator->serverv[i];
+	}
+
+	/* streams by peer number, in the buckets of the setup times */
+	res->peers   = max(allocator->peers, 1);
+	res->fanoutc = res->peers > 1 ? fanout_bucket(res->peers) + 1 : 0;
+	for (i = 0; i < res->fanoutc; i++) {
+
+		struct fanout_result *fr = &res->fanoutv[i];
+
+		memset(fr, 0, sizeof(*fr));
+		fr->lo    = i ? (1u << (i - 1)) + 1 : 1;
+		fr->hi    = min(1u << i, res->peers);
+		fr->setup = allocator->fanout_setup[i];
+	}
 
-		if (!alloc->ok || !alloc->sender)
+	hist_reset(&res->latency);
+	for (i = 0; i < allocator->groupc; i++)
+		hist_merge(&res->latency, &allocator->groupv[i].latency);
+
+	for (i = 0; i < allocator_streams(allocator); i++) {
+
+		const struct sender *snd = &allocator->senderv[i];
+		const struct receiver *recv = &allocator->recvv[i];
+		struct group_result *gr;
+		struct wire_result *wr;
+		double send_wire, recv_wire;
+		size_t tx, rx;
+
+		/* only established allocations have a sender */
+		if (!snd->alloc)
 			continue;
 
-		total_sent    += sender_get_packets(alloc->sender);
-		total_recv    += alloc->recv.total_packets;
+		/* all packets of a stream have the same size */
+		wire_overhead(snd->alloc, snd->psize, &tx, &rx);
+
+		send_wire = sender_get_bitrate(snd) *
+			(double)(snd->psize + tx) / (double)snd->psize;
+		recv_wire = receiver_get_bitrate(recv) *
+			(double)(snd->psize + rx) / (double)snd->psize;
+
+		res->send_wire += send_wire;
+		res->recv_wire += recv_wire;
+
+		wr = wire_entry(res, snd->alloc);
+		if (wr) {
+			++wr->streams;
+			wr->send_bitrate += sender_get_bitrate(snd);
+			wr->send_wire    += send_wire;
+			wr->recv_bitrate += receiver_get_bitrate(recv);
+			wr->recv_wire    += recv_wire;
+		}
+
+		res->sent    += sender_get_packets(snd);
+		res->recv    += recv->total_packets;
+		res->txdrop  += sender_get_drops(snd);
+		if (!snd->peer)
+			res->rxdrop += rx_drops(snd->alloc);
+
+		res->send_bitrate += sender_get_bitrate(snd);
+		res->recv_bitrate += receiver_get_bitrate(recv);
+
+		if (snd->alloc->srvix < res->serverc) {
+
+			struct server_result *sr;
+
+			sr = &res->serverv[snd->alloc->srvix];
+
+			sr->sent         += sender_get_packets(snd);
+			sr->recv         += recv->total_packets;
+			sr->recv_bitrate += receiver_get_bitrate(recv);
+		}
+
+		if (res->fanoutc) {
+
+			struct fanout_result *fr;
+
+			fr = &res->fanoutv[fanout_bucket(snd->peer + 1)];
+
+			++fr->streams;
+			fr->sent         += sender_get_packets(snd);
+			fr->recv         += recv->total_packets;
+			fr->recv_bitrate += receiver_get_bitrate(recv);
+		}
+
+		if (snd->alloc->group >= res->groupc)
+			continue;
+
+		gr = &res->groupv[snd->alloc->group];
+
+		if (!snd->peer)
+			++gr->allocs;
+		gr->sent         += sender_get_packets(snd);
+		gr->recv         += recv->total_packets;
+		gr->send_bitrate += sender_get_bitrate(snd);
+		gr->recv_bitrate += receiver_get_bitrate(recv);
+		gr->pps          += receiver_get_pps(recv);
+	}
+
+	res->slip    = allocator->slip;
+	memcpy(res->eventv, allocator->events.countv, sizeof(res->eventv));
+	res->stall_events = allocator->stalls.total;
+	res->stall_gaps   = allocator->stalls.gaps;
+	res->stall_max    = allocator->stalls.gap_max;
+	res->stall_flows  = allocator->stalls.worst.flows;
+
+	flood_get_result(&allocator->flood, res);
+	res->auth    = allocator->auth;
+
+	res->hs_full    = allocator->hs_tls.full;
+	res->hs_resumed = allocator->hs_tls.resumed;
+	hist_merge(&res->hs_full, &allocator->hs_dtls.full);
+	hist_merge(&res->hs_resumed, &allocator->hs_dtls.resumed);
+
+	res->dealloc_ok     = allocator->dealloc.n_ok;
+	res->dealloc_failed = allocator->dealloc.n_failed +
+		allocator->dealloc.n_timeout;
+	res->dealloc_duration = allocator->dealloc.ts_last >
+		allocator->dealloc.ts_start
+		? (allocator->dealloc.ts_last -
+		   allocator->dealloc.ts_start) / 1000.0 : 0;
+	res->dealloc = allocator->dealloc.latency;
+}
+
 
-		total_send_bitrate += sender_get_bitrate(alloc->sender);
-		total_recv_bitrate += receiver_get_bitrate(&alloc->recv);
+static void group_summary(const struct result *res)
+{
+	unsigned i;
+
+	if (!res->groupc)
+		return;
+
+	re_printf("group summary:\n");
+	re_printf("%-16s %-5s %7s %14s %14s %9s %7s %9s %9s\n",
+		  "group", "proto", "allocs", "send", "recv", "pps", "loss",
+		  "lat p50", "lat p99");
+
+	for (i = 0; i < res->groupc; i++) {
+
+		const struct group_result *gr = &res->groupv[i];
+		double loss = 0;
+		char send[32], recv[32];
+
+		if (gr->sent)
+			loss = 100.0 * ((double)gr->sent - (double)gr->recv) /
+				(double)gr->sent;
+
+		re_snprintf(send, sizeof(send), "%H",
+			    print_bitrate, &gr->send_bitrate);
+		re_snprintf(recv, sizeof(recv), "%H",
+			    print_bitrate, &gr->recv_bitrate);
+
+		re_printf("%-16s %-5s %7u %14s %14s %9.1f %6.2f%% %6.3f ms"
+			  " %6.3f ms\n",
+			  gr->name, gr->protocol, gr->allocs, send, recv,
+			  gr->pps, loss,
+			  hist_percentile(&gr->latency, 50) / 1000.0,
+			  hist_percentile(&gr->latency, 99) / 1000.0);
+	}
+
+	re_printf("\n");
+}
+
+
+static void server_summary(const struct result *res)
+{
+	unsigned i;
+
+	if (!res->serverc)
+		return;
+
+	re_printf("server summary:\n");
+	re_printf("%-24s %6s %7s %7s %7s %7s %9s %9s %14s %7s\n",
+		  "server", "weight", "allocs", "ok", "failed", "redir",
+		  "redir-in", "atime p50", "recv", "loss");
+
+	for (i = 0; i < res->serverc; i++) {
+
+		const struct server_result *sr = &res->serverv[i];
+		const struct server *srv = sr->srv;
+		double loss = 0;
+		char addr[64], recv[32];
+
+		if (sr->sent)
+			loss = 100.0 * ((double)sr->sent - (double)sr->recv) /
+				(double)sr->sent;
+
+		re_snprintf(addr, sizeof(addr), "%J", &srv->addr);
+		re_snprintf(recv, sizeof(recv), "%H",
+			    print_bitrate, &sr->recv_bitrate);
+
+		re_printf("%-24s %6u %7u %7u %7u %7u %9u %6.1f ms %14s"
+			  " %6.2f%%\n",
+			  addr, srv->weight, srv->allocs, srv->ok,
+			  srv->failed + srv->lost, srv->redirects,
+			  srv->redirected,
+			  hist_percentile(&srv->atime, 50) / 1000.0,
+			  recv, loss);
 	}
 
-	lost = total_sent - total_recv;
+	re_printf("\n");
+}
+
+
+static double overhead(double good, double wire)
+{
+	return good > 0 ? 100.0 * (wire - good) / good : 0;
+}
+
+
+/*
+ * Goodput is the turnperf packets, the wire bitrate is an estimate at
+ * the IP level, to compare with interface counters
+ */
+static void wire_summary(const struct result *res)
+{
+	unsigned i;
+
+	if (!res->wirec)
+		return;
+
+	re_printf("wire summary (goodput and estimated IP-level"
+		  " bitrate):\n");
+	re_printf("%-5s %-11s %14s %14s %8s %14s %14s %8s\n",
+		  "proto", "framing", "send", "send wire", "ovh",
+		  "recv", "recv wire", "ovh");
+
+	for (i = 0; i < res->wirec; i++) {
+
+		const struct wire_result *wr = &res->wirev[i];
+		char sg[32], sw[32], rg[32], rw[32];
+
+		re_snprintf(sg, sizeof(sg), "%H",
+			    print_bitrate, &wr->send_bitrate);
+		re_snprintf(sw, sizeof(sw), "%H",
+			    print_bitrate, &wr->send_wire);
+		re_snprintf(rg, sizeof(rg), "%H",
+			    print_bitrate, &wr->recv_bitrate);
+		re_snprintf(rw, sizeof(rw), "%H",
+			    print_bitrate, &wr->recv_wire);
+
+		re_printf("%-5s %-11s %14s %14s %7.1f%% %14s %14s %7.1f%%\n",
+			  wr->protocol,
+			  wr->turn_ind ? "indication" : "channel",
+			  sg, sw, overhead(wr->send_bitrate, wr->send_wire),
+			  rg, rw, overhead(wr->recv_bitrate, wr->recv_wire));
+	}
+
+	re_printf("\n");
+}
+
+
+/*
+ * Fan-out: the setup time of the n-th permission or channel of an
+ * allocation, and the traffic of the n-th stream, in buckets of n
+ */
+static void fanout_summary(const struct result *res)
+{
+	unsigned i;
+
+	if (!res->fanoutc)
+		return;
+
+	re_printf("fanout summary (%u peers per allocation):\n", res->peers);
+	re_printf("%-9s %7s %9s %9s %14s %7s\n",
+		  "peers", "streams", "setup p50", "setup p99", "recv",
+		  "loss");
+
+	for (i = 0; i < res->fanoutc; i++) {
+
+		const struct fanout_result *fr = &res->fanoutv[i];
+		double loss = 0;
+		char peers[16], recv[32];
+
+		if (fr->sent)
+			loss = 100.0 * ((double)fr->sent - (double)fr->recv) /
+				(double)fr->sent;
+
+		if (fr->lo == fr->hi)
+			re_snprintf(peers, sizeof(peers), "%u", fr->lo);
+		else
+			re_snprintf(peers, sizeof(peers), "%u-%u",
+				    fr->lo, fr->hi);
+
+		re_snprintf(recv, sizeof(recv), "%H",
+			    print_bitrate, &fr->recv_bitrate);
+
+		re_printf("%-9s %7u %6.1f ms %6.1f ms %14s %6.2f%%\n",
+			  peers, fr->streams,
+			  hist_percentile(&fr->setup, 50) / 1000.0,
+			  hist_percentile(&fr->setup, 99) / 1000.0,
+			  recv, loss);
+	}
+
+	re_printf("\n");
+}
+
+
+void allocator_traffic_summary(struct allocator *allocator)
+{
+	struct result *res;
+	int64_t lost, srv_lost;
+	double total;
+
+	res = mem_zalloc(sizeof(*res), NULL);
+	if (!res)
+		return;
+
+	allocator_get_result(allocator, res);
+
+	lost = (int64_t)res->sent - (int64_t)res->recv;
+
+	/* packets dropped by our own receive queues are not server loss */
+	srv_lost = lost - (int64_t)res->rxdrop;
+
+	total = res->sent ? (double)res->sent : 1.0;
 
 	re_printf("traffic summary:\n");
 	re_printf("total send bitrate:   %H\n",
-		  print_bitrate, &total_send_bitrate);
+		  print_bitrate, &res->send_bitrate);
 	re_printf("total recv bitrate:   %H\n",
-		  print_bitrate, &total_recv_bitrate);
-	re_printf("total sent:           %zu packets\n", total_sent);
-	re_printf("total received:       %zu packets\n", total_recv);
-	re_printf("lost packets:         %zu packets (%.2f%% loss)\n",
-		  lost, 100.0 * lost / total_sent);
+		  print_bitrate, &res->recv_bitrate);
+	re_printf("wire send bitrate:    %H (estimated)\n",
+		  print_bitrate, &res->send_wire);
+	re_printf("wire recv bitrate:    %H (estimated)\n",
+		  print_bitrate, &res->recv_wire);
+	re_printf("total sent:           %llu packets\n",
+		  (unsigned long long)res->sent);
+	re_printf("total received:       %llu packets\n",
+		  (unsigned long long)res->recv);
+	re_printf("lost packets:         %lld packets (%.2f%% loss)\n",
+		  (long long)lost, 100.0 * lost / total);
+	re_printf("client tx drops:      %llu packets (not sent)\n",
+		  (unsigned long long)res->txdrop);
+	re_printf("client rx drops:      %llu packets\n",
+		  (unsigned long long)res->rxdrop);
+	re_printf("server loss:          %lld packets (%.2f%% loss)\n",
+		  (long long)srv_lost, 100.0 * srv_lost / total);
+	re_printf("latency:              %H\n", hist_print, &res->latency);
 	re_printf("\n");
+
+	if (res->txdrop || res->rxdrop) {
+		re_printf("warning: the client dropped packets in its own"
+			  " socket buffers, increase them with -B\n");
+	}
+
+	wire_summary(res);
+	group_summary(res);
+	server_summary(res);
+	fanout_summary(res);
+	pacing_summary(allocator);
+
+	mem_deref(res);
+}
+
+
+static void dump_stream(const struct allocator *allocator,
+			const struct allocation *alloc, unsigned peer,
+			struct dump_record *rec)
+{
+	unsigned s = alloc->ix * max(allocator->peers, 1) + peer;
+	const struct sender *snd = &allocator->senderv[s];
+	const struct receiver *recv = &allocator->recvv[s];
+	uint64_t got;
+
+	memset(rec, 0, sizeof(*rec));
+
+	rec->ix         = alloc->ix;
+	rec->peer       = peer;
+	rec->group      = alloc->group;
+	rec->group_name = allocator->groupv[alloc->group].name;
+	rec->err        = alloc->err;
+	rec->scode      = alloc->scode;
+	rec->proto      = alloc->proto;
+	rec->secure     = alloc->secure;
+	rec->turn_ind   = alloc->turn_ind;
+	rec->srv        = alloc->srv;
+	rec->relay      = alloc->relay;
+	rec->atime      = alloc->atime;
+	rec->auth       = alloc->auth;
+	rec->retries    = alloc->retries;
+	rec->redirects  = alloc->redirc;
+
+	if (alloc->failed)
+		rec->state = alloc->established ? DUMP_LOST : DUMP_FAILED;
+	else
+		rec->state = alloc->established ? DUMP_OK : DUMP_PENDING;
+
+	if (peer < alloc->peerc)
+		rec->setup = alloc->peerv[peer].setup;
+
+	/* the arena entry is only valid if this allocation sent */
+	if (snd->alloc != alloc)
+		return;
+
+	got = recv->total_packets - min(recv->dups, recv->total_packets);
+
+	rec->sent      = sender_get_packets(snd);
+	rec->recv      = recv->total_packets;
+	rec->lost      = rec->sent > got ? rec->sent - got : 0;
+	rec->dups      = recv->dups;
+	rec->reordered = recv->reordered;
+	rec->txdrop    = sender_get_drops(snd);
+
+	rec->send_bitrate = max(sender_get_bitrate(snd), .0);
+	if (recv->ts_last > recv->ts_start)
+		rec->recv_bitrate = receiver_get_bitrate(recv);
+
+	rec->lat_avg = receiver_get_latency(recv) / 1000.0;
+	rec->lat_max = recv->lat_max / 1000.0;
+
+	if (recv->sk) {
+		rec->lat_p50 = min(sketch_percentile(recv->sk, 50),
+				   recv->lat_max) / 1000.0;
+		rec->lat_p99 = min(sketch_percentile(recv->sk, 99),
+				   recv->lat_max) / 1000.0;
+	}
+}
+
+
+/*
+ * Write one record per stream of every allocation, including the ones
+ * that failed. The records are streamed to the file, one at a time.
+ */
+int allocator_dump(const struct allocator *allocator, const char *path)
+{
+	struct dump_record rec;
+	struct dump *d = NULL;
+	struct le *le;
+	int err;
+
+	if (!allocator || !path)
+		return EINVAL;
+
+	err = dump_open(&d, path);
+	if (err)
+		return err;
+
+	for (le = list_head(&allocator->allocl); le; le = le->next) {
+
+		const struct allocation *alloc = le->data;
+		unsigned i, peerc = max(allocator->peers, 1);
+
+		for (i = 0; i < peerc; i++) {
+
+			dump_stream(allocator, alloc, i, &rec);
+
+			err = dump_write(d, &rec);
+			if (err) {
+				re_fprintf(stderr, "could not write dump"
+					   " file %s: %m\n", path, err);
+				goto out;
+			}
+		}
+	}
+
+	err = dump_close(d);
+
+ out:
+	mem_deref(d);
+
+	return err;
 }
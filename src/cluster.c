@@ -0,0 +1,320 @@
+/**
+ * @file cluster.c TURN server clusters
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include "turnperf.h"
+
+
+/*
+ * Cluster:
+ *
+ * - an explicit list of servers, "addr[:port][=weight],..."
+ * - or every server in DNS: all SRV records of the domain, and all
+ *   A records of each SRV target. Without SRV records, all A records
+ *   of the domain are used
+ * - the SRV weight is the weight of a server
+ */
+
+
+enum {
+	TARGETS_MAX = SERVERS_MAX,
+};
+
+struct target {
+	struct cluster *cl;
+	struct dns_query *q;
+	uint16_t port;
+	unsigned weight;
+};
+
+struct cluster {
+	struct allocator *allocator;
+	struct dnsc *dnsc;
+	struct dns_query *q_srv;
+	struct target targetv[TARGETS_MAX];
+	unsigned targetc;
+	unsigned pending;
+	char host[256];
+	uint16_t dport;
+	cluster_h *h;
+	void *arg;
+};
+
+
+static void destructor(void *arg)
+{
+	struct cluster *cl = arg;
+	unsigned i;
+
+	mem_deref(cl->q_srv);
+
+	for (i = 0; i < cl->targetc; i++)
+		mem_deref(cl->targetv[i].q);
+}
+
+
+static void server_add(struct cluster *cl, const struct dnsrr *rr,
+		       uint16_t port, unsigned weight)
+{
+	struct sa addr;
+	int err;
+
+	sa_set_in(&addr, rr->rdata.a.addr, port);
+
+	err = allocator_server_add(cl->allocator, &addr, weight, NULL);
+	if (err == EOVERFLOW) {
+		re_fprintf(stderr, "cluster: too many servers, %J is not"
+			   " used (max %u)\n", &addr, SERVERS_MAX);
+	}
+}
+
+
+static void done(struct cluster *cl)
+{
+	if (cl->pending)
+		return;
+
+	if (!cl->allocator->serverc) {
+		re_fprintf(stderr, "cluster: no servers found for %s\n",
+			   cl->host);
+		cl->h(ENOENT, cl->arg);
+		return;
+	}
+
+	cl->h(0, cl->arg);
+}
+
+
+static void a_handler(int err, const struct dnshdr *hdr, struct list *ansl,
+		      struct list *authl, struct list *addl, void *arg)
+{
+	struct target *tg = arg;
+	struct le *le;
+	(void)hdr;
+	(void)authl;
+	(void)addl;
+
+	if (err) {
+		re_fprintf(stderr, "cluster: A query failed (%m)\n", err);
+	}
+
+	for (le = list_head(ansl); le; le = le->next) {
+
+		const struct dnsrr *rr = le->data;
+
+		if (rr->type == DNS_TYPE_A)
+			server_add(tg->cl, rr, tg->port, tg->weight);
+	}
+
+	--tg->cl->pending;
+	done(tg->cl);
+}
+
+
+static int query_a(struct cluster *cl, const char *name, uint16_t port,
+		   unsigned weight)
+{
+	struct target *tg;
+	int err;
+
+	if (cl->targetc >= TARGETS_MAX)
+		return EOVERFLOW;
+
+	tg = &cl->targetv[cl->targetc];
+
+	tg->cl     = cl;
+	tg->port   = port;
+	tg->weight = weight;
+
+	err = dnsc_query(&tg->q, cl->dnsc, name, DNS_TYPE_A, DNS_CLASS_IN,
+			 true, a_handler, tg);
+	if (err)
+		return err;
+
+	++cl->targetc;
+	++cl->pending;
+
+	return 0;
+}
+
+
+/* the A records of an SRV target, from the additional section */
+static bool add_glue(struct cluster *cl, struct list *addl,
+		     const char *target, uint16_t port, unsigned weight)
+{
+	struct le *le;
+	bool found = false;
+
+	for (le = list_head(addl); le; le = le->next) {
+
+		const struct dnsrr *rr = le->data;
+
+		if (rr->type != DNS_TYPE_A ||
+		    0 != str_casecmp(rr->name, target))
+			continue;
+
+		server_add(cl, rr, port, weight);
+		found = true;
+	}
+
+	return found;
+}
+
+
+static void srv_handler(int err, const struct dnshdr *hdr, struct list *ansl,
+			struct list *authl, struct list *addl, void *arg)
+{
+	struct cluster *cl = arg;
+	struct le *le;
+	unsigned n = 0;
+	(void)hdr;
+	(void)authl;
+
+	for (le = list_head(ansl); !err && le; le = le->next) {
+
+		const struct dnsrr *rr = le->data;
+		unsigned weight;
+
+		if (rr->type != DNS_TYPE_SRV)
+			continue;
+
+		++n;
+
+		weight = max(rr->rdata.srv.weight, 1);
+
+		re_printf("cluster: SRV %s:%u weight=%u\n",
+			  rr->rdata.srv.target, rr->rdata.srv.port, weight);
+
+		if (add_glue(cl, addl, rr->rdata.srv.target,
+			     rr->rdata.srv.port, weight))
+			continue;
+
+		if (query_a(cl, rr->rdata.srv.target, rr->rdata.srv.port,
+			    weight)) {
+			re_fprintf(stderr, "cluster: could not resolve %s\n",
+				   rr->rdata.srv.target);
+		}
+	}
+
+	/* no SRV records, use all addresses of the domain */
+	if (!n) {
+		err = query_a(cl, cl->host, cl->dport, 1);
+		if (err) {
+			cl->h(err, cl->arg);
+			return;
+		}
+	}
+
+	done(cl);
+}
+
+
+/*
+ * Parse a comma-separated list of servers, "addr[:port][=weight]".
+ * The port is dport if not given, and the weight is 1.
+ */
+int cluster_parse(struct allocator *allocator, const char *str,
+		  uint16_t dport)
+{
+	struct pl pl, entry, addr, weight;
+	int err;
+
+	if (!allocator || !str)
+		return EINVAL;
+
+	pl_set_str(&pl, str);
+
+	while (0 == re_regex(pl.p, pl.l, "[^,]+", &entry)) {
+
+		struct sa sa;
+		unsigned w = 1;
+
+		pl.l -= entry.p + entry.l - pl.p;
+		pl.p  = entry.p + entry.l;
+
+		if (0 == re_regex(entry.p, entry.l, "[^=]+=[0-9]+",
+				  &addr, &weight)) {
+			w = pl_u32(&weight);
+		}
+		else {
+			addr = entry;
+		}
+
+		if (sa_decode(&sa, addr.p, addr.l) &&
+		    sa_set(&sa, &addr, dport)) {
+			re_fprintf(stderr, "invalid server address '%r'\n",
+				   &addr);
+			return EINVAL;
+		}
+
+		if (!w) {
+			re_fprintf(stderr, "server %J has no weight\n", &sa);
+			return EINVAL;
+		}
+
+		err = allocator_server_add(allocator, &sa, w, NULL);
+		if (err == EOVERFLOW) {
+			re_fprintf(stderr, "too many servers (max %u)\n",
+				   SERVERS_MAX);
+		}
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Find all servers of a domain in DNS, and add them to the allocator.
+ * With an explicit port only the A records of the domain are used.
+ */
+int cluster_discover(struct cluster **clp, struct dnsc *dnsc,
+		     struct allocator *allocator, const char *usage,
+		     const char *proto, const char *host, uint16_t port,
+		     uint16_t dport, cluster_h *h, void *arg)
+{
+	struct cluster *cl;
+	char name[256];
+	int err;
+
+	if (!clp || !dnsc || !allocator || !usage || !proto || !host || !h)
+		return EINVAL;
+
+	cl = mem_zalloc(sizeof(*cl), destructor);
+	if (!cl)
+		return ENOMEM;
+
+	cl->allocator = allocator;
+	cl->dnsc      = dnsc;
+	cl->dport     = port ? port : dport;
+	cl->h         = h;
+	cl->arg       = arg;
+	str_ncpy(cl->host, host, sizeof(cl->host));
+
+	if (port) {
+		err = query_a(cl, host, port, 1);
+		goto out;
+	}
+
+	if (re_snprintf(name, sizeof(name), "_%s._%s.%s",
+			usage, proto, host) < 0) {
+		err = ENAMETOOLONG;
+		goto out;
+	}
+
+	err = dnsc_query(&cl->q_srv, dnsc, name, DNS_TYPE_SRV, DNS_CLASS_IN,
+			 true, srv_handler, cl);
+
+ out:
+	if (err)
+		mem_deref(cl);
+	else
+		*clp = cl;
+
+	return err;
+}
@@ -0,0 +1,322 @@
+/**
+ * @file cred.c Per-allocation TURN credentials
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <re.h>
+#include "turnperf.h"
+
+
+/*
+ * Credentials:
+ *
+ * - a username or password with "%u" is a pattern, and %u is replaced
+ *   by the allocation number, e.g. "user%u" gives user0, user1, ...
+ * - or a credentials file with one "user:password" per line, that is
+ *   used round-robin by the allocations
+ * - with a shared secret, the credentials are time-limited ones of the
+ *   TURN REST API: the username is "<expiry>:<user>" and the password
+ *   is base64(HMAC-SHA1(secret, username))
+ */
+
+
+enum {
+	FILE_MAX = 64 * 1024 * 1024,
+};
+
+struct cred_entry {
+	struct pl user;
+	struct pl pass;
+};
+
+struct creds {
+	struct mbuf *mb;              /* the credentials file */
+	struct cred_entry *entryv;
+	unsigned entryc;
+	const char *secret;           /* TURN REST shared secret */
+	uint32_t ttl;                 /* TURN REST lifetime [s] */
+};
+
+
+static void destructor(void *arg)
+{
+	struct creds *creds = arg;
+
+	mem_deref(creds->entryv);
+	mem_deref(creds->mb);
+}
+
+
+static int file_read(struct mbuf *mb, const char *path)
+{
+	uint8_t buf[4096];
+	size_t n;
+	FILE *f;
+	int err = 0;
+
+	f = fopen(path, "r");
+	if (!f)
+		return errno;
+
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+
+		if (mb->end + n > FILE_MAX) {
+			err = EFBIG;
+			break;
+		}
+
+		err = mbuf_write_mem(mb, buf, n);
+		if (err)
+			break;
+	}
+
+	if (!err && ferror(f))
+		err = EIO;
+
+	(void)fclose(f);
+
+	return err;
+}
+
+
+static void pl_strip(struct pl *pl)
+{
+	while (pl->l && (pl->p[0] == ' ' || pl->p[0] == '\t')) {
+		++pl->p;
+		--pl->l;
+	}
+
+	while (pl->l && (pl->p[pl->l - 1] == ' ' ||
+			 pl->p[pl->l - 1] == '\t' ||
+			 pl->p[pl->l - 1] == '\r'))
+		--pl->l;
+}
+
+
+/* one "user:password" per line, empty lines and comments are skipped */
+static int file_parse(struct creds *creds, const char *path)
+{
+	const char *p = (const char *)creds->mb->buf;
+	const char *end = p + creds->mb->end;
+	unsigned n = 1, lineno = 0;
+	const char *q;
+
+	for (q = p; q < end; q++) {
+		if (*q == '\n')
+			++n;
+	}
+
+	creds->entryv = mem_zalloc(n * sizeof(*creds->entryv), NULL);
+	if (!creds->entryv)
+		return ENOMEM;
+
+	while (p < end) {
+
+		struct pl line, user, pass;
+		const char *sep;
+
+		for (q = p; q < end && *q != '\n'; q++)
+			;
+
+		line.p = p;
+		line.l = q - p;
+		p = q + 1;
+		++lineno;
+
+		pl_strip(&line);
+
+		if (!line.l || line.p[0] == '#')
+			continue;
+
+		sep = pl_strchr(&line, ':');
+		if (!sep || sep == line.p || sep == line.p + line.l - 1) {
+			re_fprintf(stderr, "credentials: %s:%u: expected"
+				   " user:password\n", path, lineno);
+			return EINVAL;
+		}
+
+		user.p = line.p;
+		user.l = sep - line.p;
+		pass.p = sep + 1;
+		pass.l = line.l - user.l - 1;
+
+		creds->entryv[creds->entryc].user = user;
+		creds->entryv[creds->entryc].pass = pass;
+		++creds->entryc;
+	}
+
+	if (!creds->entryc) {
+		re_fprintf(stderr, "credentials: no users in %s\n", path);
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Load the credentials file (optional), and remember the TURN REST
+ * shared secret (optional). The secret must outlive the credentials.
+ */
+int creds_alloc(struct creds **credsp, const char *path, const char *secret,
+		uint32_t ttl)
+{
+	struct creds *creds;
+	int err = 0;
+
+	if (!credsp)
+		return EINVAL;
+
+	creds = mem_zalloc(sizeof(*creds), destructor);
+	if (!creds)
+		return ENOMEM;
+
+	creds->secret = secret;
+	creds->ttl    = ttl;
+
+	if (path) {
+
+		creds->mb = mbuf_alloc(4096);
+		if (!creds->mb) {
+			err = ENOMEM;
+			goto out;
+		}
+
+		err = file_read(creds->mb, path);
+		if (err) {
+			re_fprintf(stderr, "credentials: could not read %s"
+				   " (%m)\n", path, err);
+			goto out;
+		}
+
+		err = file_parse(creds, path);
+		if (err)
+			goto out;
+	}
+
+ out:
+	if (err)
+		mem_deref(creds);
+	else
+		*credsp = creds;
+
+	return err;
+}
+
+
+unsigned creds_count(const struct creds *creds)
+{
+	return creds ? creds->entryc : 0;
+}
+
+
+/* copy a pattern, with every "%u" replaced by the number n */
+static int pattern_print(char *buf, size_t sz, const char *pattern,
+			 unsigned n)
+{
+	size_t len = 0;
+
+	for (; *pattern; pattern++) {
+
+		if (pattern[0] == '%' && pattern[1] == 'u') {
+
+			int w = re_snprintf(buf + len, sz - len, "%u", n);
+
+			if (w < 0 || len + w >= sz)
+				return ENAMETOOLONG;
+
+			len += w;
+			++pattern;
+		}
+		else {
+			if (len + 1 >= sz)
+				return ENAMETOOLONG;
+
+			buf[len++] = *pattern;
+		}
+	}
+
+	buf[len] = '\0';
+
+	return 0;
+}
+
+
+/* pl_strcpy() truncates, a credential must be copied in full */
+static int cred_copy(const struct pl *pl, char *buf, size_t sz)
+{
+	if (pl->l >= sz)
+		return EOVERFLOW;
+
+	return pl_strcpy(pl, buf, sz);
+}
+
+
+/*
+ * The credentials of allocation number n. Without a credentials file
+ * the username and password of the group are used, as patterns.
+ */
+int creds_get(const struct creds *creds, unsigned n, const char *user,
+	      const char *pass, char *ubuf, size_t usz, char *pbuf,
+	      size_t psz)
+{
+	char name[128];
+	int err;
+
+	if (!user || !pass || !ubuf || !usz || !pbuf || !psz)
+		return EINVAL;
+
+	if (creds && creds->entryc) {
+
+		const struct cred_entry *e;
+
+		e = &creds->entryv[n % creds->entryc];
+
+		err = cred_copy(&e->user, name, sizeof(name));
+		if (!err)
+			err = cred_copy(&e->pass, pbuf, psz);
+		if (err)
+			return err;
+	}
+	else {
+		err  = pattern_print(name, sizeof(name), user, n);
+		err |= pattern_print(pbuf, psz, pass, n);
+		if (err)
+			return ENAMETOOLONG;
+	}
+
+	if (creds && creds->secret) {
+
+		uint8_t digest[SHA_DIGEST_LENGTH];
+		size_t len = psz - 1;
+		uint64_t expiry;
+
+		expiry = (uint64_t)time(NULL) + creds->ttl;
+
+		if (re_snprintf(ubuf, usz, "%llu:%s",
+				(unsigned long long)expiry, name) < 0)
+			return ENAMETOOLONG;
+
+		hmac_sha1((const uint8_t *)creds->secret,
+			  str_len(creds->secret),
+			  (const uint8_t *)ubuf, str_len(ubuf),
+			  digest, sizeof(digest));
+
+		err = base64_encode(digest, sizeof(digest), pbuf, &len);
+		if (err)
+			return err;
+
+		pbuf[len] = '\0';
+	}
+	else {
+		if (str_len(name) >= usz)
+			return ENAMETOOLONG;
+
+		str_ncpy(ubuf, name, usz);
+	}
+
+	return 0;
+}
@@ -0,0 +1,313 @@
+/**
+ * @file dump.c Per-allocation results, for offline analysis
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <re.h>
+#include "turnperf.h"
+
+
+/*
+ * Dump:
+ *
+ * - one record per stream, i.e. per peer of an allocation, written
+ *   while the allocations are walked, nothing is kept in memory
+ * - CSV with a header line, or binary if the file name ends in ".bin"
+ * - the binary file starts with the magic "TPD1", a 16-bit version and
+ *   the 16-bit record size, followed by fixed-size records. All
+ *   numbers are in network byte order:
+ *
+ *     u32 ix, u16 peer, u16 group,
+ *     u8 state, u8 proto, u8 secure, u8 indications,
+ *     i32 err, u16 scode, u16 retries, u16 redirects, u16 reserved,
+ *     server and relay: u8 family (4 or 6), u8 reserved, u16 port,
+ *                       16 bytes address,
+ *     u32 atime, auth, setup [us],
+ *     u64 sent, received, lost, dup, reordered, txdrop [packets],
+ *     u64 send and recv bitrate [bit/s],
+ *     u32 latency avg, p50, p99, max [us]
+ */
+
+
+enum {
+	VERSION_BIN = 1,
+	ADDR_SIZE = 20,
+	REC_SIZE = 12 + 12 + 2 * ADDR_SIZE + 12 + 48 + 16 + 16,
+	CSV_BUF = 1024,
+};
+
+struct dump {
+	FILE *f;
+	const char *path;
+	struct mbuf *mb;              /* binary record */
+	bool binary;
+	unsigned count;
+};
+
+
+static const char *state_namev[DUMP_STATE_MAX] = {
+	[DUMP_PENDING] = "pending",
+	[DUMP_OK]      = "ok",
+	[DUMP_FAILED]  = "failed",
+	[DUMP_LOST]    = "lost",
+};
+
+
+static void destructor(void *arg)
+{
+	struct dump *d = arg;
+
+	if (d->f)
+		(void)fclose(d->f);
+
+	mem_deref(d->mb);
+}
+
+
+static bool has_suffix(const char *str, const char *suffix)
+{
+	size_t n = str_len(str), m = str_len(suffix);
+
+	return n >= m && 0 == str_casecmp(str + n - m, suffix);
+}
+
+
+int dump_open(struct dump **dp, const char *path)
+{
+	struct dump *d;
+	int err = 0;
+
+	if (!dp || !path)
+		return EINVAL;
+
+	d = mem_zalloc(sizeof(*d), destructor);
+	if (!d)
+		return ENOMEM;
+
+	d->path   = path;
+	d->binary = has_suffix(path, ".bin");
+
+	d->f = fopen(path, d->binary ? "wb" : "w");
+	if (!d->f) {
+		err = errno;
+		re_fprintf(stderr, "could not open dump file %s: %m\n",
+			   path, err);
+		goto out;
+	}
+
+	if (d->binary) {
+
+		d->mb = mbuf_alloc(REC_SIZE);
+		if (!d->mb) {
+			err = ENOMEM;
+			goto out;
+		}
+
+		err  = mbuf_write_str(d->mb, "TPD1");
+		err |= mbuf_write_u16(d->mb, htons(VERSION_BIN));
+		err |= mbuf_write_u16(d->mb, htons(REC_SIZE));
+		if (err)
+			goto out;
+
+		if (1 != fwrite(d->mb->buf, d->mb->end, 1, d->f))
+			err = EIO;
+	}
+	else {
+		if (re_fprintf(d->f, "ix,peer,group,state,err,scode,"
+			       "server,relay,transport,framing,"
+			       "atime_ms,auth_ms,setup_ms,retries,redirects,"
+			       "sent,received,lost,dup,reordered,txdrop,"
+			       "send_bitrate,recv_bitrate,"
+			       "lat_avg_ms,lat_p50_ms,lat_p99_ms,"
+			       "lat_max_ms\n") < 0)
+			err = EIO;
+	}
+
+ out:
+	if (err)
+		mem_deref(d);
+	else
+		*dp = d;
+
+	return err;
+}
+
+
+static uint32_t usec(double ms)
+{
+	return ms > 0 ? (uint32_t)min(ms * 1000.0, (double)UINT32_MAX) : 0;
+}
+
+
+static int write_u64(struct mbuf *mb, uint64_t v)
+{
+	int err;
+
+	err  = mbuf_write_u32(mb, htonl((uint32_t)(v >> 32)));
+	err |= mbuf_write_u32(mb, htonl((uint32_t)v));
+
+	return err;
+}
+
+
+static int write_addr(struct mbuf *mb, const struct sa *sa)
+{
+	uint8_t addr[16];
+	int err;
+
+	memset(addr, 0, sizeof(addr));
+
+	switch (sa_af(sa)) {
+
+	case AF_INET:
+		err = mbuf_write_u8(mb, 4);
+		*(uint32_t *)(void *)addr = htonl(sa_in(sa));
+		break;
+
+	case AF_INET6:
+		err = mbuf_write_u8(mb, 6);
+		sa_in6(sa, addr);
+		break;
+
+	default:
+		err = mbuf_write_u8(mb, 0);
+		break;
+	}
+
+	err |= mbuf_write_u8(mb, 0);
+	err |= mbuf_write_u16(mb, htons(sa_port(sa)));
+	err |= mbuf_write_mem(mb, addr, sizeof(addr));
+
+	return err;
+}
+
+
+static int write_bin(struct dump *d, const struct dump_record *rec)
+{
+	struct mbuf *mb = d->mb;
+	int err;
+
+	mbuf_rewind(mb);
+
+	err  = mbuf_write_u32(mb, htonl(rec->ix));
+	err |= mbuf_write_u16(mb, htons(rec->peer));
+	err |= mbuf_write_u16(mb, htons(rec->group));
+	err |= mbuf_write_u8(mb, rec->state);
+	err |= mbuf_write_u8(mb, rec->proto);
+	err |= mbuf_write_u8(mb, rec->secure);
+	err |= mbuf_write_u8(mb, rec->turn_ind);
+
+	err |= mbuf_write_u32(mb, htonl((uint32_t)rec->err));
+	err |= mbuf_write_u16(mb, htons(rec->scode));
+	err |= mbuf_write_u16(mb, htons(min(rec->retries, UINT16_MAX)));
+	err |= mbuf_write_u16(mb, htons(min(rec->redirects, UINT16_MAX)));
+	err |= mbuf_write_u16(mb, 0);
+
+	err |= write_addr(mb, &rec->srv);
+	err |= write_addr(mb, &rec->relay);
+
+	err |= mbuf_write_u32(mb, htonl(usec(rec->atime)));
+	err |= mbuf_write_u32(mb, htonl(usec(rec->auth)));
+	err |= mbuf_write_u32(mb, htonl(usec(rec->setup)));
+
+	err |= write_u64(mb, rec->sent);
+	err |= write_u64(mb, rec->recv);
+	err |= write_u64(mb, rec->lost);
+	err |= write_u64(mb, rec->dups);
+	err |= write_u64(mb, rec->reordered);
+	err |= write_u64(mb, rec->txdrop);
+
+	err |= write_u64(mb, (uint64_t)rec->send_bitrate);
+	err |= write_u64(mb, (uint64_t)rec->recv_bitrate);
+
+	err |= mbuf_write_u32(mb, htonl(usec(rec->lat_avg)));
+	err |= mbuf_write_u32(mb, htonl(usec(rec->lat_p50)));
+	err |= mbuf_write_u32(mb, htonl(usec(rec->lat_p99)));
+	err |= mbuf_write_u32(mb, htonl(usec(rec->lat_max)));
+	if (err)
+		return err;
+
+	if (1 != fwrite(mb->buf, mb->end, 1, d->f))
+		return EIO;
+
+	return 0;
+}
+
+
+static int write_csv(struct dump *d, const struct dump_record *rec)
+{
+	char srv[64] = "", relay[64] = "";
+
+	if (sa_isset(&rec->srv, SA_ALL))
+		re_snprintf(srv, sizeof(srv), "%J", &rec->srv);
+	if (sa_isset(&rec->relay, SA_ALL))
+		re_snprintf(relay, sizeof(relay), "%J", &rec->relay);
+
+	if (re_fprintf(d->f, "%u,%u,%s,%s,%d,%u,%s,%s,%s,%s,"
+		       "%.3f,%.3f,%.3f,%u,%u,"
+		       "%llu,%llu,%llu,%llu,%llu,%llu,"
+		       "%.0f,%.0f,%.3f,%.3f,%.3f,%.3f\n",
+		       rec->ix, rec->peer, rec->group_name,
+		       state_namev[rec->state], rec->err, rec->scode,
+		       srv, relay, protocol_name(rec->proto, rec->secure),
+		       rec->turn_ind ? "indication" : "channel",
+		       rec->atime, rec->auth, rec->setup,
+		       rec->retries, rec->redirects,
+		       (unsigned long long)rec->sent,
+		       (unsigned long long)rec->recv,
+		       (unsigned long long)rec->lost,
+		       (unsigned long long)rec->dups,
+		       (unsigned long long)rec->reordered,
+		       (unsigned long long)rec->txdrop,
+		       rec->send_bitrate, rec->recv_bitrate,
+		       rec->lat_avg, rec->lat_p50, rec->lat_p99,
+		       rec->lat_max) < 0)
+		return EIO;
+
+	return 0;
+}
+
+
+int dump_write(struct dump *d, const struct dump_record *rec)
+{
+	int err;
+
+	if (!d || !d->f || !rec || rec->state >= DUMP_STATE_MAX)
+		return EINVAL;
+
+	err = d->binary ? write_bin(d, rec) : write_csv(d, rec);
+	if (err)
+		return err;
+
+	++d->count;
+
+	return 0;
+}
+
+
+/* flush and close the file, the records are complete if this succeeds */
+int dump_close(struct dump *d)
+{
+	int err = 0;
+
+	if (!d || !d->f)
+		return EINVAL;
+
+	if (fclose(d->f))
+		err = errno;
+
+	d->f = NULL;
+
+	if (err) {
+		re_fprintf(stderr, "could not write dump file %s: %m\n",
+			   d->path, err);
+	}
+	else {
+		re_printf("%u records written to %s\n", d->count, d->path);
+	}
+
+	return err;
+}
@@ -0,0 +1,208 @@
+/**
+ * @file events.c Counted, rate-limited events of the packet paths
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include "turnperf.h"
+
+
+/*
+ * Events:
+ *
+ * - the packet paths must not block on stderr when a server misbehaves
+ * - every event is counted, and the last EVENT_RING are kept in a ring
+ * - at most LOG_MAX events per LOG_WINDOW are printed, the rest are
+ *   counted as suppressed and reported when the next window starts
+ * - with the live view, nothing is printed by the packet paths. The
+ *   view shows the new events above itself when it is redrawn
+ * - the counters and the ring are printed at the end
+ */
+
+
+enum {
+	LOG_WINDOW = 1000,            /* [ms] */
+	LOG_MAX = 5,                  /* printed per window */
+};
+
+
+static const char *namev[EVENT_MAX] = {
+	[EVENT_FOREIGN]   = "non-turnperf packet",
+	[EVENT_DECODE]    = "decode error",
+	[EVENT_COOKIE]    = "wrong session cookie",
+	[EVENT_ALLOC_ID]  = "wrong stream",
+	[EVENT_REORDER]   = "late or out-of-order",
+	[EVENT_NOT_READY] = "data before allocation",
+	[EVENT_PEER_ADDR] = "peer address changed",
+	[EVENT_TX_ERROR]  = "send error",
+};
+
+
+const char *event_name(enum event_type type)
+{
+	return type < EVENT_MAX ? namev[type] : "???";
+}
+
+
+static int event_print(struct re_printf *pf, const struct event *e)
+{
+	int err;
+
+	err = re_hprintf(pf, "[%u] %s", e->id, event_name(e->type));
+
+	if (sa_isset(&e->src, SA_ALL))
+		err |= re_hprintf(pf, " from %J", &e->src);
+	if (e->size)
+		err |= re_hprintf(pf, " (%zu bytes)", e->size);
+
+	switch (e->type) {
+
+	case EVENT_COOKIE:
+	case EVENT_ALLOC_ID:
+		err |= re_hprintf(pf, " exp=%x actual=%x", e->a, e->b);
+		break;
+
+	case EVENT_REORDER:
+		err |= re_hprintf(pf, " last_seq=%u seq=%u", e->a, e->b);
+		break;
+
+	default:
+		break;
+	}
+
+	if (e->err)
+		err |= re_hprintf(pf, " (%m)", e->err);
+	if (e->samplec)
+		err |= re_hprintf(pf, " %w", e->sample, e->samplec);
+
+	return err;
+}
+
+
+void events_add(struct events *ev, enum event_type type, uint32_t id,
+		const struct sa *src, const struct mbuf *mb, int err,
+		uint32_t a, uint32_t b)
+{
+	struct event *e;
+	uint64_t now;
+
+	if (!ev || type >= EVENT_MAX)
+		return;
+
+	now = tmr_jiffies();
+
+	++ev->countv[type];
+
+	e = &ev->ringv[ev->total++ % EVENT_RING];
+
+	e->ts   = now;
+	e->type = type;
+	e->id   = id;
+	e->err  = err;
+	e->a    = a;
+	e->b    = b;
+
+	if (src)
+		e->src = *src;
+	else
+		sa_init(&e->src, AF_UNSPEC);
+
+	if (mb) {
+		e->size    = mbuf_get_left(mb);
+		e->samplec = min(e->size, sizeof(e->sample));
+		memcpy(e->sample, mbuf_buf(mb), e->samplec);
+	}
+	else {
+		e->size    = 0;
+		e->samplec = 0;
+	}
+
+	if (ev->deferred)
+		return;
+
+	if (now >= ev->ts_log + LOG_WINDOW) {
+
+		if (ev->suppressed) {
+			re_fprintf(stderr, "events: %llu more events were"
+				   " not printed\n",
+				   (unsigned long long)ev->suppressed);
+		}
+
+		ev->ts_log     = now;
+		ev->n_log      = 0;
+		ev->suppressed = 0;
+	}
+
+	if (ev->n_log >= LOG_MAX) {
+		++ev->suppressed;
+		return;
+	}
+
+	++ev->n_log;
+
+	re_fprintf(stderr, "%H\n", event_print, e);
+}
+
+
+/* the events since the last flush, at most LOG_MAX */
+void events_flush(struct events *ev)
+{
+	uint64_t n, i;
+
+	if (!ev)
+		return;
+
+	n = ev->total - ev->flushed;
+
+	for (i = ev->total - min(n, LOG_MAX); i < ev->total; i++) {
+
+		const struct event *e = &ev->ringv[i % EVENT_RING];
+
+		re_fprintf(stderr, "%H\n", event_print, e);
+	}
+
+	if (n > LOG_MAX) {
+		re_fprintf(stderr, "events: %llu more events were"
+			   " not printed\n",
+			   (unsigned long long)(n - LOG_MAX));
+	}
+
+	ev->flushed = ev->total;
+}
+
+
+void events_print(const struct events *ev)
+{
+	uint64_t first, i;
+	unsigned t;
+
+	if (!ev || !ev->total)
+		return;
+
+	re_printf("events summary:\n");
+
+	for (t = 0; t < EVENT_MAX; t++) {
+
+		if (!ev->countv[t])
+			continue;
+
+		re_printf("%-24s %llu\n", event_name(t),
+			  (unsigned long long)ev->countv[t]);
+	}
+
+	first = ev->total > EVENT_RING ? ev->total - EVENT_RING : 0;
+
+	re_printf("last %u events:\n", (unsigned)(ev->total - first));
+
+	for (i = first; i < ev->total; i++) {
+
+		const struct event *e = &ev->ringv[i % EVENT_RING];
+
+		re_printf("%10llu ms %H\n", (unsigned long long)e->ts,
+			  event_print, e);
+	}
+
+	re_printf("\n");
+}
@@ -0,0 +1,233 @@
+/**
+ * @file flood.c Unpaced flood mode, to find the maximum packet rate
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include "turnperf.h"
+
+
+/*
+ * Flood mode:
+ *
+ * - the senders are not paced, each stream keeps up to "window"
+ *   packets in flight and sends the next ones as older ones arrive
+ * - the window starts at one packet and is doubled every FLOOD_STEP,
+ *   up to the maximum window, which is then kept until the end
+ * - each step records the offered and the forwarded packet rate and
+ *   the loss. The packets in flight at the start and the end of a step
+ *   are not counted as loss
+ * - the knee is the first step with more than FLOOD_KNEE_LOSS percent
+ *   loss, the maximum lossless rate is the best step before it
+ * - the step that is running when the traffic stops is recorded with
+ *   its actual duration
+ */
+
+
+enum {
+	FLOOD_STEP = 2000,            /* [ms] */
+};
+
+#define FLOOD_KNEE_LOSS 1.0           /* [percent] */
+
+
+void flood_init(struct flood *fl, unsigned window_max)
+{
+	if (!fl)
+		return;
+
+	memset(fl, 0, sizeof(*fl));
+
+	fl->window_max = window_max;
+	fl->window     = window_max ? 1 : 0;
+	fl->ts_step    = tmr_jiffies();
+}
+
+
+/* counters of all streams, and the packets in flight */
+static void snapshot(const struct allocator *allocator,
+		     struct flood_snap *snap)
+{
+	const unsigned window = allocator->flood.window;
+	unsigned i;
+
+	memset(snap, 0, sizeof(*snap));
+
+	for (i = 0; i < allocator_streams(allocator); i++) {
+
+		const struct sender *snd = &allocator->senderv[i];
+		const struct receiver *recv = &allocator->recvv[i];
+
+		if (!snd->alloc)
+			continue;
+
+		snap->sent    += snd->flood_sent;
+		snap->recv    += recv->live_packets;
+		snap->lat_sum += recv->live_lat_sum;
+
+		if (snd->seq > recv->max_seq) {
+			snap->inflight += min(snd->seq - recv->max_seq,
+					      window);
+		}
+	}
+}
+
+
+static void step_add(struct flood *fl, const struct flood_snap *snap,
+		     uint64_t duration)
+{
+	const struct flood_snap *prev = &fl->snap;
+	struct flood_step *st;
+	uint64_t recv = snap->recv - prev->recv;
+	int64_t lost;
+
+	/* the last step at the maximum window is extended */
+	if (fl->stepc && fl->stepv[fl->stepc - 1].window == fl->window) {
+		st = &fl->stepv[fl->stepc - 1];
+	}
+	else if (fl->stepc < FLOOD_STEPS_MAX) {
+		st = &fl->stepv[fl->stepc++];
+		memset(st, 0, sizeof(*st));
+		st->window = fl->window;
+	}
+	else {
+		return;
+	}
+
+	lost = (int64_t)(snap->sent - prev->sent) - (int64_t)recv -
+		((int64_t)snap->inflight - (int64_t)prev->inflight);
+
+	st->duration += duration;
+	st->sent     += snap->sent - prev->sent;
+	st->recv     += recv;
+	st->lost     += max(lost, 0);
+	st->lat_sum  += snap->lat_sum - prev->lat_sum;
+}
+
+
+/* called every pacing tick, steps up the window every FLOOD_STEP */
+void flood_tick(struct allocator *allocator)
+{
+	struct flood *fl = &allocator->flood;
+	struct flood_snap snap;
+	uint64_t now = tmr_jiffies();
+
+	if (!fl->window || now < fl->ts_step + FLOOD_STEP)
+		return;
+
+	snapshot(allocator, &snap);
+
+	step_add(fl, &snap, now - fl->ts_step);
+
+	fl->snap    = snap;
+	fl->ts_step = now;
+	fl->window  = min(fl->window * 2, fl->window_max);
+}
+
+
+/* at the end of the traffic, record the partial last step */
+void flood_flush(struct allocator *allocator)
+{
+	struct flood *fl = &allocator->flood;
+	struct flood_snap snap;
+	uint64_t now = tmr_jiffies();
+
+	if (!fl->window || now <= fl->ts_step)
+		return;
+
+	snapshot(allocator, &snap);
+
+	step_add(fl, &snap, now - fl->ts_step);
+
+	fl->snap    = snap;
+	fl->ts_step = now;
+}
+
+
+static double step_pps(const struct flood_step *st, uint64_t packets)
+{
+	return st->duration ? 1000.0 * packets / st->duration : .0;
+}
+
+
+static double step_loss(const struct flood_step *st)
+{
+	return st->sent ? 100.0 * st->lost / st->sent : .0;
+}
+
+
+void flood_get_result(const struct flood *fl, struct result *res)
+{
+	unsigned i;
+
+	if (!fl || !res)
+		return;
+
+	for (i = 0; i < fl->stepc; i++) {
+
+		const struct flood_step *st = &fl->stepv[i];
+		const double pps = step_pps(st, st->recv);
+
+		res->flood_max_pps = max(res->flood_max_pps, pps);
+
+		if (res->flood_knee)
+			continue;
+
+		if (step_loss(st) > FLOOD_KNEE_LOSS)
+			res->flood_knee = st->window;
+		else
+			res->flood_lossless_pps =
+				max(res->flood_lossless_pps, pps);
+	}
+}
+
+
+void flood_print(const struct allocator *allocator)
+{
+	const struct flood *fl = &allocator->flood;
+	struct result *res;
+	unsigned i;
+
+	if (!fl->stepc)
+		return;
+
+	res = mem_zalloc(sizeof(*res), NULL);
+	if (!res)
+		return;
+
+	flood_get_result(fl, res);
+
+	re_printf("flood summary (window is packets in flight per stream):\n");
+	re_printf("%7s %9s %13s %13s %8s %10s\n", "window", "duration",
+		  "offered pps", "forwarded pps", "loss", "latency");
+
+	for (i = 0; i < fl->stepc; i++) {
+
+		const struct flood_step *st = &fl->stepv[i];
+
+		re_printf("%7u %7.1f s %13.0f %13.0f %7.2f%% %7.3f ms\n",
+			  st->window, st->duration / 1000.0,
+			  step_pps(st, st->sent), step_pps(st, st->recv),
+			  step_loss(st),
+			  st->recv ? st->lat_sum / 1000.0 / st->recv : .0);
+	}
+
+	re_printf("max forwarded:        %.0f pps\n", res->flood_max_pps);
+	re_printf("max lossless:         %.0f pps\n",
+		  res->flood_lossless_pps);
+
+	if (res->flood_knee) {
+		re_printf("knee:                 loss above %.1f%% at"
+			  " window %u\n", FLOOD_KNEE_LOSS, res->flood_knee);
+	}
+	else {
+		re_printf("knee:                 not reached, increase the"
+			  " window\n");
+	}
+
+	re_printf("\n");
+
+	mem_deref(res);
+}
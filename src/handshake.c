@@ -0,0 +1,239 @@
+/**
+ * @file handshake.c TLS/DTLS handshake timing and session resumption
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <re.h>
+#ifdef USE_OPENSSL
+#include <openssl/ssl.h>
+#endif
+#include "turnperf.h"
+
+
+/*
+ * Handshakes:
+ *
+ * - timed from the start of the handshake to the end, so the time is
+ *   no longer hidden in the allocation time
+ * - full and resumed handshakes are counted separately
+ * - with resumption, the most recent session from the server is offered
+ *   on every new connection (session ticket or session ID)
+ *
+ * libre owns the SSL objects, so everything is done from callbacks on
+ * the SSL_CTX. TLS and DTLS have their own context and their own
+ * struct handshake, so a TLS session is never offered on DTLS.
+ */
+
+
+#if defined(USE_OPENSSL) && OPENSSL_VERSION_NUMBER >= 0x10100000L
+
+
+static int ctx_index = -1;         /* struct handshake on the SSL_CTX */
+static int ssl_index = -1;         /* handshake start time on the SSL */
+
+
+static double cpu_time(void)
+{
+	struct rusage ru;
+
+	if (0 != getrusage(RUSAGE_SELF, &ru))
+		return 0;
+
+	return (double)ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		(double)ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+
+static int new_session_handler(SSL *ssl, SSL_SESSION *sess)
+{
+	struct handshake *hs;
+
+	hs = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ctx_index);
+	if (!hs || !hs->resume)
+		return 0;
+
+	if (hs->session)
+		SSL_SESSION_free(hs->session);
+
+	/* keep the reference, the latest session is offered next */
+	hs->session = sess;
+	++hs->n_sessions;
+
+	return 1;
+}
+
+
+static void handshake_start(struct handshake *hs, SSL *ssl)
+{
+	const uint64_t now = time_usec();
+
+	/* offer the latest session, before the ClientHello is sent */
+	if (hs->resume && hs->session)
+		SSL_set_session(ssl, hs->session);
+
+	/* note: microseconds since the first handshake */
+	if (!hs->ts_first) {
+		hs->ts_first  = now;
+		hs->cpu_first = cpu_time();
+	}
+
+	SSL_set_ex_data(ssl, ssl_index,
+			(void *)(uintptr_t)(now - hs->ts_first + 1));
+}
+
+
+static void handshake_done(struct handshake *hs, SSL *ssl)
+{
+	uintptr_t start = (uintptr_t)SSL_get_ex_data(ssl, ssl_index);
+	const uint64_t now = time_usec();
+	uint64_t us;
+
+	/* TLS 1.3 session tickets may signal done again */
+	if (!start)
+		return;
+
+	SSL_set_ex_data(ssl, ssl_index, NULL);
+
+	us = now - hs->ts_first - (start - 1);
+
+	if (SSL_session_reused(ssl))
+		hist_add(&hs->resumed, us);
+	else
+		hist_add(&hs->full, us);
+
+	hs->ts_last  = now;
+	hs->cpu_last = cpu_time();
+}
+
+
+static void info_handler(const SSL *cssl, int where, int ret)
+{
+	SSL *ssl = (SSL *)cssl;
+	struct handshake *hs;
+	(void)ret;
+
+	hs = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ctx_index);
+	if (!hs)
+		return;
+
+	if (where & SSL_CB_HANDSHAKE_START)
+		handshake_start(hs, ssl);
+	else if (where & SSL_CB_HANDSHAKE_DONE)
+		handshake_done(hs, ssl);
+}
+
+
+int handshake_init(struct handshake *hs, struct tls *tls, bool resume)
+{
+	SSL_CTX *ctx;
+
+	if (!hs || !tls)
+		return EINVAL;
+
+	ctx = tls_openssl_context(tls);
+	if (!ctx)
+		return ENOSYS;
+
+	if (ctx_index < 0)
+		ctx_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL,
+						     NULL);
+	if (ssl_index < 0)
+		ssl_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+	if (ctx_index < 0 || ssl_index < 0)
+		return ENOMEM;
+
+	hs->resume = resume;
+
+	SSL_CTX_set_ex_data(ctx, ctx_index, hs);
+	SSL_CTX_set_info_callback(ctx, info_handler);
+
+	if (resume) {
+		SSL_CTX_set_session_cache_mode(ctx,
+					SSL_SESS_CACHE_CLIENT |
+					SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ctx, new_session_handler);
+	}
+
+	return 0;
+}
+
+
+void handshake_close(struct handshake *hs, struct tls *tls)
+{
+	SSL_CTX *ctx;
+
+	if (!hs)
+		return;
+
+	ctx = tls ? tls_openssl_context(tls) : NULL;
+	if (ctx && ctx_index >= 0) {
+		SSL_CTX_set_info_callback(ctx, NULL);
+		SSL_CTX_sess_set_new_cb(ctx, NULL);
+		SSL_CTX_set_ex_data(ctx, ctx_index, NULL);
+	}
+
+	if (hs->session) {
+		SSL_SESSION_free(hs->session);
+		hs->session = NULL;
+	}
+}
+
+
+#else
+
+
+int handshake_init(struct handshake *hs, struct tls *tls, bool resume)
+{
+	(void)hs;
+	(void)tls;
+	(void)resume;
+
+	return ENOSYS;
+}
+
+
+void handshake_close(struct handshake *hs, struct tls *tls)
+{
+	(void)hs;
+	(void)tls;
+}
+
+
+#endif
+
+
+void handshake_print(const struct handshake *hs, const char *name)
+{
+	const uint64_t n = hs ? hs->full.count + hs->resumed.count : 0;
+	double duration;
+
+	if (!n)
+		return;
+
+	duration = (hs->ts_last - hs->ts_first) / 1e6;
+
+	re_printf("%s handshake summary:\n", name);
+	re_printf("session resumption:   %s (%u sessions received)\n",
+		  hs->resume ? "on" : "off", hs->n_sessions);
+	re_printf("full handshakes:      %H\n", hist_print, &hs->full);
+	re_printf("resumed handshakes:   %H\n", hist_print, &hs->resumed);
+
+	if (duration > 0) {
+		re_printf("handshakes per second: %.1f (%.1f full,"
+			  " %.1f resumed)\n",
+			  n / duration,
+			  hs->full.count / duration,
+			  hs->resumed.count / duration);
+	}
+
+	/* all client work while the handshakes were running */
+	re_printf("client cpu:           %.3f ms per handshake"
+		  " (%.1f%% of the handshake period)\n",
+		  1000.0 * (hs->cpu_last - hs->cpu_first) / n,
+		  duration > 0
+		  ? 100.0 * (hs->cpu_last - hs->cpu_first) / duration : 0);
+	re_printf("\n");
+}
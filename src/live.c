@@ -0,0 +1,316 @@
+/**
+ * @file live.c Live view of the worst allocations during a run
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include "turnperf.h"
+
+
+/*
+ * Live view:
+ *
+ * - every UI tick scans the next SCAN_MAX streams, so the cost of a
+ *   tick does not depend on the number of allocations
+ * - a stream's loss, latency and receive rate are measured over the
+ *   time since it was scanned last, one scan cycle or MIN_INTERVAL
+ * - the top-K lists and the rate distribution are updated with each
+ *   scanned stream, entries are replaced when the stream comes round
+ * - streams with an on/off model have no rate deficit
+ */
+
+
+enum {
+	SCAN_MAX = 4096,              /* streams per UI tick */
+	PRINT_INTERVAL = 1000,        /* [ms] */
+	MIN_PACKETS = 10,             /* per scan, to measure loss */
+	MIN_INTERVAL = 1000,          /* between scans of a stream [ms] */
+};
+
+enum metric {
+	METRIC_LOSS = 0,
+	METRIC_LATENCY,
+	METRIC_DEFICIT,
+	METRIC_MAX
+};
+
+struct top {
+	unsigned s;                   /* stream number */
+	double val;
+};
+
+struct live_stream {
+	uint64_t ts;                  /* last scan [ms] */
+	uint32_t seq;                 /* sender sequence at the last scan */
+	uint64_t packets;
+	uint64_t lat_sum;
+	int bucket;                   /* rate bucket, -1 if none */
+};
+
+struct live {
+	struct live_stream *streamv;
+	unsigned streamc;
+	unsigned pos;                 /* next stream to scan */
+	uint64_t ts_cycle;            /* start of the current cycle [ms] */
+	uint64_t cycle;               /* duration of the last cycle [ms] */
+	struct top topv[METRIC_MAX][LIVE_TOP];
+	unsigned topc[METRIC_MAX];
+	unsigned bucketv[LIVE_BUCKETS];
+	uint64_t ts_print;
+	unsigned lines;               /* printed by the last refresh */
+};
+
+
+/* receive rate in percent of the target */
+static const double bucket_limv[LIVE_BUCKETS - 1] = {50, 90, 98, 102};
+static const char *bucket_namev[LIVE_BUCKETS] = {
+	"<50%", "50-90%", "90-98%", "98-102%", ">102%"
+};
+
+
+static void destructor(void *arg)
+{
+	struct live *live = arg;
+
+	mem_deref(live->streamv);
+}
+
+
+int live_alloc(struct live **livep, unsigned streams)
+{
+	struct live *live;
+	unsigned i;
+
+	if (!livep || !streams)
+		return EINVAL;
+
+	live = mem_zalloc(sizeof(*live), destructor);
+	if (!live)
+		return ENOMEM;
+
+	live->streamv = mem_zalloc(streams * sizeof(*live->streamv), NULL);
+	if (!live->streamv) {
+		mem_deref(live);
+		return ENOMEM;
+	}
+
+	for (i = 0; i < streams; i++)
+		live->streamv[i].bucket = -1;
+
+	live->streamc  = streams;
+	live->ts_cycle = tmr_jiffies();
+
+	*livep = live;
+
+	return 0;
+}
+
+
+/* keep the K largest values, a stream is in the list only once */
+static void top_update(struct top *topv, unsigned *topc, unsigned s,
+		       double val)
+{
+	unsigned i, n = *topc;
+
+	for (i = 0; i < n; i++) {
+		if (topv[i].s == s) {
+			memmove(&topv[i], &topv[i + 1],
+				(n - i - 1) * sizeof(*topv));
+			--n;
+			break;
+		}
+	}
+
+	if (val > 0 && (n < LIVE_TOP || val > topv[n - 1].val)) {
+
+		if (n == LIVE_TOP)
+			--n;
+
+		for (i = n; i > 0 && topv[i - 1].val < val; i--)
+			topv[i] = topv[i - 1];
+
+		topv[i].s   = s;
+		topv[i].val = val;
+		++n;
+	}
+
+	*topc = n;
+}
+
+
+static int rate_bucket(double pct)
+{
+	int b;
+
+	for (b = 0; b < LIVE_BUCKETS - 1; b++) {
+		if (pct < bucket_limv[b])
+			break;
+	}
+
+	return b;
+}
+
+
+static void scan_stream(struct live *live, unsigned s,
+			const struct sender *snd, const struct receiver *recv,
+			uint64_t now)
+{
+	struct live_stream *ls = &live->streamv[s];
+	uint64_t packets, dt;
+	uint32_t sent;
+	double loss, target, rate;
+	int b;
+
+	if (!snd->alloc)
+		return;
+
+	/* the first visit only takes the snapshot */
+	if (!ls->ts)
+		goto out;
+
+	dt      = now - ls->ts;
+	sent    = snd->seq - ls->seq;
+	packets = recv->live_packets - ls->packets;
+
+	if (dt < MIN_INTERVAL)
+		return;
+
+	if (sent >= MIN_PACKETS) {
+		loss = sent > packets ? 100.0 * (sent - packets) / sent : 0;
+		top_update(live->topv[METRIC_LOSS], &live->topc[METRIC_LOSS],
+			   s, loss);
+	}
+
+	if (packets) {
+		top_update(live->topv[METRIC_LATENCY],
+			   &live->topc[METRIC_LATENCY], s,
+			   (recv->live_lat_sum - ls->lat_sum) / packets /
+			   1000.0);
+	}
+
+	/* not started yet, or silent */
+	if (!sent || snd->off_ms || !snd->bitrate)
+		goto out;
+
+	target = snd->bitrate;
+	rate   = 8.0 * packets * snd->psize / (dt / 1000.0);
+
+	top_update(live->topv[METRIC_DEFICIT], &live->topc[METRIC_DEFICIT],
+		   s, 100.0 * (1.0 - rate / target));
+
+	b = rate_bucket(100.0 * rate / target);
+	if (ls->bucket >= 0)
+		--live->bucketv[ls->bucket];
+	++live->bucketv[b];
+	ls->bucket = b;
+
+ out:
+	ls->ts      = now;
+	ls->seq     = snd->seq;
+	ls->packets = recv->live_packets;
+	ls->lat_sum = recv->live_lat_sum;
+}
+
+
+/* scan the next streams, at most SCAN_MAX */
+void live_scan(struct live *live, const struct allocator *allocator)
+{
+	uint64_t now = tmr_jiffies();
+	unsigned n, streams;
+
+	if (!live || !allocator)
+		return;
+
+	streams = min(allocator_streams(allocator), live->streamc);
+	if (!streams)
+		return;
+
+	for (n = 0; n < SCAN_MAX && n < streams; n++) {
+
+		if (live->pos >= streams) {
+			live->pos      = 0;
+			live->cycle    = now - live->ts_cycle;
+			live->ts_cycle = now;
+		}
+
+		scan_stream(live, live->pos, &allocator->senderv[live->pos],
+			    &allocator->recvv[live->pos], now);
+
+		++live->pos;
+	}
+}
+
+
+static void top_fmt(char *buf, size_t sz, const struct live *live,
+		    enum metric m, unsigned i, unsigned peers,
+		    const char *unit)
+{
+	const struct top *t = &live->topv[m][i];
+
+	if (i >= live->topc[m])
+		buf[0] = '\0';
+	else if (peers > 1)
+		re_snprintf(buf, sz, "#%u/%u %.2f %s",
+			    t->s / peers, t->s % peers, t->val, unit);
+	else
+		re_snprintf(buf, sz, "#%u %.2f %s", t->s, t->val, unit);
+}
+
+
+/*
+ * Redraw the view in place on stderr, once per PRINT_INTERVAL. The new
+ * events are printed above it, so they scroll up and stay readable.
+ */
+void live_print(struct live *live, struct allocator *allocator,
+		uint64_t elapsed)
+{
+	uint64_t now = tmr_jiffies();
+	unsigned i, b, peers;
+
+	if (!live || !allocator)
+		return;
+
+	if (now < live->ts_print + PRINT_INTERVAL)
+		return;
+
+	live->ts_print = now;
+	peers = max(allocator->peers, 1);
+
+	if (live->lines)
+		re_fprintf(stderr, "\r\x1b[%uA\x1b[J", live->lines);
+	else
+		re_fprintf(stderr, "\r\x1b[J");
+
+	events_flush(&allocator->events);
+
+	re_fprintf(stderr, "live: %llu s, %u streams, scan cycle %llu ms\n",
+		   (unsigned long long)elapsed, allocator_streams(allocator),
+		   (unsigned long long)live->cycle);
+
+	re_fprintf(stderr, "recv rate of target:");
+	for (b = 0; b < LIVE_BUCKETS; b++) {
+		re_fprintf(stderr, "  %s %u", bucket_namev[b],
+			   live->bucketv[b]);
+	}
+	re_fprintf(stderr, "\n");
+
+	re_fprintf(stderr, "%-24s %-24s %-24s\n",
+		   "worst loss", "worst latency", "worst rate deficit");
+
+	for (i = 0; i < LIVE_TOP; i++) {
+
+		char loss[32], lat[32], deficit[32];
+
+		top_fmt(loss, sizeof(loss), live, METRIC_LOSS, i, peers, "%");
+		top_fmt(lat, sizeof(lat), live, METRIC_LATENCY, i, peers,
+			"ms");
+		top_fmt(deficit, sizeof(deficit), live, METRIC_DEFICIT, i,
+			peers, "%");
+
+		re_fprintf(stderr, "%-24s %-24s %-24s\n", loss, lat, deficit);
+	}
+
+	live->lines = 3 + LIVE_TOP;
+}
@@ -16,26 +16,62 @@
 
 static struct {
 	const char *user, *pass;
-	struct sa srv;
+	const char *cred_file;        /* one user:password per line */
+	const char *secret;           /* TURN REST shared secret */
+	struct creds *creds;
 	int proto;
+	bool secure;
+	uint16_t port;                /* explicit server port, or zero */
 	int err;
 	unsigned bitrate;
 	size_t psize;
 	struct tmr tmr_grace;
-	struct tls *tls;
+	struct tls *tls;              /* TLS over TCP */
+	struct tls *dtls;
+	const char *scenario;         /* scenario file with groups */
 	struct stun_dns *dns;
+	struct cluster *cluster;      /* all servers in DNS */
+	bool cluster_all;
 	bool turn_ind;
+	int ind_pct;                  /* A/B split, -1 if not used */
+	struct sa *laddrv;            /* pool of local addresses */
+	unsigned laddrc;
+	bool uring;                   /* io_uring datapath for senders */
+	bool gso;                     /* UDP GSO for packet trains */
+	struct relay *relay;          /* built-in TURN relay */
+	struct sa relay_addr;
+	bool relay_only;
+	bool relay_local;
+	bool allocs_set;              /* -a was given */
+	const char *result_path;      /* write a result file */
+	const char *dump_path;        /* one record per allocation */
+	bool compare;                 /* compare two result files */
+	double max_tput_drop;         /* [percent] */
+	double max_p99_rise;          /* [percent] */
+	unsigned duration;            /* measurement window [s] */
+	unsigned warmup;              /* [s] */
+	unsigned cooldown;            /* [s] */
+	struct tmr tmr_phase;
+	bool resume;                  /* TLS/DTLS session resumption */
+	bool dealloc;                 /* release allocations at the end */
+	double dealloc_rate;          /* [1/s], zero is all at once */
 } turnperf = {
 	.user    = "demo",
 	.pass    = "secret",
 	.proto   = IPPROTO_UDP,
 	.bitrate = 64000,
-	.psize   = 160
+	.psize   = 160,
+	.ind_pct = -1,
+	.max_tput_drop = 5.0,
+	.max_p99_rise  = 20.0,
 };
 
 
 static struct allocator gallocator = {
 	.num_allocations = 100,
+	.sockbuf = SOCKBUF_DEFAULT,
+	.weighted = true,
+	.stall_ms = STALL_MS,
 };
 
 
@@ -46,6 +82,145 @@ static void terminate(int err)
 }
 
 
+static void dealloc_handler(void *arg)
+{
+	(void)arg;
+	re_cancel();
+}
+
+
+static void tmr_grace_handler(void *arg)
+{
+	(void)arg;
+
+	if (turnperf.dealloc &&
+	    0 == allocator_dealloc_start(&gallocator, turnperf.dealloc_rate,
+					 dealloc_handler, NULL))
+		return;
+
+	re_cancel();
+}
+
+
+static void run_stop(void)
+{
+	time_t duration = time(NULL) - gallocator.traf_start_time;
+
+	tmr_cancel(&turnperf.tmr_phase);
+
+	allocator_stop_senders(&gallocator);
+
+	re_printf("total duration: %H\n", fmt_human_time, &duration);
+
+	re_printf("wait 1 second for traffic to settle..\n");
+	tmr_start(&turnperf.tmr_grace, 1000, tmr_grace_handler, 0);
+}
+
+
+static void tmr_cooldown_handler(void *arg)
+{
+	(void)arg;
+
+	re_fprintf(stderr, "\n");
+	run_stop();
+}
+
+
+static void tmr_measure_handler(void *arg)
+{
+	(void)arg;
+
+	allocator_measure_stop(&gallocator);
+
+	re_fprintf(stderr, "\rmeasurement done, cool-down for %u seconds\n",
+		   turnperf.cooldown);
+
+	tmr_start(&turnperf.tmr_phase, turnperf.cooldown * 1000,
+		  tmr_cooldown_handler, NULL);
+}
+
+
+static void tmr_warmup_handler(void *arg)
+{
+	(void)arg;
+
+	allocator_measure_start(&gallocator);
+
+	re_fprintf(stderr, "\rwarm-up done, measuring\n");
+
+	if (turnperf.duration) {
+		tmr_start(&turnperf.tmr_phase, turnperf.duration * 1000,
+			  tmr_measure_handler, NULL);
+	}
+}
+
+
+/* all allocations are either ok or failed, start the traffic */
+static void ramp_check(struct allocator *allocator)
+{
+	int err;
+
+	if (allocator->tock ||
+	    allocator->num_received + allocator->num_failed <
+	    allocator->num_allocations)
+		return;
+
+	allocator->tock = tmr_jiffies();
+
+	if (!allocator->num_received) {
+		re_fprintf(stderr, "\nall allocations failed\n");
+		allocator_show_summary(allocator);
+		terminate(EPROTO);
+		return;
+	}
+
+	if (allocator->num_failed) {
+		re_printf("\n%u allocations are ok, %u failed.\n",
+			  allocator->num_received, allocator->num_failed);
+	}
+	else {
+		re_printf("all allocations are ok.\n");
+	}
+
+	if (allocator->server_info) {
+		re_printf("\nserver:  %s, authentication=%s\n",
+			  allocator->server_software,
+			  allocator->server_auth ? "yes" : "no");
+		re_printf("         lifetime is %u seconds\n",
+			  allocator->lifetime);
+		re_printf("\n");
+		re_printf("public address: %j\n",
+			  &allocator->mapped_addr);
+	}
+
+	allocator_show_summary(allocator);
+	handshake_print(&allocator->hs_tls, "TLS");
+	handshake_print(&allocator->hs_dtls, "DTLS");
+
+	err = allocator_start_senders(allocator);
+	if (err) {
+		re_fprintf(stderr, "failed to start senders (%m)\n", err);
+		terminate(err);
+	}
+#if 0
+	tmr_debug();
+#endif
+
+	allocator->traf_start_time = time(NULL);
+
+	/* the statistics cover only the measurement window */
+	if (turnperf.warmup) {
+		re_printf("warm-up for %u seconds\n", turnperf.warmup);
+		tmr_start(&turnperf.tmr_phase, turnperf.warmup * 1000,
+			  tmr_warmup_handler, NULL);
+	}
+	else if (turnperf.duration) {
+		tmr_start(&turnperf.tmr_phase, turnperf.duration * 1000,
+			  tmr_measure_handler, NULL);
+	}
+}
+
+
 static void allocation_handler(int err, uint16_t scode, const char *reason,
 			       const struct sa *srv,  const struct sa *relay,
 			       void *arg)
@@ -54,56 +229,57 @@ static void allocation_handler(int err, uint16_t scode, const char *reason,
 	(void)srv;
 	(void)relay;
 
+	/* failures are counted and retried by the allocation */
 	if (err || scode) {
-		re_fprintf(stderr, "allocation failed (%m %u %s)\n",
-			   err, scode, reason);
-		terminate(err ? err : EPROTO);
-		return;
+		re_fprintf(stderr, "\rallocation failed (%m %u %s)\n",
+			   err, scode, reason ? reason : "");
+	}
+	else {
+		allocator->num_received++;
 	}
 
-	allocator->num_received++;
+	re_fprintf(stderr, "\r[ allocations: %u ok, %u failed ]",
+		   allocator->num_received, allocator->num_failed);
 
-	re_fprintf(stderr, "\r[ allocations: %u ]", allocator->num_received);
+	ramp_check(allocator);
+}
 
-	if (allocator->num_received >= allocator->num_allocations) {
 
-		re_printf("all allocations are ok.\n");
+/* the group that is furthest behind, so all groups ramp up together */
+static struct group *group_next(struct allocator *allocator, unsigned *ixp)
+{
+	unsigned i, ix = 0;
+	bool found = false;
 
-		if (allocator->server_info) {
-			re_printf("\nserver:  %s, authentication=%s\n",
-				  allocator->server_software,
-				  allocator->server_auth ? "yes" : "no");
-			re_printf("         lifetime is %u seconds\n",
-				  allocator->lifetime);
-			re_printf("\n");
-			re_printf("public address: %j\n",
-				  &allocator->mapped_addr);
-		}
+	for (i = 0; i < allocator->groupc; i++) {
 
-		allocator->tock = tmr_jiffies();
+		const struct group *grp = &allocator->groupv[i];
+		const struct group *best = &allocator->groupv[ix];
 
-		allocator_show_summary(allocator);
+		if (grp->count >= grp->num_allocations)
+			continue;
 
-		err = allocator_start_senders(allocator, turnperf.bitrate,
-					      turnperf.psize);
-		if (err) {
-			re_fprintf(stderr, "failed to start senders (%m)\n",
-				   err);
-			terminate(err);
+		if (!found || (uint64_t)grp->count * best->num_allocations <
+		    (uint64_t)best->count * grp->num_allocations) {
+			ix = i;
+			found = true;
 		}
-#if 0
-		tmr_debug();
-#endif
-
-		allocator->traf_start_time = time(NULL);
 	}
+
+	*ixp = ix;
+
+	return &allocator->groupv[ix];
 }
 
 
 static void tmr_handler(void *arg)
 {
 	struct allocator *allocator = arg;
-	unsigned i;
+	struct group *grp;
+	struct tls *tls = NULL;
+	struct sa srv;
+	char user[256], pass[128];
+	unsigned i, group, server;
 	int err;
 
 	if (allocator->num_sent >= allocator->num_allocations) {
@@ -112,23 +288,47 @@ static void tmr_handler(void *arg)
 
 	i = allocator->num_sent;
 
-	err = allocation_create(allocator, i, turnperf.proto, &turnperf.srv,
-				turnperf.user, turnperf.pass,
-				turnperf.tls, turnperf.turn_ind,
+	grp    = group_next(allocator, &group);
+	server = allocator_server_next(allocator);
+
+	/* a group with the other kind of transport uses its default port */
+	srv = allocator->serverv[server].addr;
+	if (!turnperf.port && grp->secure != turnperf.secure)
+		sa_set_port(&srv, grp->secure ? STUNS_PORT : STUN_PORT);
+
+	if (grp->secure)
+		tls = grp->proto == IPPROTO_UDP ? turnperf.dtls : turnperf.tls;
+
+	/* every allocation has its own credentials */
+	err = creds_get(turnperf.creds, i, grp->user, grp->pass,
+			user, sizeof(user), pass, sizeof(pass));
+	if (err)
+		goto out;
+
+	/* spread the allocations round-robin over the local addresses */
+	err = allocation_create(allocator, i, group, server, grp->proto, &srv,
+				turnperf.laddrc
+				? &turnperf.laddrv[i % turnperf.laddrc] : NULL,
+				user, pass, tls, grp->turn_ind,
 				allocation_handler, allocator);
+
+ out:
 	if (err) {
 		re_fprintf(stderr, "creating allocation number %u failed"
 			   " (%m)\n", i, err);
-		goto out;
+
+		/* e.g. out of sockets, count it and carry on */
+		allocator_count_error(allocator, err, 0, NULL);
+		allocator->num_failed++;
 	}
 
+	++grp->count;
 	allocator->num_sent++;
 
 	tmr_start(&allocator->tmr, rand_u16()&3, tmr_handler, allocator);
 
- out:
 	if (err)
-		terminate(err);
+		ramp_check(allocator);
 }
 
 
@@ -142,13 +342,6 @@ static void allocator_start(struct allocator *allocator)
 }
 
 
-static void tmr_grace_handler(void *arg)
-{
-	(void)arg;
-	re_cancel();
-}
-
-
 static void signal_handler(int signum)
 {
 	static bool term = false;
@@ -163,14 +356,7 @@ static void signal_handler(int signum)
 	term = true;
 
 	if (gallocator.num_received > 0) {
-		time_t duration = time(NULL) - gallocator.traf_start_time;
-
-		allocator_stop_senders(&gallocator);
-
-		re_printf("total duration: %H\n", fmt_human_time, &duration);
-
-		re_printf("wait 1 second for traffic to settle..\n");
-		tmr_start(&turnperf.tmr_grace, 1000, tmr_grace_handler, 0);
+		run_stop();
 	}
 	else {
 		re_cancel();
@@ -187,7 +373,9 @@ static void dns_handler(int err, const struct sa *srv, void *arg)
 
 	re_printf("resolved TURN-server: %J\n", srv);
 
-	turnperf.srv = *srv;
+	err = allocator_server_add(&gallocator, srv, 1, NULL);
+	if (err)
+		goto out;
 
 	/* create a bunch of allocations, with timing */
 	allocator_start(&gallocator);
@@ -198,30 +386,277 @@ static void dns_handler(int err, const struct sa *srv, void *arg)
 }
 
 
+static void servers_print(const struct allocator *allocator)
+{
+	unsigned i;
+
+	re_printf("spreading allocations over %u servers (%s):\n",
+		  allocator->serverc,
+		  allocator->weighted ? "weighted" : "round-robin");
+
+	for (i = 0; i < allocator->serverc; i++) {
+		re_printf("  %J weight=%u\n", &allocator->serverv[i].addr,
+			  allocator->serverv[i].weight);
+	}
+}
+
+
+static void cluster_handler(int err, void *arg)
+{
+	(void)arg;
+
+	if (err) {
+		terminate(err);
+		return;
+	}
+
+	servers_print(&gallocator);
+
+	/* create a bunch of allocations, with timing */
+	allocator_start(&gallocator);
+}
+
+
+/*
+ * The workload is split into groups of allocations: one group from the
+ * command line, two for a channel/indication split, or the groups of
+ * a scenario file. Returns the total number of allocations.
+ */
+static int groups_setup(struct allocator *allocator)
+{
+	struct group def;
+	unsigned i, n = 0;
+	int err = 0;
+
+	memset(&def, 0, sizeof(def));
+	def.num_allocations = allocator->num_allocations;
+	def.proto    = turnperf.proto;
+	def.secure   = turnperf.secure;
+	def.bitrate  = turnperf.bitrate;
+	def.psize    = turnperf.psize;
+	def.turn_ind = turnperf.turn_ind;
+	str_ncpy(def.user, turnperf.user, sizeof(def.user));
+	str_ncpy(def.pass, turnperf.pass, sizeof(def.pass));
+
+	if (turnperf.scenario) {
+
+		err = scenario_load(allocator, turnperf.scenario, &def);
+		if (err)
+			return err;
+
+		/* the server is resolved for the transport of group 0 */
+		turnperf.proto  = allocator->groupv[0].proto;
+		turnperf.secure = allocator->groupv[0].secure;
+	}
+	else if (turnperf.ind_pct >= 0) {
+		struct group ind = def;
+
+		ind.num_allocations = def.num_allocations *
+			turnperf.ind_pct / 100;
+		ind.turn_ind = true;
+
+		def.num_allocations -= ind.num_allocations;
+		def.turn_ind = false;
+
+		err  = allocator_group_add(allocator, "channels", &def);
+		err |= allocator_group_add(allocator, "indications", &ind);
+	}
+	else {
+		err = allocator_group_add(allocator, "default", &def);
+	}
+	if (err)
+		return err;
+
+	for (i = 0; i < allocator->groupc; i++)
+		n += allocator->groupv[i].num_allocations;
+
+	allocator->num_allocations = n;
+
+	return 0;
+}
+
+
+/*
+ * The workload of the result. The groups of a scenario file have their
+ * own values, the configuration is only "mixed" if they differ.
+ */
+static void result_config(struct result *res,
+			  const struct allocator *allocator)
+{
+	const struct group *grp = &allocator->groupv[0];
+	unsigned i;
+
+	res->protocol = protocol_name(turnperf.proto, turnperf.secure);
+	res->bitrate  = turnperf.bitrate;
+	res->psize    = turnperf.psize;
+	res->turn_ind = turnperf.turn_ind;
+	res->ind_pct  = turnperf.ind_pct;
+
+	if (!turnperf.scenario || !allocator->groupc)
+		return;
+
+	res->bitrate  = grp->bitrate;
+	res->psize    = grp->psize;
+	res->turn_ind = grp->turn_ind;
+
+	for (i = 1; i < allocator->groupc; i++) {
+
+		const struct group *g = &allocator->groupv[i];
+
+		if (g->proto != grp->proto || g->secure != grp->secure ||
+		    g->bitrate != grp->bitrate || g->psize != grp->psize ||
+		    g->turn_ind != grp->turn_ind)
+			res->mixed = true;
+	}
+
+	if (res->mixed) {
+		res->protocol = "mixed";
+		res->bitrate  = 0;
+		res->psize    = 0;
+		res->turn_ind = false;
+	}
+}
+
+
+static void groups_print(const struct allocator *allocator)
+{
+	unsigned i;
+
+	for (i = 0; i < allocator->groupc; i++) {
+
+		const struct group *grp = &allocator->groupv[i];
+
+		re_printf("group %s: %u allocations, %s %s, %u bit/s,"
+			  " psize=%zu", grp->name, grp->num_allocations,
+			  protocol_name(grp->proto, grp->secure),
+			  grp->turn_ind ? "indications" : "channels",
+			  grp->bitrate, grp->psize);
+		if (grp->off_ms) {
+			re_printf(", on/off %u/%u ms",
+				  grp->on_ms, grp->off_ms);
+		}
+		if (grp->start_ms)
+			re_printf(", start after %u ms", grp->start_ms);
+		re_printf("\n");
+	}
+}
+
+
+static int tls_setup(struct tls **tlsp, enum tls_method method,
+		     struct handshake *hs)
+{
+	int err;
+
+	if (*tlsp)
+		return 0;
+
+	err = tls_alloc(tlsp, method, NULL, NULL);
+	if (err)
+		return err;
+
+	err = handshake_init(hs, *tlsp, turnperf.resume);
+	if (err == ENOSYS && !turnperf.resume) {
+		err = 0;
+	}
+	else if (err) {
+		re_fprintf(stderr, "could not setup TLS session"
+			   " resumption (%m)\n", err);
+	}
+
+	return err;
+}
+
+
 static void usage(void)
 {
 	re_fprintf(stderr,
 			 "turnperf -ihtT -u <user> -p <pass> "
-			 "-P <port> turn-server\n");
+			 "-P <port> -L <addrs> turn-server\n");
+	re_fprintf(stderr,
+			 "turnperf [options] addr[:port][=weight],...\n");
+	re_fprintf(stderr,
+			 "turnperf -l [options]\n");
+	re_fprintf(stderr,
+			 "turnperf -S <addr:port>\n");
+	re_fprintf(stderr,
+			 "turnperf -C [-x <pct>] [-y <pct>]"
+			 " baseline.json current.json\n");
 	re_fprintf(stderr, "\t-h            Show summary of options\n");
 	re_fprintf(stderr, "\t-m <method>   Use async polling method\n");
+	re_fprintf(stderr, "\t-d <datapath> Sender datapath"
+		   " (poll, io_uring)\n");
+	re_fprintf(stderr, "\t-L <addrs>    Local addresses or CIDR-blocks"
+		   " (comma-separated)\n");
+	re_fprintf(stderr, "\t-l            Run against a built-in local"
+		   " TURN relay\n");
+	re_fprintf(stderr, "\t-S <addr>     Run only a built-in TURN relay"
+		   " on addr:port\n");
+	re_fprintf(stderr, "\t              for -a allocations"
+		   " (default %u)\n", RELAY_CAPACITY);
+	re_fprintf(stderr, "\t-o <file>     Write the results to a JSON"
+		   " file\n");
+	re_fprintf(stderr, "\t-O <file>     Write one record per allocation"
+		   " (CSV, binary if .bin)\n");
+	re_fprintf(stderr, "\t-V            Live view of the worst"
+		   " allocations\n");
+	re_fprintf(stderr, "\n");
+	re_fprintf(stderr, "Compare options:\n");
+	re_fprintf(stderr, "\t-C            Compare two result files\n");
+	re_fprintf(stderr, "\t-x <pct>      Max throughput drop"
+		   " (default 5%%)\n");
+	re_fprintf(stderr, "\t-y <pct>      Max p99 latency increase"
+		   " (default 20%%)\n");
 	re_fprintf(stderr, "\n");
 	re_fprintf(stderr, "TURN server options:\n");
 	re_fprintf(stderr, "\t-u <user>     TURN Username\n");
 	re_fprintf(stderr, "\t-p <pass>     TURN Password\n");
+	re_fprintf(stderr, "\t              (%%u in user or pass is the"
+		   " allocation number)\n");
+	re_fprintf(stderr, "\t-U <file>     Credentials file, one"
+		   " user:password per line\n");
+	re_fprintf(stderr, "\t-K <secret>   TURN REST API shared secret,"
+		   " time-limited credentials\n");
 	re_fprintf(stderr, "\t-P <port>     TURN Server port\n");
+	re_fprintf(stderr, "\t-A            Use all servers of the domain"
+		   " (SRV and A records)\n");
+	re_fprintf(stderr, "\t-M <mode>     Server selection, rr or weight"
+		   " (default)\n");
 	re_fprintf(stderr, "\t-i            Use data/send indications\n");
+	re_fprintf(stderr, "\t-I <pct>      Use data/send indications for"
+		   " pct%% of the allocations,\n"
+		   "\t              and channels for the rest\n");
 	re_fprintf(stderr, "\n");
 	re_fprintf(stderr, "Traffic options:\n");
 	re_fprintf(stderr, "\t-a <num>      Number of TURN allocations\n");
+	re_fprintf(stderr, "\t-f <file>     Scenario file with groups of"
+		   " allocations\n");
+	re_fprintf(stderr, "\t-N <num>      Peers per allocation, each"
+		   " with its own stream (default 1)\n");
+	re_fprintf(stderr, "\t-R <num>      Retries per failed allocation"
+		   " (default 0)\n");
+	re_fprintf(stderr, "\t-e <rate>     Release the allocations at the"
+		   " end, per second (0 is all at once)\n");
 	re_fprintf(stderr, "\t-b <bitrate>  Bitrate per allocation"
 		   " (bits/s)\n");
 	re_fprintf(stderr, "\t-s <bytes>    Packet size in bytes\n");
+	re_fprintf(stderr, "\t-F <window>   Flood mode, unpaced with up"
+		   " to window packets in flight\n");
+	re_fprintf(stderr, "\t-G            Send packet trains with UDP"
+		   " GSO, late senders catch up\n");
+	re_fprintf(stderr, "\t-B <bytes>    UDP socket buffer size\n");
+	re_fprintf(stderr, "\t-r <secs>     Run duration, measured part"
+		   " (default until Ctrl-C)\n");
+	re_fprintf(stderr, "\t-w <secs>     Warm-up period, not measured\n");
+	re_fprintf(stderr, "\t-c <secs>     Cool-down period, not"
+		   " measured (needs -r)\n");
+	re_fprintf(stderr, "\t-W <ms>       Report gaps between packets"
+		   " as stalls (default %u, 0 is off)\n", STALL_MS);
 	re_fprintf(stderr, "\n");
 	re_fprintf(stderr, "Transport options (default is UDP):\n");
 	re_fprintf(stderr, "\t-t            Use TCP\n");
 	re_fprintf(stderr, "\t-T            Use TLS\n");
 	re_fprintf(stderr, "\t-D            Use DTLS\n");
+	re_fprintf(stderr, "\t-z            Resume TLS/DTLS sessions\n");
 }
 
 
@@ -229,16 +664,23 @@ int main(int argc, char *argv[])
 {
 	struct dnsc *dnsc = NULL;
 	enum poll_method method = poll_method_best();
+	struct sa srv;
 	const char *host;
-	bool secure = false;
 	uint64_t dport = STUN_PORT;
-	uint16_t port = 0;
-	int maxfds = 4096;
+	size_t psize_max = 0;
+	unsigned maxfds;
+	unsigned nports;
+	unsigned socks;
+	unsigned allocs;
+	bool tcp = false;
+	unsigned i;
 	int err = 0;
 
 	for (;;) {
 
-		const int c = getopt(argc, argv, "a:b:s:u:p:P:tTDhim:");
+		const int c = getopt(argc, argv,
+				     "a:b:s:u:p:P:tTDhim:L:d:GB:lS:o:Cx:y:"
+				     "r:w:c:R:e:zI:f:AM:N:U:K:VO:W:F:");
 		if (0 > c)
 			break;
 
@@ -246,12 +688,78 @@ int main(int argc, char *argv[])
 
 		case 'a':
 			gallocator.num_allocations = atoi(optarg);
+			turnperf.allocs_set = true;
 			break;
 
 		case 'b':
 			turnperf.bitrate = atoi(optarg);
 			break;
 
+		case 'R':
+			gallocator.retry_max = atoi(optarg);
+			break;
+
+		case 'N':
+			gallocator.peers = atoi(optarg);
+			if (gallocator.peers < 1 ||
+			    gallocator.peers > PEERS_MAX) {
+				re_fprintf(stderr, "number of peers must be"
+					   " 1 to %u\n", PEERS_MAX);
+				return EINVAL;
+			}
+			break;
+
+		case 'W':
+			/* a negative value wraps, and is out of range */
+			gallocator.stall_ms = atoi(optarg);
+			if (gallocator.stall_ms > STALL_MS_MAX) {
+				re_fprintf(stderr, "stall threshold must be"
+					   " 0 to %u ms\n", STALL_MS_MAX);
+				return EINVAL;
+			}
+			break;
+
+		case 'F':
+			gallocator.flood_window = atoi(optarg);
+			if (gallocator.flood_window < 1 ||
+			    gallocator.flood_window > FLOOD_WINDOW_MAX) {
+				re_fprintf(stderr, "flood window must be"
+					   " 1 to %u\n", FLOOD_WINDOW_MAX);
+				return EINVAL;
+			}
+			break;
+
+		case 'f':
+			turnperf.scenario = optarg;
+			break;
+
+		case 'A':
+			turnperf.cluster_all = true;
+			break;
+
+		case 'M':
+			if (0 == str_casecmp(optarg, "rr")) {
+				gallocator.weighted = false;
+			}
+			else if (0 == str_casecmp(optarg, "weight")) {
+				gallocator.weighted = true;
+			}
+			else {
+				re_fprintf(stderr, "unknown server selection"
+					   " '%s'\n", optarg);
+				return EINVAL;
+			}
+			break;
+
+		case 'z':
+			turnperf.resume = true;
+			break;
+
+		case 'e':
+			turnperf.dealloc = true;
+			turnperf.dealloc_rate = atof(optarg);
+			break;
+
 		case 's':
 			turnperf.psize = atoi(optarg);
 			break;
@@ -264,12 +772,29 @@ int main(int argc, char *argv[])
 			turnperf.pass = optarg;
 			break;
 
+		case 'U':
+			turnperf.cred_file = optarg;
+			break;
+
+		case 'K':
+			turnperf.secret = optarg;
+			break;
+
 		case 'i':
 			turnperf.turn_ind = true;
 			break;
 
+		case 'I':
+			turnperf.ind_pct = atoi(optarg);
+			if (turnperf.ind_pct < 0 || turnperf.ind_pct > 100) {
+				re_fprintf(stderr, "invalid percentage '%s'\n",
+					   optarg);
+				return EINVAL;
+			}
+			break;
+
 		case 'P':
-			port = atoi(optarg);
+			turnperf.port = atoi(optarg);
 			break;
 
 		case 't':
@@ -278,12 +803,100 @@ int main(int argc, char *argv[])
 
 		case 'T':
 			turnperf.proto = IPPROTO_TCP;
-			secure = true;
+			turnperf.secure = true;
 			break;
 
 		case 'D':
 			turnperf.proto = IPPROTO_UDP;
-			secure = true;
+			turnperf.secure = true;
+			break;
+
+		case 'B':
+			gallocator.sockbuf = atoi(optarg);
+			break;
+
+		case 'l':
+			turnperf.relay_local = true;
+			break;
+
+		case 'S':
+			err = sa_decode(&turnperf.relay_addr, optarg,
+					str_len(optarg));
+			if (err) {
+				re_fprintf(stderr, "invalid relay address"
+					   " '%s'\n", optarg);
+				return err;
+			}
+			turnperf.relay_only = true;
+			break;
+
+		case 'G':
+			turnperf.gso = true;
+			break;
+
+		case 'V':
+			gallocator.live_view = true;
+			break;
+
+		case 'o':
+			turnperf.result_path = optarg;
+			break;
+
+		case 'O':
+			turnperf.dump_path = optarg;
+			gallocator.dump = true;
+			break;
+
+		case 'C':
+			turnperf.compare = true;
+			break;
+
+		case 'x':
+			turnperf.max_tput_drop = atof(optarg);
+			break;
+
+		case 'y':
+			turnperf.max_p99_rise = atof(optarg);
+			break;
+
+		case 'r':
+			turnperf.duration = atoi(optarg);
+			break;
+
+		case 'w':
+			turnperf.warmup = atoi(optarg);
+			gallocator.warmup = turnperf.warmup != 0;
+			break;
+
+		case 'c':
+			turnperf.cooldown = atoi(optarg);
+			break;
+
+		case 'L':
+			err = laddr_pool_parse(&turnperf.laddrv,
+					       &turnperf.laddrc, optarg);
+			if (err)
+				return err;
+			break;
+
+		case 'd':
+			if (0 == str_casecmp(optarg, "io_uring")) {
+#ifdef USE_IO_URING
+				turnperf.uring = true;
+#else
+				re_fprintf(stderr, "io_uring datapath is not"
+					   " supported by this build\n");
+				return ENOSYS;
+#endif
+			}
+			else if (0 == str_casecmp(optarg, "poll")) {
+				turnperf.uring = false;
+			}
+			else {
+				re_fprintf(stderr, "unknown datapath '%s'\n",
+					   optarg);
+				return EINVAL;
+			}
 			break;
 
 		case 'm': {
@@ -308,12 +921,47 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (argc < 2 || argc != (optind + 1)) {
-		usage();
+	if (turnperf.compare) {
+
+		if (argc != (optind + 2)) {
+			usage();
+			return -EINVAL;
+		}
+
+		return result_compare(argv[optind], argv[optind + 1],
+				      turnperf.max_tput_drop,
+				      turnperf.max_p99_rise);
+	}
+
+	/* the cool-down follows the end of the measurement window */
+	if (turnperf.cooldown && !turnperf.duration) {
+		re_fprintf(stderr, "cool-down (-c) needs a run duration"
+			   " (-r)\n");
 		return -EINVAL;
 	}
 
-	host = argv[optind];
+	if (turnperf.relay_only || turnperf.relay_local) {
+
+		if (argc != optind) {
+			usage();
+			return -EINVAL;
+		}
+
+		if (turnperf.secure) {
+			re_fprintf(stderr, "the built-in relay does not"
+				   " support TLS or DTLS\n");
+			return -EINVAL;
+		}
+
+		host = NULL;
+	}
+	else if (argc < 2 || argc != (optind + 1)) {
+		usage();
+		return -EINVAL;
+	}
+	else {
+		host = argv[optind];
+	}
 
 	(void)sys_coredump_set(true);
 
@@ -323,24 +971,118 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
-	switch (method) {
+	err = groups_setup(&gallocator);
+	if (err)
+		goto out;
+
+	if (turnperf.cred_file || turnperf.secret) {
 
-	case METHOD_SELECT:
+		err = creds_alloc(&turnperf.creds, turnperf.cred_file,
+				  turnperf.secret, CRED_TTL);
+		if (err)
+			goto out;
+	}
+
+	for (i = 0; i < gallocator.groupc; i++) {
+
+		psize_max = max(psize_max, gallocator.groupv[i].psize);
+
+		if (gallocator.groupv[i].proto == IPPROTO_TCP)
+			tcp = true;
+
+		if (turnperf.relay_local && gallocator.groupv[i].secure) {
+			re_fprintf(stderr, "the built-in relay does not"
+				   " support TLS or DTLS\n");
+			err = EINVAL;
+			goto out;
+		}
+	}
+
+	/* the peers of an allocation are spread over the local addresses */
+	gallocator.laddrv = turnperf.laddrv;
+	gallocator.laddrc = turnperf.laddrc;
+
+	err = allocator_arena_alloc(&gallocator);
+	if (err) {
+		re_fprintf(stderr, "cannot allocate state for %u allocations:"
+			   " %m\n", gallocator.num_allocations, err);
+		goto out;
+	}
+
+#ifdef USE_IO_URING
+	/* the ring holds the burst of one tick, the rest is polled */
+	if (turnperf.uring) {
+		uint64_t entries;
+
+		entries = gallocator.arena_size * (uint64_t)SENDER_BURST_MAX;
+		entries = min(entries, URING_ENTRIES_MAX);
+		entries = min(entries, URING_BUFFERS_MAX / max(psize_max, 1));
+
+		err = uring_alloc(&gallocator.uring, (unsigned)entries,
+				  psize_max);
+		if (err) {
+			re_fprintf(stderr, "could not setup io_uring: %m\n",
+				   err);
+			goto out;
+		}
+	}
+#endif
+
+	/* every allocation needs a TURN socket and a socket per peer */
+	socks  = SOCKETS_PER_ALLOC - 1 + max(gallocator.peers, 1);
+	allocs = gallocator.num_allocations;
+
+	/*
+	 * The built-in relay has a relayed socket per allocation, and
+	 * an accepted connection per allocation over TCP. Run alone, it
+	 * serves RELAY_CAPACITY allocations, unless -a is given.
+	 */
+	if (turnperf.relay_only) {
+		socks = RELAY_SOCKETS;
+		if (!turnperf.allocs_set)
+			allocs = RELAY_CAPACITY;
+	}
+	else if (turnperf.relay_local) {
+		socks += tcp ? RELAY_SOCKETS : RELAY_SOCKETS - 1;
+	}
+
+	err = fd_limit_raise(&maxfds, allocs * socks + FD_RESERVE);
+	if (err) {
+		re_fprintf(stderr, "cannot raise open files limit: %m\n",
+			   err);
+		goto out;
+	}
+
+	if (method == METHOD_SELECT && maxfds > 1024)
 		maxfds = 1024;
-		break;
 
-	default:
-		maxfds = 32768;
-		break;
+	if (maxfds < allocs * socks) {
+		re_fprintf(stderr, "warning: maxfds=%u is too low for"
+			   " %u allocations\n", maxfds, allocs);
 	}
 
 	err = fd_setsize(maxfds);
 	if (err) {
-		re_fprintf(stderr, "cannot set maxfds to %d: %m\n",
+		re_fprintf(stderr, "cannot set maxfds to %u: %m\n",
 			   maxfds, err);
 		goto out;
 	}
 
+	/* each local address has its own range of ephemeral ports */
+	nports = ephemeral_port_count();
+	if (nports) {
+		uint64_t cap = (uint64_t)max(turnperf.laddrc, 1) *
+			nports / socks;
+
+		if (allocs > cap) {
+			re_fprintf(stderr, "warning: %u allocations need more"
+				   " than %u ephemeral ports on %u local"
+				   " address(es), use -L to add more\n",
+				   allocs, nports,
+				   max(turnperf.laddrc, 1));
+		}
+	}
+
 	err = poll_method_set(method);
 	if (err) {
 		re_fprintf(stderr, "could not set polling method '%s' (%m)\n",
@@ -348,26 +1090,62 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
-	re_printf("using async polling method '%s' with maxfds=%d\n",
+	re_printf("using async polling method '%s' with maxfds=%u\n",
 		  poll_method_name(method), maxfds);
+	re_printf("using sender datapath '%s'\n",
+		  turnperf.uring ? "io_uring" : "poll");
 
-	if (secure) {
-		switch (turnperf.proto) {
+	if (turnperf.gso) {
+		if (turnperf.uring) {
+			re_fprintf(stderr, "UDP GSO is not used with the"
+				   " io_uring datapath\n");
+		}
+		else if (udp_gso_supported()) {
+			gallocator.gso = true;
+			re_printf("using UDP GSO for packet trains\n");
+		}
+		else {
+			re_fprintf(stderr, "UDP GSO is not supported by the"
+				   " kernel, sending one packet at a time\n");
+		}
+	}
 
-		case IPPROTO_UDP:
-			err = tls_alloc(&turnperf.tls, TLS_METHOD_DTLSV1,
-					NULL, NULL);
-			break;
+	/* each transport that is used has its own TLS context */
+	for (i = 0; i < gallocator.groupc; i++) {
 
-		case IPPROTO_TCP:
-			err = tls_alloc(&turnperf.tls, TLS_METHOD_SSLV23,
-					NULL, NULL);
-			break;
+		const struct group *grp = &gallocator.groupv[i];
+
+		if (!grp->secure)
+			continue;
+
+		if (grp->proto == IPPROTO_UDP) {
+			err = tls_setup(&turnperf.dtls, TLS_METHOD_DTLSV1,
+					&gallocator.hs_dtls);
+		}
+		else {
+			err = tls_setup(&turnperf.tls, TLS_METHOD_SSLV23,
+					&gallocator.hs_tls);
 		}
 		if (err)
 			goto out;
+	}
 
+	if (turnperf.secure)
 		dport = STUNS_PORT;
+
+	if (turnperf.relay_only) {
+
+		err = relay_alloc(&turnperf.relay, &turnperf.relay_addr);
+		if (err)
+			goto out;
+
+		re_printf("TURN relay listening on %J (UDP and TCP)\n",
+			  relay_laddr(turnperf.relay));
+
+		re_main(signal_handler);
+
+		relay_print_stats(turnperf.relay);
+		goto out;
 	}
 
 	/* A new random cookie for each session */
@@ -380,18 +1158,85 @@ int main(int argc, char *argv[])
 	}
 
 	re_printf("turnperf version %s\n", VERSION);
-	re_printf("bitrate: %u bits/second (per allocation)\n",
-		  turnperf.bitrate);
 	re_printf("session cookie: 0x%08x\n", gallocator.session_cookie);
-	re_printf("using TURN %s\n",
-		  turnperf.turn_ind ? "DATA/SEND indications" : "Channels");
+	if (turnperf.scenario) {
+		re_printf("scenario: %s\n", turnperf.scenario);
+		groups_print(&gallocator);
+	}
+	else if (turnperf.ind_pct >= 0) {
+		re_printf("bitrate: %u bits/second (per allocation)\n",
+			  turnperf.bitrate);
+		re_printf("using TURN Channels (%d%%) and DATA/SEND"
+			  " indications (%d%%)\n",
+			  100 - turnperf.ind_pct, turnperf.ind_pct);
+	}
+	else {
+		re_printf("bitrate: %u bits/second (per allocation)\n",
+			  turnperf.bitrate);
+		re_printf("using TURN %s\n", turnperf.turn_ind
+			  ? "DATA/SEND indications" : "Channels");
+	}
+	if (gallocator.peers > 1) {
+		re_printf("peers: %u per allocation\n", gallocator.peers);
+	}
+	if (turnperf.cred_file) {
+		re_printf("credentials: %u users from %s\n",
+			  creds_count(turnperf.creds), turnperf.cred_file);
+	}
+	if (turnperf.secret) {
+		re_printf("credentials: TURN REST API, valid for %u"
+			  " seconds\n", CRED_TTL);
+	}
+	if (turnperf.laddrc) {
+		re_printf("local addresses: %u (first %j)\n",
+			  turnperf.laddrc, &turnperf.laddrv[0]);
+	}
+
+	if (turnperf.relay_local) {
+		struct sa laddr;
+
+		sa_set_str(&laddr, "127.0.0.1", turnperf.port);
+
+		err = relay_alloc(&turnperf.relay, &laddr);
+		if (err)
+			goto out;
+
+		err = allocator_server_add(&gallocator,
+					   relay_laddr(turnperf.relay),
+					   1, NULL);
+		if (err)
+			goto out;
+
+		re_printf("server: built-in relay %J protocol=%s\n",
+			  relay_laddr(turnperf.relay),
+			  protocol_name(turnperf.proto, turnperf.secure));
+
+		/* create a bunch of allocations, with timing */
+		allocator_start(&gallocator);
+	}
+	else if (strchr(host, ',')) {
 
-	if (0 == sa_set_str(&turnperf.srv, argv[optind],
-			    port ? port : dport)) {
+		err = cluster_parse(&gallocator, host,
+				    turnperf.port ? turnperf.port : dport);
+		if (err)
+			goto out;
 
-		re_printf("server: %J protocol=%s\n",
-			  &turnperf.srv,
-			  protocol_name(turnperf.proto, secure));
+		re_printf("server: cluster protocol=%s\n",
+			  protocol_name(turnperf.proto, turnperf.secure));
+		servers_print(&gallocator);
+
+		/* create a bunch of allocations, with timing */
+		allocator_start(&gallocator);
+	}
+	else if (0 == sa_set_str(&srv, host,
+				 turnperf.port ? turnperf.port : dport)) {
+
+		err = allocator_server_add(&gallocator, &srv, 1, NULL);
+		if (err)
+			goto out;
+
+		re_printf("server: %J protocol=%s\n", &srv,
+			  protocol_name(turnperf.proto, turnperf.secure));
 
 		/* create a bunch of allocations, with timing */
 		allocator_start(&gallocator);
@@ -399,10 +1244,11 @@ int main(int argc, char *argv[])
 	else {
 		const char *stun_proto, *stun_usage;
 
-		re_printf("server: %s protocol=%s\n",
-			  host, protocol_name(turnperf.proto, secure));
+		re_printf("server: %s protocol=%s\n", host,
+			  protocol_name(turnperf.proto, turnperf.secure));
 
-		stun_usage = secure ? stuns_usage_relay : stun_usage_relay;
+		stun_usage = turnperf.secure
+			? stuns_usage_relay : stun_usage_relay;
 
 		switch (turnperf.proto) {
 
@@ -419,10 +1265,20 @@ int main(int argc, char *argv[])
 			goto out;
 		}
 
-		err = stun_server_discover(&turnperf.dns, dnsc,
-                                           stun_usage, stun_proto,
-                                           AF_INET, host, port,
-                                           dns_handler, NULL);
+		if (turnperf.cluster_all) {
+			err = cluster_discover(&turnperf.cluster, dnsc,
+					       &gallocator, stun_usage,
+					       stun_proto, host,
+					       turnperf.port, dport,
+					       cluster_handler, NULL);
+		}
+		else {
+			err = stun_server_discover(&turnperf.dns, dnsc,
+						   stun_usage, stun_proto,
+						   AF_INET, host,
+						   turnperf.port,
+						   dns_handler, NULL);
+		}
 		if (err) {
 			re_fprintf(stderr, "stun discover failed (%m)\n",
 				   err);
@@ -439,14 +1295,66 @@ int main(int argc, char *argv[])
 	}
 
 	allocator_traffic_summary(&gallocator);
+	allocator_dealloc_print(&gallocator);
+	monitor_print(&gallocator.mon);
+	events_print(&gallocator.events);
+	stalls_print(&gallocator);
+	flood_print(&gallocator);
+#ifdef USE_IO_URING
+	uring_print_stats(gallocator.uring);
+#endif
+	relay_print_stats(turnperf.relay);
+
+	if (turnperf.result_path) {
+		struct result *res;
+		char server[256];
+
+		res = mem_zalloc(sizeof(*res), NULL);
+		if (!res) {
+			err = ENOMEM;
+			goto out;
+		}
+
+		if (host)
+			str_ncpy(server, host, sizeof(server));
+		else
+			re_snprintf(server, sizeof(server), "%J",
+				    &gallocator.serverv[0].addr);
+
+		res->server    = server;
+		res->software  = gallocator.server_software;
+		res->num_allocations = gallocator.num_allocations;
+
+		result_config(res, &gallocator);
+
+		allocator_get_result(&gallocator, res);
+
+		err = result_write(turnperf.result_path, res);
+		if (!err)
+			re_printf("results written to %s\n",
+				  turnperf.result_path);
+
+		mem_deref(res);
+	}
+
+	if (turnperf.dump_path)
+		err |= allocator_dump(&gallocator, turnperf.dump_path);
 
  out:
 	allocator_reset(&gallocator);
+	mem_deref(turnperf.relay);
 	mem_deref(dnsc);
 
 	tmr_cancel(&turnperf.tmr_grace);
+	tmr_cancel(&turnperf.tmr_phase);
+	handshake_close(&gallocator.hs_tls, turnperf.tls);
+	handshake_close(&gallocator.hs_dtls, turnperf.dtls);
 	mem_deref(turnperf.tls);
+	mem_deref(turnperf.dtls);
 	mem_deref(turnperf.dns);
+	mem_deref(turnperf.cluster);
+	mem_deref(turnperf.laddrv);
+	mem_deref(turnperf.creds);
 
 	libre_close();
 	mem_debug();
@@ -0,0 +1,161 @@
+/**
+ * @file monitor.c Self-monitoring of the turnperf client
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <re.h>
+#include "turnperf.h"
+
+
+enum {
+	SAMPLE_INTERVAL = 1000,        /* ms */
+	CPU_SATURATED   = 90,          /* percent of one core */
+};
+
+
+static double rusage_cpu(const struct rusage *ru)
+{
+	return (double)ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 +
+		(double)ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+
+static void tmr_sample_handler(void *arg)
+{
+	struct monitor *mon = arg;
+	struct rusage ru;
+	uint64_t now = time_usec();
+	double cpu;
+
+	tmr_start(&mon->tmr, SAMPLE_INTERVAL, tmr_sample_handler, mon);
+
+	if (0 != getrusage(RUSAGE_SELF, &ru))
+		return;
+
+	/* CPU usage of the last interval, in percent of one core */
+	if (now > mon->ts_sample) {
+		cpu = 100.0 * (rusage_cpu(&ru) - mon->cpu_sample) /
+			((now - mon->ts_sample) / 1e6);
+
+		if (cpu > mon->cpu_max)
+			mon->cpu_max = cpu;
+		if (cpu >= CPU_SATURATED)
+			++mon->n_saturated;
+	}
+
+	mon->ts_sample  = now;
+	mon->cpu_sample = rusage_cpu(&ru);
+}
+
+
+void monitor_start(struct monitor *mon)
+{
+	struct rusage ru;
+
+	if (!mon)
+		return;
+
+	hist_reset(&mon->lateness);
+	hist_reset(&mon->tick);
+
+	mon->ts_start  = time_usec();
+	mon->ts_sample = mon->ts_start;
+	mon->ts_stop   = 0;
+	mon->cpu_max   = 0;
+	mon->n_saturated = 0;
+
+	if (0 == getrusage(RUSAGE_SELF, &ru))
+		mon->cpu_start = mon->cpu_sample = rusage_cpu(&ru);
+
+	tmr_start(&mon->tmr, SAMPLE_INTERVAL, tmr_sample_handler, mon);
+}
+
+
+void monitor_stop(struct monitor *mon)
+{
+	struct rusage ru;
+
+	if (!mon || mon->ts_stop)
+		return;
+
+	tmr_cancel(&mon->tmr);
+
+	mon->ts_stop = time_usec();
+
+	if (0 == getrusage(RUSAGE_SELF, &ru)) {
+		mon->cpu_stop = rusage_cpu(&ru);
+		mon->maxrss   = ru.ru_maxrss;
+	}
+}
+
+
+/*
+ * Record one pacing tick: how late the timer fired compared to when
+ * it was scheduled, and how long the tick took to process.
+ */
+void monitor_tick(struct monitor *mon, uint64_t scheduled,
+		  uint64_t start, uint64_t end)
+{
+	if (!mon)
+		return;
+
+	if (scheduled)
+		hist_add(&mon->lateness, start > scheduled
+			 ? start - scheduled : 0);
+
+	hist_add(&mon->tick, end - start);
+}
+
+
+bool monitor_saturated(const struct monitor *mon)
+{
+	const uint64_t interval = PACING_INTERVAL_MS * 1000;
+
+	if (!mon)
+		return false;
+
+	return mon->n_saturated > 0 ||
+		hist_percentile(&mon->lateness, 99) > interval ||
+		hist_percentile(&mon->tick, 99) > interval;
+}
+
+
+void monitor_print(const struct monitor *mon)
+{
+	struct memstat mstat;
+	double wall, cpu;
+
+	if (!mon || !mon->ts_start)
+		return;
+
+	wall = ((mon->ts_stop ? mon->ts_stop : time_usec()) -
+		mon->ts_start) / 1e6;
+	cpu  = mon->cpu_stop - mon->cpu_start;
+
+	re_printf("client summary:\n");
+	re_printf("pacing timer lateness: %H\n", hist_print, &mon->lateness);
+	re_printf("pacing tick duration:  %H\n", hist_print, &mon->tick);
+	if (wall > 0) {
+		re_printf("cpu usage:             %.1f s (%.1f%% avg,"
+			  " %.1f%% max)\n",
+			  cpu, 100.0 * cpu / wall, mon->cpu_max);
+	}
+	re_printf("max resident memory:   %ld KB\n", mon->maxrss);
+
+	if (0 == mem_get_stat(&mstat)) {
+		re_printf("libre memory:          %zu bytes in %zu blocks"
+			  " (peak %zu bytes)\n",
+			  mstat.bytes_cur, mstat.blocks_cur,
+			  mstat.bytes_peak);
+	}
+
+	if (monitor_saturated(mon)) {
+		re_printf("\nWARNING: the turnperf client was saturated"
+			  " during the run, the results are suspect!\n");
+	}
+
+	re_printf("\n");
+}
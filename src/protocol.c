@@ -9,20 +9,32 @@
 #include "turnperf.h"
 
 
-static const uint32_t proto_magic = 'T'<<24 | 'P'<<16 | 'R'<<8 | 'F';
+/*
+ * The magic is "TPR" and the version of the header in the last byte.
+ * Version 1 was "TPRF", without the send time.
+ */
+enum {
+	PROTO_VERSION = 2,
+};
+
+static const uint32_t proto_magic = 'T'<<24 | 'P'<<16 | 'R'<<8;
+#define MAGIC_MASK 0xffffff00
 
 
 int protocol_encode(struct mbuf *mb,
 		    uint32_t session_cookie, uint32_t alloc_id,
-		    uint32_t seq, size_t payload_len, uint8_t pattern)
+		    uint32_t seq, uint64_t ts, size_t payload_len,
+		    uint8_t pattern)
 {
 	int err = 0;
 
-	err |= mbuf_write_u32(mb, htonl(proto_magic));
+	err |= mbuf_write_u32(mb, htonl(proto_magic | PROTO_VERSION));
 	err |= mbuf_write_u32(mb, htonl(session_cookie));
 	err |= mbuf_write_u32(mb, htonl(alloc_id));
 	err |= mbuf_write_u32(mb, htonl(seq));
 	err |= mbuf_write_u32(mb, htonl((uint32_t)payload_len));
+	err |= mbuf_write_u32(mb, htonl((uint32_t)(ts >> 32)));
+	err |= mbuf_write_u32(mb, htonl((uint32_t)ts));
 	err |= mbuf_fill(mb, pattern, payload_len);
 
 	return err;
@@ -40,24 +52,35 @@ int protocol_decode(struct hdr *hdr, struct mbuf *mb)
 
 	start = mb->pos;
 
-	if (mbuf_get_left(mb) < HDR_SIZE)
+	if (mbuf_get_left(mb) < 4)
 		return EBADMSG;
 
 	magic = ntohl(mbuf_read_u32(mb));
-	if (magic != proto_magic) {
+	if ((magic & MAGIC_MASK) != proto_magic) {
 		err = EBADMSG;
 		goto out;
 	}
 
+	/* a turnperf peer with another header version */
+	if ((magic & ~MAGIC_MASK) != PROTO_VERSION) {
+		err = EPROTONOSUPPORT;
+		goto out;
+	}
+
+	if (mbuf_get_left(mb) < HDR_SIZE - 4) {
+		err = EPROTO;
+		goto out;
+	}
+
 	hdr->session_cookie = ntohl(mbuf_read_u32(mb));
 	hdr->alloc_id       = ntohl(mbuf_read_u32(mb));
 	hdr->seq            = ntohl(mbuf_read_u32(mb));
 	hdr->payload_len    = ntohl(mbuf_read_u32(mb));
+	hdr->ts             = (uint64_t)ntohl(mbuf_read_u32(mb)) << 32;
+	hdr->ts            |= ntohl(mbuf_read_u32(mb));
 
+	/* truncated, the caller counts it */
 	if (mbuf_get_left(mb) < hdr->payload_len) {
-		re_fprintf(stderr, "receiver: header said %zu bytes,"
-			   " but payload is only %zu bytes\n",
-			   hdr->payload_len, mbuf_get_left(mb));
 		err = EPROTO;
 		goto out;
 	}
@@ -73,6 +96,31 @@ int protocol_decode(struct hdr *hdr, struct mbuf *mb)
 	if (err)
 		mb->pos = start;
 
+	return err;
+}
+
+
+/* the allocation-ID of a packet, without decoding it */
+int protocol_peek_id(const struct mbuf *mb, uint32_t *alloc_id)
+{
+	const uint8_t *p;
+	uint32_t v;
+
+	if (!mb || !alloc_id)
+		return EINVAL;
+
+	if (mbuf_get_left(mb) < HDR_SIZE)
+		return EBADMSG;
+
+	p = mbuf_buf(mb);
+
+	memcpy(&v, p, 4);
+	if (ntohl(v) != (proto_magic | PROTO_VERSION))
+		return EBADMSG;
+
+	memcpy(&v, p + 8, 4);
+	*alloc_id = ntohl(v);
+
 	return 0;
 }
 
@@ -87,6 +135,8 @@ void protocol_packet_dump(const struct hdr *hdr)
 	re_fprintf(stderr, "alloc_id:       %u\n", hdr->alloc_id);
 	re_fprintf(stderr, "seq:            %u\n", hdr->seq);
 	re_fprintf(stderr, "payload_len:    %u\n", hdr->payload_len);
+	re_fprintf(stderr, "timestamp:      %llu us\n",
+		   (unsigned long long)hdr->ts);
 	re_fprintf(stderr, "payload:        %w\n",
 		   hdr->payload, hdr->payload_len);
 	re_fprintf(stderr, "\n");
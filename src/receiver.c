@@ -10,7 +10,8 @@
 
 
 void receiver_init(struct receiver *recvr,
-		   uint32_t exp_cookie, uint32_t exp_allocid)
+		   uint32_t exp_cookie, uint32_t exp_allocid,
+		   struct histogram *lat, struct events *ev)
 {
 	if (!recvr)
 		return;
@@ -19,6 +20,114 @@ void receiver_init(struct receiver *recvr,
 
 	recvr->cookie = exp_cookie;
 	recvr->allocid = exp_allocid;
+	recvr->lat = lat;
+	recvr->ev = ev;
+	recvr->seq_hi = UINT32_MAX;
+}
+
+
+/*
+ * Count only the packets that were sent after sequence number "seq",
+ * including the ones that are still in flight. Everything counted so
+ * far is discarded.
+ */
+void receiver_window_start(struct receiver *recvr, uint32_t seq)
+{
+	if (!recvr)
+		return;
+
+	recvr->ts_start      = 0;
+	recvr->ts_last       = 0;
+	recvr->total_bytes   = 0;
+	recvr->total_packets = 0;
+	recvr->lat_sum       = 0;
+	recvr->lat_max       = 0;
+	recvr->dups          = 0;
+	recvr->reordered     = 0;
+
+	if (recvr->sk)
+		memset(recvr->sk, 0, sizeof(*recvr->sk));
+
+	recvr->seq_lo = seq + 1;
+	recvr->seq_hi = UINT32_MAX;
+}
+
+
+/* packets sent after sequence number "seq" are not counted */
+void receiver_window_stop(struct receiver *recvr, uint32_t seq)
+{
+	if (!recvr)
+		return;
+
+	recvr->seq_hi = seq;
+}
+
+
+/*
+ * Mark a sequence number as received, in the window of the last 64
+ * below the highest one. Returns true if it was received before. An
+ * older packet cannot be told apart, and counts as reordered.
+ */
+static bool seq_update(struct receiver *recvr, uint32_t seq)
+{
+	uint32_t d;
+	uint64_t bit;
+
+	if (seq > recvr->max_seq) {
+
+		d = seq - recvr->max_seq;
+
+		recvr->seq_map = d < 64 ? recvr->seq_map << d : 0;
+		recvr->seq_map |= 1;
+		recvr->max_seq = seq;
+
+		return false;
+	}
+
+	d = recvr->max_seq - seq;
+	if (d >= 64)
+		return false;
+
+	bit = 1ULL << d;
+	if (recvr->seq_map & bit)
+		return true;
+
+	recvr->seq_map |= bit;
+
+	return false;
+}
+
+
+/* a long gap since the last arrival, the relay or the path stalled */
+static void stall_check(struct receiver *recvr, uint64_t now)
+{
+	uint64_t gap;
+
+	if (!recvr->stall_min || !recvr->ts_arrival ||
+	    now < recvr->ts_arrival + recvr->stall_min)
+		return;
+
+	gap = now - recvr->ts_arrival;
+
+	++recvr->stallc;
+	recvr->stall_sum += gap;
+	recvr->stall_max  = max(recvr->stall_max, gap);
+
+	stalls_add(recvr->stalls, recvr->ts_arrival, now);
+}
+
+
+/* at the end of the traffic, a stream that is still stalled [ms] */
+void receiver_stall_flush(struct receiver *recvr, uint64_t now)
+{
+	if (!recvr)
+		return;
+
+	stall_check(recvr, now);
+
+	/* the gap is counted once, also if packets arrive later */
+	if (recvr->ts_arrival)
+		recvr->ts_arrival = now;
 }
 
 
@@ -27,59 +136,50 @@ int receiver_recv(struct receiver *recvr,
 {
 	struct hdr hdr;
 	uint64_t now = tmr_jiffies();
+	uint64_t lat = 0;
 	size_t start, sz;
+	bool late = false, dup;
 	int err;
 
 	if (!recvr || !mb)
 		return EINVAL;
 
-	if (!recvr->ts_start)
-		recvr->ts_start = now;
-	recvr->ts_last = now;
-
 	start = mb->pos;
 	sz = mbuf_get_left(mb);
 
 	/* decode packet */
 	err = protocol_decode(&hdr, mb);
 	if (err) {
+		mb->pos = start;
+
 		if (err == EBADMSG) {
-			re_fprintf(stderr, "[%u] ignore a non-Turnperf packet"
-				   " from %J (%zu bytes)\n",
-				   recvr->allocid, src, sz);
-			hexdump(stderr, mb->buf + start, sz);
+			events_add(recvr->ev, EVENT_FOREIGN, recvr->allocid,
+				   src, mb, 0, 0, 0);
 			return 0;
 		}
 
-		re_fprintf(stderr, "receiver: protocol decode"
-			   " error [%zu bytes from %J] (%m)\n", sz, src, err);
-		re_fprintf(stderr, "          %w\n", mb->buf + start, sz);
+		events_add(recvr->ev, EVENT_DECODE, recvr->allocid,
+			   src, mb, err, 0, 0);
 		return err;
 	}
 
 	/* verify packet */
 	if (hdr.session_cookie != recvr->cookie) {
-		re_fprintf(stderr, "invalid cookie received"
-			   " from %J [exp=%x, actual=%x] (%zu bytes)\n",
-			   src, recvr->cookie, hdr.session_cookie, sz);
-		protocol_packet_dump(&hdr);
+		events_add(recvr->ev, EVENT_COOKIE, recvr->allocid, src, NULL,
+			   0, recvr->cookie, hdr.session_cookie);
 		return EPROTO;
 	}
 	if (hdr.alloc_id != recvr->allocid) {
-		re_fprintf(stderr, "invalid allocation-ID received"
-			   " from %J [exp=%u, actual=%u] (%zu bytes)\n",
-			   src, hdr.alloc_id, recvr->allocid, sz);
-		protocol_packet_dump(&hdr);
+		events_add(recvr->ev, EVENT_ALLOC_ID, recvr->allocid, src,
+			   NULL, 0, recvr->allocid, hdr.alloc_id);
 		return EPROTO;
 	}
 
 	if (recvr->last_seq) {
 		if (hdr.seq <= recvr->last_seq) {
-			re_fprintf(stderr, "receiver[%u]: late or "
-				   " out-of-order packet from %J"
-				   " (last_seq=%u, seq=%u)\n",
-				   recvr->allocid, src,
-				   recvr->last_seq, hdr.seq);
+			late = true;
+			events_add(recvr->ev, EVENT_REORDER, recvr->allocid,
+				   src, NULL, 0, recvr->last_seq, hdr.seq);
 		}
 	}
 
@@ -87,6 +187,47 @@ int receiver_recv(struct receiver *recvr,
 	protocol_packet_dump(&hdr);
 #endif
 
+	/* sender and receiver share the same clock */
+	if (hdr.ts) {
+		const uint64_t now_us = time_usec();
+
+		lat = now_us > hdr.ts ? now_us - hdr.ts : 0;
+	}
+
+	stall_check(recvr, now);
+	recvr->ts_arrival = now;
+
+	/* a late packet does not move the flood window back */
+	dup = seq_update(recvr, hdr.seq);
+
+	/* the live view counts all packets */
+	recvr->live_packets += 1;
+	recvr->live_lat_sum += lat;
+
+	/* outside of the measurement window */
+	if (hdr.seq < recvr->seq_lo || hdr.seq > recvr->seq_hi) {
+		recvr->last_seq = hdr.seq;
+		return 0;
+	}
+
+	if (!recvr->ts_start)
+		recvr->ts_start = now;
+	recvr->ts_last = now;
+
+	if (hdr.ts) {
+		recvr->lat_sum += lat;
+		if (lat > recvr->lat_max)
+			recvr->lat_max = lat;
+
+		hist_add(recvr->lat, lat);
+		sketch_add(recvr->sk, lat);
+	}
+
+	if (dup)
+		++recvr->dups;
+	else if (late)
+		++recvr->reordered;
+
 	recvr->total_bytes   += sz;
 	recvr->total_packets += 1;
 
@@ -116,7 +257,34 @@ double receiver_get_bitrate(const struct receiver *recvr)
 {
 	double duration;
 
+	if (!recvr || recvr->ts_last <= recvr->ts_start)
+		return .0;
+
 	duration = recvr->ts_last - recvr->ts_start;
 
 	return recvr->total_bytes / (duration / 1000.0 / 8);
 }
+
+
+/* received packets per second */
+double receiver_get_pps(const struct receiver *recvr)
+{
+	double duration;
+
+	if (!recvr || recvr->ts_last <= recvr->ts_start)
+		return .0;
+
+	duration = recvr->ts_last - recvr->ts_start;
+
+	return recvr->total_packets / (duration / 1000.0);
+}
+
+
+/* average one-way latency [us] */
+double receiver_get_latency(const struct receiver *recvr)
+{
+	if (!recvr || !recvr->total_packets)
+		return .0;
+
+	return (double)recvr->lat_sum / (double)recvr->total_packets;
+}
@@ -0,0 +1,680 @@
+/**
+ * @file relay.c Minimal built-in TURN relay, for client self-benchmarks
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include "turnperf.h"
+
+
+/*
+ * Relay:
+ *
+ * - Allocate, Refresh, CreatePermission and ChannelBind requests
+ * - Send/Data indications and ChannelData
+ * - client transport is UDP or TCP, the relayed transport is UDP
+ * - no authentication and no lifetime expiry
+ * - the forwarding path does not allocate memory
+ */
+
+
+enum {
+	RELAY_LIFETIME = 600,
+	HASH_SIZE = 1024,
+	CHAN_MIN = 0x4000,
+	CHAN_MAX = 0x7fff,
+};
+
+
+struct relay {
+	struct udp_sock *us;
+	struct tcp_sock *ts;
+	struct sa laddr;
+	struct hash *ht_alloc;        /* UDP allocations by client address */
+	struct list connl;            /* TCP connections */
+	struct mbuf *mb_tx;           /* scratch buffer for ChannelData */
+
+	uint64_t n_alloc;
+	uint64_t n_tx;                /* packets forwarded to peers */
+	uint64_t n_rx;                /* packets forwarded to clients */
+	uint64_t n_drop;
+};
+
+struct relay_conn {
+	struct le le;
+	struct relay *relay;
+	struct tcp_conn *tc;
+	struct mbuf *mb;              /* TCP re-assembly buffer */
+	struct relay_alloc *alloc;
+	struct sa cli;
+};
+
+struct relay_alloc {
+	struct le he;                 /* hash element, UDP only */
+	struct relay *relay;
+	struct relay_conn *conn;      /* TCP only */
+	struct sa cli;
+	struct udp_sock *rel;
+	struct sa rel_addr;
+	struct list perml;
+	struct list chanl;
+};
+
+struct perm {
+	struct le le;
+	struct sa peer;
+};
+
+struct chan {
+	struct le le;
+	struct sa peer;
+	uint16_t numb;
+};
+
+
+static const char software[] = "turnperf relay v" VERSION;
+
+
+static void alloc_destructor(void *arg)
+{
+	struct relay_alloc *ra = arg;
+
+	hash_unlink(&ra->he);
+	list_flush(&ra->perml);
+	list_flush(&ra->chanl);
+	mem_deref(ra->rel);
+}
+
+
+static bool alloc_cmp_handler(struct le *le, void *arg)
+{
+	const struct relay_alloc *ra = le->data;
+
+	return sa_cmp(&ra->cli, arg, SA_ALL);
+}
+
+
+static struct relay_alloc *alloc_find(const struct relay *relay,
+				      const struct sa *cli)
+{
+	struct le *le;
+
+	le = hash_lookup(relay->ht_alloc, sa_hash(cli, SA_ALL),
+			 alloc_cmp_handler, (void *)cli);
+
+	return le ? le->data : NULL;
+}
+
+
+static bool perm_exists(const struct relay_alloc *ra, const struct sa *peer)
+{
+	struct le *le;
+
+	for (le = ra->perml.head; le; le = le->next) {
+		const struct perm *perm = le->data;
+
+		if (sa_cmp(&perm->peer, peer, SA_ADDR))
+			return true;
+	}
+
+	return false;
+}
+
+
+static int perm_add(struct relay_alloc *ra, const struct sa *peer)
+{
+	struct perm *perm;
+
+	if (perm_exists(ra, peer))
+		return 0;
+
+	perm = mem_zalloc(sizeof(*perm), NULL);
+	if (!perm)
+		return ENOMEM;
+
+	perm->peer = *peer;
+	list_append(&ra->perml, &perm->le, perm);
+
+	return 0;
+}
+
+
+static struct chan *chan_find_peer(const struct relay_alloc *ra,
+				   const struct sa *peer)
+{
+	struct le *le;
+
+	for (le = ra->chanl.head; le; le = le->next) {
+		struct chan *chan = le->data;
+
+		if (sa_cmp(&chan->peer, peer, SA_ALL))
+			return chan;
+	}
+
+	return NULL;
+}
+
+
+static struct chan *chan_find_numb(const struct relay_alloc *ra,
+				   uint16_t numb)
+{
+	struct le *le;
+
+	for (le = ra->chanl.head; le; le = le->next) {
+		struct chan *chan = le->data;
+
+		if (chan->numb == numb)
+			return chan;
+	}
+
+	return NULL;
+}
+
+
+static int client_send(struct relay_alloc *ra, struct mbuf *mb)
+{
+	if (ra->conn)
+		return tcp_send(ra->conn->tc, mb);
+	else
+		return udp_send(ra->relay->us, &ra->cli, mb);
+}
+
+
+/* Incoming packet from a peer, on the relayed address */
+static void rel_recv(const struct sa *src, struct mbuf *mb, void *arg)
+{
+	struct relay_alloc *ra = arg;
+	struct relay *relay = ra->relay;
+	const struct chan *chan;
+	size_t len = mbuf_get_left(mb);
+	int err;
+
+	if (!perm_exists(ra, src)) {
+		++relay->n_drop;
+		return;
+	}
+
+	chan = chan_find_peer(ra, src);
+	if (chan) {
+		struct mbuf *mbc = relay->mb_tx;
+
+		mbc->pos = 0;
+		mbc->end = 0;
+
+		err  = mbuf_write_u16(mbc, htons(chan->numb));
+		err |= mbuf_write_u16(mbc, htons((uint16_t)len));
+		err |= mbuf_write_mem(mbc, mbuf_buf(mb), len);
+
+		/* ChannelData over TCP is padded to 4 bytes */
+		if (ra->conn) {
+			while (mbc->end & 0x03)
+				err |= mbuf_write_u8(mbc, 0x00);
+		}
+
+		mbc->pos = 0;
+
+		if (!err)
+			err = client_send(ra, mbc);
+	}
+	else {
+		err = stun_indication(ra->conn ? IPPROTO_TCP : IPPROTO_UDP,
+				      ra->conn ? (void *)ra->conn->tc
+				      : (void *)relay->us,
+				      &ra->cli, 0, STUN_METHOD_DATA,
+				      NULL, 0, false, 2,
+				      STUN_ATTR_XOR_PEER_ADDR, src,
+				      STUN_ATTR_DATA, mb);
+	}
+
+	if (err)
+		++relay->n_drop;
+	else
+		++relay->n_rx;
+}
+
+
+/*
+ * Reply to a request, with an error when scode is set. The relayed
+ * address and lifetime are optional; libre leaves out NULL attributes.
+ */
+static int reply(struct relay *relay, struct relay_conn *conn,
+		 const struct sa *src, const struct stun_msg *msg,
+		 uint16_t scode, const char *reason,
+		 const struct sa *rel_addr, const uint32_t *lifetime)
+{
+	const int proto = conn ? IPPROTO_TCP : IPPROTO_UDP;
+	void *sock = conn ? (void *)conn->tc : (void *)relay->us;
+
+	if (scode) {
+		return stun_ereply(proto, sock, src, 0, msg, scode, reason,
+				   NULL, 0, false, 1,
+				   STUN_ATTR_SOFTWARE, software);
+	}
+
+	return stun_reply(proto, sock, src, 0, msg, NULL, 0, false, 4,
+			  STUN_ATTR_XOR_RELAY_ADDR, rel_addr,
+			  STUN_ATTR_XOR_MAPPED_ADDR, rel_addr ? src : NULL,
+			  STUN_ATTR_LIFETIME, lifetime,
+			  STUN_ATTR_SOFTWARE, software);
+}
+
+
+static void handle_allocate(struct relay *relay, struct relay_conn *conn,
+			    struct relay_alloc *ra, const struct sa *src,
+			    const struct stun_msg *msg)
+{
+	const uint32_t lifetime = RELAY_LIFETIME;
+	struct sa laddr;
+	int err;
+
+	/* a retransmitted request gets the same answer */
+	if (ra)
+		goto reply;
+
+	ra = mem_zalloc(sizeof(*ra), alloc_destructor);
+	if (!ra) {
+		(void)reply(relay, conn, src, msg, 500, "Server Error",
+			    NULL, NULL);
+		return;
+	}
+
+	ra->relay = relay;
+	ra->cli   = *src;
+
+	laddr = relay->laddr;
+	sa_set_port(&laddr, 0);
+
+	err = udp_listen(&ra->rel, &laddr, rel_recv, ra);
+	if (err) {
+		mem_deref(ra);
+		(void)reply(relay, conn, src, msg,
+			    508, "Insufficient Capacity", NULL, NULL);
+		return;
+	}
+
+	udp_sockbuf_set(ra->rel, SOCKBUF_DEFAULT);
+	udp_local_get(ra->rel, &ra->rel_addr);
+
+	if (conn) {
+		ra->conn = conn;
+		conn->alloc = ra;
+	}
+	else {
+		hash_append(relay->ht_alloc, sa_hash(src, SA_ALL),
+			    &ra->he, ra);
+	}
+
+	++relay->n_alloc;
+
+ reply:
+	(void)reply(relay, conn, src, msg, 0, NULL,
+		    &ra->rel_addr, &lifetime);
+}
+
+
+static void handle_refresh(struct relay *relay, struct relay_conn *conn,
+			   struct relay_alloc *ra, const struct sa *src,
+			   const struct stun_msg *msg)
+{
+	const struct stun_attr *attr;
+	uint32_t lifetime = RELAY_LIFETIME;
+
+	attr = stun_msg_attr(msg, STUN_ATTR_LIFETIME);
+	if (attr)
+		lifetime = min(attr->v.lifetime, RELAY_LIFETIME);
+
+	(void)reply(relay, conn, src, msg, 0, NULL, NULL, &lifetime);
+
+	/* lifetime 0 means de-allocate */
+	if (!lifetime) {
+		if (conn)
+			conn->alloc = NULL;
+		mem_deref(ra);
+	}
+}
+
+
+static void handle_stun(struct relay *relay, struct relay_conn *conn,
+			const struct sa *src, struct mbuf *mb)
+{
+	struct relay_alloc *ra;
+	const struct stun_attr *peer, *attr;
+	struct stun_msg *msg = NULL;
+	uint16_t method;
+	struct chan *chan;
+	int err;
+
+	err = stun_msg_decode(&msg, mb, NULL);
+	if (err) {
+		++relay->n_drop;
+		return;
+	}
+
+	ra = conn ? conn->alloc : alloc_find(relay, src);
+
+	method = stun_msg_method(msg);
+
+	if (stun_msg_class(msg) == STUN_CLASS_INDICATION) {
+
+		if (method != STUN_METHOD_SEND || !ra)
+			goto drop;
+
+		peer = stun_msg_attr(msg, STUN_ATTR_XOR_PEER_ADDR);
+		attr = stun_msg_attr(msg, STUN_ATTR_DATA);
+		if (!peer || !attr || !perm_exists(ra, &peer->v.xor_peer_addr))
+			goto drop;
+
+		err = udp_send(ra->rel, &peer->v.xor_peer_addr,
+			       (struct mbuf *)&attr->v.data);
+		if (err)
+			goto drop;
+
+		++relay->n_tx;
+		goto out;
+	}
+
+	if (stun_msg_class(msg) != STUN_CLASS_REQUEST)
+		goto drop;
+
+	if (method == STUN_METHOD_ALLOCATE) {
+		handle_allocate(relay, conn, ra, src, msg);
+		goto out;
+	}
+
+	if (!ra) {
+		(void)reply(relay, conn, src, msg,
+			    437, "Allocation Mismatch", NULL, NULL);
+		goto out;
+	}
+
+	switch (method) {
+
+	case STUN_METHOD_REFRESH:
+		handle_refresh(relay, conn, ra, src, msg);
+		break;
+
+	case STUN_METHOD_CREATEPERM:
+		peer = stun_msg_attr(msg, STUN_ATTR_XOR_PEER_ADDR);
+		if (!peer) {
+			(void)reply(relay, conn, src, msg,
+				    400, "Bad Request", NULL, NULL);
+			break;
+		}
+
+		err = perm_add(ra, &peer->v.xor_peer_addr);
+		(void)reply(relay, conn, src, msg,
+			    err ? 500 : 0, err ? "Server Error" : NULL,
+			    NULL, NULL);
+		break;
+
+	case STUN_METHOD_CHANBIND:
+		peer = stun_msg_attr(msg, STUN_ATTR_XOR_PEER_ADDR);
+		attr = stun_msg_attr(msg, STUN_ATTR_CHANNEL_NUMBER);
+		if (!peer || !attr ||
+		    attr->v.channel_number < CHAN_MIN ||
+		    attr->v.channel_number > CHAN_MAX) {
+			(void)reply(relay, conn, src, msg,
+				    400, "Bad Request", NULL, NULL);
+			break;
+		}
+
+		chan = chan_find_numb(ra, attr->v.channel_number);
+		if (!chan) {
+			chan = mem_zalloc(sizeof(*chan), NULL);
+			if (!chan) {
+				(void)reply(relay, conn, src, msg,
+					    500, "Server Error", NULL, NULL);
+				break;
+			}
+
+			chan->numb = attr->v.channel_number;
+			list_append(&ra->chanl, &chan->le, chan);
+		}
+
+		chan->peer = peer->v.xor_peer_addr;
+
+		err = perm_add(ra, &chan->peer);
+		(void)reply(relay, conn, src, msg,
+			    err ? 500 : 0, err ? "Server Error" : NULL,
+			    NULL, NULL);
+		break;
+
+	default:
+		(void)reply(relay, conn, src, msg, 400, "Bad Request",
+			    NULL, NULL);
+		break;
+	}
+
+ out:
+	mem_deref(msg);
+	return;
+
+ drop:
+	++relay->n_drop;
+	mem_deref(msg);
+}
+
+
+/* ChannelData from the client, forwarded without copying */
+static void handle_chandata(struct relay *relay, struct relay_alloc *ra,
+			    struct mbuf *mb)
+{
+	const struct chan *chan;
+	uint16_t numb, len;
+	size_t end;
+
+	numb = ntohs(mbuf_read_u16(mb));
+	len  = ntohs(mbuf_read_u16(mb));
+
+	if (!ra || mbuf_get_left(mb) < len)
+		goto drop;
+
+	chan = chan_find_numb(ra, numb);
+	if (!chan)
+		goto drop;
+
+	end = mb->end;
+	mb->end = mb->pos + len;
+
+	if (udp_send(ra->rel, &chan->peer, mb)) {
+		mb->end = end;
+		goto drop;
+	}
+
+	mb->end = end;
+	++relay->n_tx;
+	return;
+
+ drop:
+	++relay->n_drop;
+}
+
+
+static void client_packet(struct relay *relay, struct relay_conn *conn,
+			  const struct sa *src, struct mbuf *mb)
+{
+	const uint8_t *p = mbuf_buf(mb);
+
+	if (mbuf_get_left(mb) < 4)
+		return;
+
+	if ((p[0] & 0xc0) == 0x40) {
+		handle_chandata(relay,
+				conn ? conn->alloc : alloc_find(relay, src),
+				mb);
+	}
+	else {
+		handle_stun(relay, conn, src, mb);
+	}
+}
+
+
+static void udp_recv_handler(const struct sa *src, struct mbuf *mb,
+			     void *arg)
+{
+	struct relay *relay = arg;
+
+	client_packet(relay, NULL, src, mb);
+}
+
+
+static void conn_destructor(void *arg)
+{
+	struct relay_conn *conn = arg;
+
+	list_unlink(&conn->le);
+	mem_deref(conn->alloc);
+	mem_deref(conn->tc);
+	mem_deref(conn->mb);
+}
+
+
+static int conn_frame_handler(struct mbuf *mb, void *arg)
+{
+	struct relay_conn *conn = arg;
+
+	client_packet(conn->relay, conn, &conn->cli, mb);
+
+	return 0;
+}
+
+
+static void conn_recv_handler(struct mbuf *mb_pkt, void *arg)
+{
+	struct relay_conn *conn = arg;
+	int err;
+
+	err = tcp_reassemble(&conn->mb, mb_pkt, conn_frame_handler, conn);
+	if (err)
+		mem_deref(conn);
+}
+
+
+static void conn_close_handler(int err, void *arg)
+{
+	struct relay_conn *conn = arg;
+	(void)err;
+
+	mem_deref(conn);
+}
+
+
+static void tcp_conn_handler(const struct sa *peer, void *arg)
+{
+	struct relay *relay = arg;
+	struct relay_conn *conn;
+	int err;
+
+	conn = mem_zalloc(sizeof(*conn), conn_destructor);
+	if (!conn) {
+		tcp_reject(relay->ts);
+		return;
+	}
+
+	conn->relay = relay;
+	conn->cli   = *peer;
+
+	err = tcp_accept(&conn->tc, relay->ts, NULL, conn_recv_handler,
+			 conn_close_handler, conn);
+	if (err) {
+		mem_deref(conn);
+		tcp_reject(relay->ts);
+		return;
+	}
+
+	list_append(&relay->connl, &conn->le, conn);
+}
+
+
+static void destructor(void *arg)
+{
+	struct relay *relay = arg;
+
+	list_flush(&relay->connl);
+	hash_flush(relay->ht_alloc);
+	mem_deref(relay->ht_alloc);
+	mem_deref(relay->ts);
+	mem_deref(relay->us);
+	mem_deref(relay->mb_tx);
+}
+
+
+/*
+ * Start a TURN relay on a UDP and TCP listening address. If the port
+ * is zero, an ephemeral port is used for both transports.
+ */
+int relay_alloc(struct relay **relayp, const struct sa *laddr)
+{
+	struct relay *relay;
+	int err;
+
+	if (!relayp || !laddr)
+		return EINVAL;
+
+	relay = mem_zalloc(sizeof(*relay), destructor);
+	if (!relay)
+		return ENOMEM;
+
+	relay->mb_tx = mbuf_alloc(2048);
+	if (!relay->mb_tx) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	err = hash_alloc(&relay->ht_alloc, HASH_SIZE);
+	if (err)
+		goto out;
+
+	err = udp_listen(&relay->us, laddr, udp_recv_handler, relay);
+	if (err) {
+		re_fprintf(stderr, "relay: could not listen on UDP %J (%m)\n",
+			   laddr, err);
+		goto out;
+	}
+
+	udp_sockbuf_set(relay->us, SOCKBUF_DEFAULT);
+
+	/* TCP listens on the same port as UDP */
+	udp_local_get(relay->us, &relay->laddr);
+
+	err = tcp_listen(&relay->ts, &relay->laddr, tcp_conn_handler, relay);
+	if (err) {
+		re_fprintf(stderr, "relay: could not listen on TCP %J (%m)\n",
+			   &relay->laddr, err);
+		goto out;
+	}
+
+ out:
+	if (err)
+		mem_deref(relay);
+	else
+		*relayp = relay;
+
+	return err;
+}
+
+
+const struct sa *relay_laddr(const struct relay *relay)
+{
+	return relay ? &relay->laddr : NULL;
+}
+
+
+void relay_print_stats(const struct relay *relay)
+{
+	if (!relay)
+		return;
+
+	re_printf("relay summary:\n");
+	re_printf("allocations:          %llu\n",
+		  (unsigned long long)relay->n_alloc);
+	re_printf("forwarded to peers:   %llu packets\n",
+		  (unsigned long long)relay->n_tx);
+	re_printf("forwarded to clients: %llu packets\n",
+		  (unsigned long long)relay->n_rx);
+	re_printf("dropped:              %llu packets\n",
+		  (unsigned long long)relay->n_drop);
+	re_printf("\n");
+}
@@ -0,0 +1,589 @@
+/**
+ * @file result.c Run result files and baseline comparison
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <re.h>
+#include "turnperf.h"
+
+
+/*
+ * Result file:
+ *
+ * - one JSON object per run, grouped in sections
+ * - every key outside of the groups and servers arrays is unique in
+ *   the file, so a value can be looked up by its key alone when two
+ *   files are compared
+ * - numbers are written without exponent
+ */
+
+
+enum {
+	RESULT_MAXSZ = 65536,
+};
+
+enum limit {
+	LIMIT_NONE = 0,
+	LIMIT_TPUT,
+	LIMIT_P99,
+};
+
+
+static int json_str(struct re_printf *pf, const char *str)
+{
+	int err = 0;
+
+	err |= re_hprintf(pf, "\"");
+
+	for (; str && *str; str++) {
+
+		const char c = *str;
+
+		if (c == '"' || c == '\\')
+			err |= re_hprintf(pf, "\\%c", c);
+		else if ((unsigned char)c < 0x20)
+			err |= re_hprintf(pf, "\\u%04x", c);
+		else
+			err |= re_hprintf(pf, "%c", c);
+	}
+
+	err |= re_hprintf(pf, "\"");
+
+	return err;
+}
+
+
+static double ms(uint64_t us)
+{
+	return us / 1000.0;
+}
+
+
+int result_write(const char *path, const struct result *res)
+{
+	double loss = 0, srv_loss = 0, alloc_rate = 0, dealloc_rate = 0;
+	unsigned i, n;
+	FILE *f;
+	int err = 0;
+
+	if (!path || !res)
+		return EINVAL;
+
+	f = fopen(path, "w");
+	if (!f) {
+		err = errno;
+		re_fprintf(stderr, "could not open result file %s: %m\n",
+			   path, err);
+		return err;
+	}
+
+	if (res->sent) {
+		loss = 100.0 * ((double)res->sent - (double)res->recv) /
+			(double)res->sent;
+		srv_loss = 100.0 * ((double)res->sent - (double)res->recv -
+				    (double)res->rxdrop) / (double)res->sent;
+	}
+
+	if (res->alloc_duration > 0)
+		alloc_rate = res->allocs_ok / (res->alloc_duration / 1000.0);
+	if (res->dealloc_duration > 0)
+		dealloc_rate = res->dealloc_ok /
+			(res->dealloc_duration / 1000.0);
+
+	re_fprintf(f, "{\n");
+	re_fprintf(f, "  \"turnperf\": %H,\n", json_str, VERSION);
+
+	re_fprintf(f, "  \"config\": {\n");
+	re_fprintf(f, "    \"server\": %H,\n", json_str, res->server);
+	re_fprintf(f, "    \"protocol\": %H,\n", json_str, res->protocol);
+	re_fprintf(f, "    \"software\": %H,\n", json_str, res->software);
+	re_fprintf(f, "    \"allocations\": %u,\n", res->num_allocations);
+	re_fprintf(f, "    \"peers\": %u,\n", res->peers);
+	re_fprintf(f, "    \"bitrate\": %u,\n", res->bitrate);
+	re_fprintf(f, "    \"psize\": %zu,\n", res->psize);
+	re_fprintf(f, "    \"indications\": %s,\n",
+		   res->turn_ind ? "true" : "false");
+	re_fprintf(f, "    \"indications_percent\": %d,\n", res->ind_pct);
+	re_fprintf(f, "    \"mixed\": %s\n", res->mixed ? "true" : "false");
+	re_fprintf(f, "  },\n");
+
+	re_fprintf(f, "  \"allocation\": {\n");
+	re_fprintf(f, "    \"allocations_ok\": %u,\n", res->allocs_ok);
+	re_fprintf(f, "    \"allocations_failed\": %u,\n",
+		   res->allocs_failed);
+	re_fprintf(f, "    \"alloc_duration_ms\": %.3f,\n",
+		   res->alloc_duration);
+	re_fprintf(f, "    \"alloc_rate\": %.3f,\n", alloc_rate);
+	re_fprintf(f, "    \"alloc_time_avg_ms\": %.3f,\n",
+		   hist_mean(&res->atime) / 1000.0);
+	re_fprintf(f, "    \"alloc_time_p50_ms\": %.3f,\n",
+		   ms(hist_percentile(&res->atime, 50)));
+	re_fprintf(f, "    \"alloc_time_p99_ms\": %.3f,\n",
+		   ms(hist_percentile(&res->atime, 99)));
+	re_fprintf(f, "    \"alloc_time_max_ms\": %.3f,\n",
+		   ms(res->atime.max));
+	re_fprintf(f, "    \"auth_challenged\": %llu,\n",
+		   (unsigned long long)res->auth.count);
+	re_fprintf(f, "    \"auth_time_p50_ms\": %.3f,\n",
+		   ms(hist_percentile(&res->auth, 50)));
+	re_fprintf(f, "    \"auth_time_p99_ms\": %.3f\n",
+		   ms(hist_percentile(&res->auth, 99)));
+	re_fprintf(f, "  },\n");
+
+	re_fprintf(f, "  \"traffic\": {\n");
+	re_fprintf(f, "    \"send_bitrate\": %.3f,\n", res->send_bitrate);
+	re_fprintf(f, "    \"recv_bitrate\": %.3f,\n", res->recv_bitrate);
+	re_fprintf(f, "    \"send_wire_bitrate\": %.3f,\n", res->send_wire);
+	re_fprintf(f, "    \"recv_wire_bitrate\": %.3f,\n", res->recv_wire);
+	re_fprintf(f, "    \"packets_sent\": %llu,\n",
+		   (unsigned long long)res->sent);
+	re_fprintf(f, "    \"packets_received\": %llu,\n",
+		   (unsigned long long)res->recv);
+	re_fprintf(f, "    \"client_tx_drops\": %llu,\n",
+		   (unsigned long long)res->txdrop);
+	re_fprintf(f, "    \"client_rx_drops\": %llu,\n",
+		   (unsigned long long)res->rxdrop);
+	re_fprintf(f, "    \"loss_percent\": %.3f,\n", loss);
+	re_fprintf(f, "    \"server_loss_percent\": %.3f\n", srv_loss);
+	re_fprintf(f, "  },\n");
+
+	re_fprintf(f, "  \"latency\": {\n");
+	re_fprintf(f, "    \"latency_samples\": %llu,\n",
+		   (unsigned long long)res->latency.count);
+	re_fprintf(f, "    \"latency_avg_ms\": %.3f,\n",
+		   hist_mean(&res->latency) / 1000.0);
+	re_fprintf(f, "    \"latency_p50_ms\": %.3f,\n",
+		   ms(hist_percentile(&res->latency, 50)));
+	re_fprintf(f, "    \"latency_p90_ms\": %.3f,\n",
+		   ms(hist_percentile(&res->latency, 90)));
+	re_fprintf(f, "    \"latency_p99_ms\": %.3f,\n",
+		   ms(hist_percentile(&res->latency, 99)));
+	re_fprintf(f, "    \"latency_max_ms\": %.3f\n",
+		   ms(res->latency.max));
+	re_fprintf(f, "  },\n");
+
+	re_fprintf(f, "  \"pacing\": {\n");
+	re_fprintf(f, "    \"slip_p50_ms\": %.3f,\n",
+		   ms(hist_percentile(&res->slip, 50)));
+	re_fprintf(f, "    \"slip_p99_ms\": %.3f\n",
+		   ms(hist_percentile(&res->slip, 99)));
+	re_fprintf(f, "  },\n");
+
+	re_fprintf(f, "  \"groups\": [");
+	for (i = 0; i < res->groupc; i++) {
+
+		const struct group_result *gr = &res->groupv[i];
+
+		re_fprintf(f, "%s\n    {\n", i ? "," : "");
+		re_fprintf(f, "      \"group_name\": %H,\n",
+			   json_str, gr->name);
+		re_fprintf(f, "      \"group_protocol\": %H,\n",
+			   json_str, gr->protocol);
+		re_fprintf(f, "      \"group_bitrate\": %u,\n", gr->bitrate);
+		re_fprintf(f, "      \"group_psize\": %zu,\n", gr->psize);
+		re_fprintf(f, "      \"group_indications\": %s,\n",
+			   gr->turn_ind ? "true" : "false");
+		re_fprintf(f, "      \"group_allocations\": %u,\n",
+			   gr->allocs);
+		re_fprintf(f, "      \"group_send_bitrate\": %.3f,\n",
+			   gr->send_bitrate);
+		re_fprintf(f, "      \"group_recv_bitrate\": %.3f,\n",
+			   gr->recv_bitrate);
+		re_fprintf(f, "      \"group_pps\": %.3f,\n", gr->pps);
+		re_fprintf(f, "      \"group_packets_sent\": %llu,\n",
+			   (unsigned long long)gr->sent);
+		re_fprintf(f, "      \"group_packets_received\": %llu,\n",
+			   (unsigned long long)gr->recv);
+		re_fprintf(f, "      \"group_latency_p50_ms\": %.3f,\n",
+			   ms(hist_percentile(&gr->latency, 50)));
+		re_fprintf(f, "      \"group_latency_p99_ms\": %.3f\n",
+			   ms(hist_percentile(&gr->latency, 99)));
+		re_fprintf(f, "    }");
+	}
+	re_fprintf(f, "%s],\n", res->groupc ? "\n  " : "");
+
+	re_fprintf(f, "  \"servers\": [");
+	for (i = 0; i < res->serverc; i++) {
+
+		const struct server_result *sr = &res->serverv[i];
+		const struct server *srv = sr->srv;
+
+		re_fprintf(f, "%s\n    {\n", i ? "," : "");
+		re_fprintf(f, "      \"server_address\": \"%J\",\n",
+			   &srv->addr);
+		re_fprintf(f, "      \"server_weight\": %u,\n", srv->weight);
+		re_fprintf(f, "      \"server_allocations\": %u,\n",
+			   srv->allocs);
+		re_fprintf(f, "      \"server_allocations_ok\": %u,\n",
+			   srv->ok);
+		re_fprintf(f, "      \"server_allocations_failed\": %u,\n",
+			   srv->failed + srv->lost);
+		re_fprintf(f, "      \"server_redirects\": %u,\n",
+			   srv->redirects);
+		re_fprintf(f, "      \"server_redirected\": %u,\n",
+			   srv->redirected);
+		re_fprintf(f, "      \"server_alloc_p50_ms\": %.3f,\n",
+			   ms(hist_percentile(&srv->atime, 50)));
+		re_fprintf(f, "      \"server_recv_bitrate\": %.3f,\n",
+			   sr->recv_bitrate);
+		re_fprintf(f, "      \"server_packets_sent\": %llu,\n",
+			   (unsigned long long)sr->sent);
+		re_fprintf(f, "      \"server_packets_received\": %llu\n",
+			   (unsigned long long)sr->recv);
+		re_fprintf(f, "    }");
+	}
+	re_fprintf(f, "%s],\n", res->serverc ? "\n  " : "");
+
+	re_fprintf(f, "  \"wire\": [");
+	for (i = 0; i < res->wirec; i++) {
+
+		const struct wire_result *wr = &res->wirev[i];
+
+		re_fprintf(f, "%s\n    {\n", i ? "," : "");
+		re_fprintf(f, "      \"wire_protocol\": %H,\n",
+			   json_str, wr->protocol);
+		re_fprintf(f, "      \"wire_framing\": \"%s\",\n",
+			   wr->turn_ind ? "indication" : "channel");
+		re_fprintf(f, "      \"wire_streams\": %u,\n", wr->streams);
+		re_fprintf(f, "      \"wire_send_goodput\": %.3f,\n",
+			   wr->send_bitrate);
+		re_fprintf(f, "      \"wire_send_bitrate\": %.3f,\n",
+			   wr->send_wire);
+		re_fprintf(f, "      \"wire_recv_goodput\": %.3f,\n",
+			   wr->recv_bitrate);
+		re_fprintf(f, "      \"wire_recv_bitrate\": %.3f\n",
+			   wr->recv_wire);
+		re_fprintf(f, "    }");
+	}
+	re_fprintf(f, "%s],\n", res->wirec ? "\n  " : "");
+
+	re_fprintf(f, "  \"fanout\": [");
+	for (i = 0; i < res->fanoutc; i++) {
+
+		const struct fanout_result *fr = &res->fanoutv[i];
+
+		re_fprintf(f, "%s\n    {\n", i ? "," : "");
+		re_fprintf(f, "      \"fanout_peers_min\": %u,\n", fr->lo);
+		re_fprintf(f, "      \"fanout_peers_max\": %u,\n", fr->hi);
+		re_fprintf(f, "      \"fanout_streams\": %u,\n",
+			   fr->streams);
+		re_fprintf(f, "      \"fanout_setup_p50_ms\": %.3f,\n",
+			   ms(hist_percentile(&fr->setup, 50)));
+		re_fprintf(f, "      \"fanout_setup_p99_ms\": %.3f,\n",
+			   ms(hist_percentile(&fr->setup, 99)));
+		re_fprintf(f, "      \"fanout_recv_bitrate\": %.3f,\n",
+			   fr->recv_bitrate);
+		re_fprintf(f, "      \"fanout_packets_sent\": %llu,\n",
+			   (unsigned long long)fr->sent);
+		re_fprintf(f, "      \"fanout_packets_received\": %llu\n",
+			   (unsigned long long)fr->recv);
+		re_fprintf(f, "    }");
+	}
+	re_fprintf(f, "%s],\n", res->fanoutc ? "\n  " : "");
+
+	re_fprintf(f, "  \"events\": [");
+	for (i = 0, n = 0; i < EVENT_MAX; i++) {
+
+		if (!res->eventv[i])
+			continue;
+
+		re_fprintf(f, "%s\n    {\"event\": %H, \"count\": %llu}",
+			   n++ ? "," : "", json_str, event_name(i),
+			   (unsigned long long)res->eventv[i]);
+	}
+	re_fprintf(f, "%s],\n", n ? "\n  " : "");
+
+	re_fprintf(f, "  \"stalls\": {\n");
+	re_fprintf(f, "    \"stall_events\": %llu,\n",
+		   (unsigned long long)res->stall_events);
+	re_fprintf(f, "    \"stall_gaps\": %llu,\n",
+		   (unsigned long long)res->stall_gaps);
+	re_fprintf(f, "    \"stall_max_ms\": %llu,\n",
+		   (unsigned long long)res->stall_max);
+	re_fprintf(f, "    \"stall_flows_max\": %u\n", res->stall_flows);
+	re_fprintf(f, "  },\n");
+
+	re_fprintf(f, "  \"flood\": {\n");
+	re_fprintf(f, "    \"flood_max_pps\": %.1f,\n", res->flood_max_pps);
+	re_fprintf(f, "    \"flood_lossless_pps\": %.1f,\n",
+		   res->flood_lossless_pps);
+	re_fprintf(f, "    \"flood_knee_window\": %u\n", res->flood_knee);
+	re_fprintf(f, "  },\n");
+
+	re_fprintf(f, "  \"handshake\": {\n");
+	re_fprintf(f, "    \"handshakes_full\": %llu,\n",
+		   (unsigned long long)res->hs_full.count);
+	re_fprintf(f, "    \"handshakes_resumed\": %llu,\n",
+		   (unsigned long long)res->hs_resumed.count);
+	re_fprintf(f, "    \"handshake_full_p50_ms\": %.3f,\n",
+		   ms(hist_percentile(&res->hs_full, 50)));
+	re_fprintf(f, "    \"handshake_full_p99_ms\": %.3f,\n",
+		   ms(hist_percentile(&res->hs_full, 99)));
+	re_fprintf(f, "    \"handshake_resumed_p50_ms\": %.3f,\n",
+		   ms(hist_percentile(&res->hs_resumed, 50)));
+	re_fprintf(f, "    \"handshake_resumed_p99_ms\": %.3f\n",
+		   ms(hist_percentile(&res->hs_resumed, 99)));
+	re_fprintf(f, "  },\n");
+
+	re_fprintf(f, "  \"deallocation\": {\n");
+	re_fprintf(f, "    \"dealloc_ok\": %u,\n", res->dealloc_ok);
+	re_fprintf(f, "    \"dealloc_failed\": %u,\n", res->dealloc_failed);
+	re_fprintf(f, "    \"dealloc_duration_ms\": %.3f,\n",
+		   res->dealloc_duration);
+	re_fprintf(f, "    \"dealloc_rate\": %.3f,\n", dealloc_rate);
+	re_fprintf(f, "    \"dealloc_p50_ms\": %.3f,\n",
+		   ms(hist_percentile(&res->dealloc, 50)));
+	re_fprintf(f, "    \"dealloc_p99_ms\": %.3f\n",
+		   ms(hist_percentile(&res->dealloc, 99)));
+	re_fprintf(f, "  }\n");
+	re_fprintf(f, "}\n");
+
+	if (ferror(f))
+		err = EIO;
+
+	if (0 != fclose(f) && !err)
+		err = errno;
+
+	if (err)
+		re_fprintf(stderr, "could not write result file %s: %m\n",
+			   path, err);
+
+	return err;
+}
+
+
+static int load_file(struct mbuf **mbp, const char *path)
+{
+	struct mbuf *mb;
+	FILE *f;
+	size_t n;
+	int err = 0;
+
+	f = fopen(path, "r");
+	if (!f) {
+		err = errno;
+		re_fprintf(stderr, "could not open result file %s: %m\n",
+			   path, err);
+		return err;
+	}
+
+	mb = mbuf_alloc(RESULT_MAXSZ);
+	if (!mb) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	n = fread(mb->buf, 1, mb->size, f);
+	if (ferror(f)) {
+		err = EIO;
+		goto out;
+	}
+	if (n == mb->size) {
+		re_fprintf(stderr, "result file %s is too large\n", path);
+		err = EFBIG;
+		goto out;
+	}
+
+	mb->end = n;
+
+ out:
+	fclose(f);
+
+	if (err)
+		mem_deref(mb);
+	else
+		*mbp = mb;
+
+	return err;
+}
+
+
+/*
+ * The value of the ix-th occurrence of a key, for the objects of an
+ * array. ENOENT if there are fewer, EINVAL if it is not a finite number
+ */
+static int json_number(const struct mbuf *mb, const char *key, unsigned ix,
+		       double *valp)
+{
+	const char *p = (const char *)mb->buf;
+	size_t len = mb->end;
+	char pat[64], num[64];
+	struct pl pl;
+	char *end;
+	double val;
+
+	if (re_snprintf(pat, sizeof(pat), "\"%s\":[ ]*[-+0-9.eE]+", key) < 0)
+		return EINVAL;
+
+	for (;;) {
+		if (re_regex(p, len, pat, NULL, &pl))
+			return ENOENT;
+
+		if (!ix--)
+			break;
+
+		len -= pl.p + pl.l - p;
+		p    = pl.p + pl.l;
+	}
+
+	if (pl_strcpy(&pl, num, sizeof(num)))
+		return EINVAL;
+
+	val = strtod(num, &end);
+	if (*end || !isfinite(val))
+		return EINVAL;
+
+	*valp = val;
+
+	return 0;
+}
+
+
+/*
+ * Compare two result files, and fail with ERANGE if the throughput
+ * dropped or the p99 latency increased by more than the given
+ * percentages. The metrics of the per-group arrays are compared
+ * element by element, and each group is gated on its own.
+ */
+int result_compare(const char *base_path, const char *cur_path,
+		   double max_tput_drop, double max_p99_rise)
+{
+	static const struct {
+		const char *key;
+		bool higher_is_better;
+		enum limit limit;
+		bool array;
+	} metricv[] = {
+		{"alloc_rate",           true,  LIMIT_NONE, false},
+		{"alloc_time_p99_ms",    false, LIMIT_NONE, false},
+		{"send_bitrate",         true,  LIMIT_NONE, false},
+		{"recv_bitrate",         true,  LIMIT_TPUT, false},
+		{"loss_percent",         false, LIMIT_NONE, false},
+		{"latency_p50_ms",       false, LIMIT_NONE, false},
+		{"latency_p99_ms",       false, LIMIT_P99,  false},
+		{"slip_p99_ms",          false, LIMIT_NONE, false},
+		{"flood_max_pps",        true,  LIMIT_NONE, false},
+		{"flood_lossless_pps",   true,  LIMIT_NONE, false},
+		{"group_recv_bitrate",   true,  LIMIT_TPUT, true },
+		{"group_latency_p99_ms", false, LIMIT_P99,  true },
+		{"server_recv_bitrate",  true,  LIMIT_NONE, true },
+		{"wire_recv_bitrate",    true,  LIMIT_NONE, true },
+		{"fanout_recv_bitrate",  true,  LIMIT_NONE, true },
+	};
+	struct mbuf *base = NULL, *cur = NULL;
+	double tput_change = 0, p99_change = 0;
+	bool regress = false, missing = false;
+	unsigned i, ix;
+	char name[64];
+	int err;
+
+	err = load_file(&base, base_path);
+	if (err)
+		goto out;
+
+	err = load_file(&cur, cur_path);
+	if (err)
+		goto out;
+
+	re_printf("%-26s %14s %14s %9s\n",
+		  "metric", "baseline", "current", "change");
+
+	for (i = 0; i < ARRAY_SIZE(metricv); i++) {
+
+		for (ix = 0; ; ix++) {
+
+			double a, b, change = 0;
+			int ea, eb;
+
+			ea = json_number(base, metricv[i].key, ix, &a);
+			eb = json_number(cur, metricv[i].key, ix, &b);
+
+			/* the end of both arrays */
+			if (metricv[i].array && ea == ENOENT && eb == ENOENT)
+				break;
+
+			if (metricv[i].array)
+				re_snprintf(name, sizeof(name), "%s[%u]",
+					    metricv[i].key, ix);
+			else
+				str_ncpy(name, metricv[i].key, sizeof(name));
+
+			if (ea || eb) {
+				re_printf("%-26s %14s %14s\n", name,
+					  "-", "-");
+
+				/* a gated metric must be in both files */
+				if (metricv[i].limit != LIMIT_NONE)
+					missing = true;
+			}
+			else {
+				if (a > 0)
+					change = 100.0 * (b - a) / a;
+
+				re_printf("%-26s %14.3f %14.3f %s%7.1f%%%s\n",
+					  name, a, b, change < 0 ? "-" : "+",
+					  change < 0 ? -change : change,
+					  (change > 0) ==
+					  metricv[i].higher_is_better ||
+					  change == 0 ? "" : " (worse)");
+			}
+
+			/* the worst of the totals and the groups */
+			switch (metricv[i].limit) {
+
+			case LIMIT_TPUT:
+				tput_change = min(tput_change, change);
+				break;
+
+			case LIMIT_P99:
+				p99_change = max(p99_change, change);
+				break;
+
+			default:
+				break;
+			}
+
+			if (!metricv[i].array)
+				break;
+		}
+	}
+
+	re_printf("\n");
+
+	if (missing) {
+		re_fprintf(stderr, "a throughput or p99 latency metric is"
+			   " missing or not a number in %s or %s\n",
+			   base_path, cur_path);
+		err = EINVAL;
+		goto out;
+	}
+
+	if (-tput_change > max_tput_drop) {
+		re_printf("REGRESSION: throughput dropped by %.1f%%"
+			  " (limit %.1f%%)\n", -tput_change, max_tput_drop);
+		regress = true;
+	}
+	if (p99_change > max_p99_rise) {
+		re_printf("REGRESSION: p99 latency increased by %.1f%%"
+			  " (limit %.1f%%)\n", p99_change, max_p99_rise);
+		regress = true;
+	}
+
+	if (regress)
+		err = ERANGE;
+	else
+		re_printf("no regression (throughput limit %.1f%%,"
+			  " p99 latency limit %.1f%%)\n",
+			  max_tput_drop, max_p99_rise);
+
+ out:
+	mem_deref(base);
+	mem_deref(cur);
+
+	return err;
+}
@@ -0,0 +1,242 @@
+/**
+ * @file scenario.c Mixed-workload scenario files
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include "turnperf.h"
+
+
+/*
+ * Scenario file:
+ *
+ * - one line per group of allocations, all groups run concurrently
+ * - "group <name> <key>=<value> ..."
+ * - keys that are not given are taken from the command line
+ *
+ *   # name    workload
+ *   group     audio  count=800 transport=udp bitrate=64000 psize=160
+ *   group     video  count=100 transport=tls bitrate=1500000 psize=1200
+ *   group     talk   count=50  model=onoff:1500:3000 start=10
+ *
+ * Keys:
+ *
+ *   count=<num>              number of allocations (required)
+ *   transport=<proto>        udp, tcp, tls or dtls
+ *   user=<user>, pass=<pass> TURN credentials
+ *   bitrate=<bit/s>          bitrate per allocation
+ *   psize=<bytes>            packet size
+ *   indications=<yes|no>     use DATA/SEND indications instead of channels
+ *   model=<model>            cbr, or onoff:<on ms>:<off ms>
+ *   start=<secs>             traffic start offset
+ */
+
+
+struct scenario {
+	struct allocator *allocator;
+	const struct group *def;
+	unsigned groupc;
+};
+
+
+static int parse_transport(struct group *grp, const struct pl *val)
+{
+	if (0 == pl_strcasecmp(val, "udp")) {
+		grp->proto  = IPPROTO_UDP;
+		grp->secure = false;
+	}
+	else if (0 == pl_strcasecmp(val, "tcp")) {
+		grp->proto  = IPPROTO_TCP;
+		grp->secure = false;
+	}
+	else if (0 == pl_strcasecmp(val, "tls")) {
+		grp->proto  = IPPROTO_TCP;
+		grp->secure = true;
+	}
+	else if (0 == pl_strcasecmp(val, "dtls")) {
+		grp->proto  = IPPROTO_UDP;
+		grp->secure = true;
+	}
+	else
+		return EINVAL;
+
+	return 0;
+}
+
+
+static int parse_model(struct group *grp, const struct pl *val)
+{
+	struct pl on, off;
+
+	if (0 == pl_strcasecmp(val, "cbr")) {
+		grp->on_ms  = 0;
+		grp->off_ms = 0;
+		return 0;
+	}
+
+	if (re_regex(val->p, val->l, "onoff:[0-9]+:[0-9]+", &on, &off))
+		return EINVAL;
+
+	grp->on_ms  = pl_u32(&on);
+	grp->off_ms = pl_u32(&off);
+
+	if (!grp->on_ms || !grp->off_ms)
+		return EINVAL;
+
+	return 0;
+}
+
+
+static int parse_param(struct group *grp, const struct pl *key,
+		       const struct pl *val)
+{
+	if (0 == pl_strcasecmp(key, "count")) {
+		grp->num_allocations = pl_u32(val);
+	}
+	else if (0 == pl_strcasecmp(key, "transport")) {
+		return parse_transport(grp, val);
+	}
+	else if (0 == pl_strcasecmp(key, "user")) {
+		return pl_strcpy(val, grp->user, sizeof(grp->user));
+	}
+	else if (0 == pl_strcasecmp(key, "pass")) {
+		return pl_strcpy(val, grp->pass, sizeof(grp->pass));
+	}
+	else if (0 == pl_strcasecmp(key, "bitrate")) {
+		grp->bitrate = pl_u32(val);
+	}
+	else if (0 == pl_strcasecmp(key, "psize")) {
+		grp->psize = pl_u32(val);
+	}
+	else if (0 == pl_strcasecmp(key, "indications")) {
+		if (0 == pl_strcasecmp(val, "yes"))
+			grp->turn_ind = true;
+		else if (0 == pl_strcasecmp(val, "no"))
+			grp->turn_ind = false;
+		else
+			return EINVAL;
+	}
+	else if (0 == pl_strcasecmp(key, "model")) {
+		return parse_model(grp, val);
+	}
+	else if (0 == pl_strcasecmp(key, "start")) {
+		grp->start_ms = (unsigned)(pl_float(val) * 1000);
+	}
+	else {
+		return ENOENT;
+	}
+
+	return 0;
+}
+
+
+static int group_handler(const struct pl *val, void *arg)
+{
+	struct scenario *sc = arg;
+	struct group grp = *sc->def;
+	struct pl name, tok, key, kval, rest = *val;
+	char buf[32];
+	int err;
+
+	++sc->groupc;
+
+	if (re_regex(val->p, val->l, "[^ \t\r\n]+", &name)) {
+		re_fprintf(stderr, "scenario: group %u has no name\n",
+			   sc->groupc);
+		return EINVAL;
+	}
+
+	rest.l -= name.p + name.l - rest.p;
+	rest.p  = name.p + name.l;
+
+	grp.num_allocations = 0;
+
+	while (0 == re_regex(rest.p, rest.l, "[^ \t\r\n]+", &tok)) {
+
+		rest.l -= tok.p + tok.l - rest.p;
+		rest.p  = tok.p + tok.l;
+
+		if (re_regex(tok.p, tok.l, "[^=]+=[^ \t]*", &key, &kval)) {
+			re_fprintf(stderr, "scenario: group %r: expected"
+				   " key=value, got '%r'\n", &name, &tok);
+			return EINVAL;
+		}
+
+		err = parse_param(&grp, &key, &kval);
+		if (err == ENOENT) {
+			re_fprintf(stderr, "scenario: group %r: unknown key"
+				   " '%r'\n", &name, &key);
+			return EINVAL;
+		}
+		else if (err) {
+			re_fprintf(stderr, "scenario: group %r: invalid value"
+				   " '%r' for %r\n", &name, &kval, &key);
+			return err;
+		}
+	}
+
+	if (!grp.num_allocations) {
+		re_fprintf(stderr, "scenario: group %r: count is missing\n",
+			   &name);
+		return EINVAL;
+	}
+
+	if (!grp.bitrate || grp.psize < HDR_SIZE) {
+		re_fprintf(stderr, "scenario: group %r: bitrate or packet"
+			   " size is too low\n", &name);
+		return EINVAL;
+	}
+
+	pl_strcpy(&name, buf, sizeof(buf));
+
+	err = allocator_group_add(sc->allocator, buf, &grp);
+	if (err == EOVERFLOW) {
+		re_fprintf(stderr, "scenario: too many groups (max %u)\n",
+			   GROUPS_MAX);
+	}
+
+	return err;
+}
+
+
+/*
+ * Load the groups of a scenario file into the allocator. Anything that
+ * a group does not set is taken from def.
+ */
+int scenario_load(struct allocator *allocator, const char *path,
+		  const struct group *def)
+{
+	struct scenario sc;
+	struct conf *conf;
+	int err;
+
+	if (!allocator || !path || !def)
+		return EINVAL;
+
+	err = conf_alloc(&conf, path);
+	if (err) {
+		re_fprintf(stderr, "scenario: could not read %s (%m)\n",
+			   path, err);
+		return err;
+	}
+
+	memset(&sc, 0, sizeof(sc));
+	sc.allocator = allocator;
+	sc.def       = def;
+
+	err = conf_apply(conf, "group", group_handler, &sc);
+	if (err)
+		goto out;
+
+	if (!sc.groupc) {
+		re_fprintf(stderr, "scenario: no groups in %s\n", path);
+		err = EINVAL;
+	}
+
+ out:
+	mem_deref(conf);
+
+	return err;
+}
@@ -5,6 +5,7 @@
  */
 
 #include <pthread.h>
+#include <string.h>
 #include <re.h>
 #include "turnperf.h"
 
@@ -18,29 +19,21 @@
  *   - packet time interval
  *   - packet size
  *   - bitrate
+ *   - optional on/off model, e.g. talk spurts or bursty video
+ * - or flood mode: unpaced, at most "window" packets in flight, which
+ *   are sent as soon as the receiver sees older packets arrive
  */
 
 
-struct sender {
-	struct allocation *alloc;  /* pointer */
-	uint32_t session_cookie;
-	uint32_t alloc_id;
-	uint32_t seq;
-
-	unsigned bitrate;          /* target bitrate [bit/s] */
-	unsigned ptime;
-	size_t psize;
-
-	uint64_t ts;               /* running timestamp */
-	uint64_t ts_start;
-	uint64_t ts_stop;
-
-	uint64_t total_bytes;
-	uint64_t total_packets;
-};
+/* the local socket buffer was full, the packet never left the host */
+static bool is_drop(int err)
+{
+	return err == ENOBUFS || err == EAGAIN || err == EWOULDBLOCK;
+}
 
 
-static int send_packet(struct sender *snd)
+/* send one packet, with send time "now" [us] */
+static int send_packet(struct sender *snd, uint64_t now)
 {
 	struct mbuf *mb = mbuf_alloc(1024);
 #define PRESZ 48
@@ -55,21 +48,28 @@ static int send_packet(struct sender *snd)
 	mb->pos = PRESZ;
 
 	err = protocol_encode(mb, snd->session_cookie, snd->alloc_id,
-			      ++snd->seq, payload_len, PATTERN);
+			      ++snd->seq, now, payload_len, PATTERN);
 	if (err)
 		goto out;
 
 	mb->pos = PRESZ;
 
-	err = allocation_tx(snd->alloc, mb);
-	if (err) {
-		re_fprintf(stderr, "sender: allocation_tx(%zu bytes)"
-			   " failed (%m)\n", snd->psize, err);
+	err = allocation_tx(snd->alloc, snd->peer, mb);
+	if (is_drop(err)) {
+		if (snd->measure)
+			++snd->tx_drops;
+		goto out;
+	}
+	else if (err) {
+		events_add(snd->ev, EVENT_TX_ERROR, snd->alloc_id, NULL, NULL,
+			   err, 0, 0);
 		goto out;
 	}
 
-	snd->total_bytes   += mbuf_get_left(mb);
-	snd->total_packets += 1;
+	if (snd->measure) {
+		snd->total_bytes   += mbuf_get_left(mb);
+		snd->total_packets += 1;
+	}
 
  out:
 	mem_deref(mb);
@@ -78,34 +78,270 @@ static int send_packet(struct sender *snd)
 }
 
 
-void sender_tick(struct sender *snd, uint64_t now)
+/*
+ * Encode a train of equal-size packets, and send it in one go. If the
+ * train is stopped part-way, only the packets that were not sent are
+ * drops or errors. The number of packets sent is returned in "sentp".
+ */
+static int send_train(struct sender *snd, unsigned n, uint64_t now,
+		      unsigned *sentp)
 {
-	if (!snd)
+	struct mbuf *mb;
+	size_t payload_len;
+	unsigned i, sent = 0;
+	int err = 0;
+
+	mb = mbuf_alloc(PRESZ + n * snd->psize);
+	if (!mb)
+		return ENOMEM;
+
+	payload_len = snd->psize - HDR_SIZE;
+
+	mb->pos = PRESZ;
+
+	for (i = 0; i < n; i++) {
+
+		err = protocol_encode(mb, snd->session_cookie, snd->alloc_id,
+				      ++snd->seq, now, payload_len, PATTERN);
+		if (err)
+			goto out;
+	}
+
+	mb->pos = PRESZ;
+
+	err = allocation_tx_train(snd->alloc, snd->peer, mb, snd->psize,
+				  &sent);
+
+	sent = min(sent, n);
+
+	if (snd->measure) {
+		snd->total_bytes   += sent * snd->psize;
+		snd->total_packets += sent;
+	}
+
+	if (is_drop(err)) {
+		if (snd->measure)
+			snd->tx_drops += n - sent;
+	}
+	else if (err) {
+		events_add(snd->ev, EVENT_TX_ERROR, snd->alloc_id, NULL, NULL,
+			   err, n - sent, 0);
+	}
+
+ out:
+	if (sentp)
+		*sentp = sent;
+
+	mem_deref(mb);
+
+	return err;
+}
+
+
+/*
+ * On/off traffic model: the sender is on for on_ms and silent for off_ms,
+ * starting with the first packet. Returns the start of the next on
+ * period if "ts" falls into an off period, otherwise zero.
+ */
+static uint64_t next_on(const struct sender *snd, uint64_t ts)
+{
+	const uint64_t cycle = (snd->on_ms + snd->off_ms) * 1000ULL;
+	uint64_t pos;
+
+	if (!snd->off_ms)
+		return 0;
+
+	pos = (ts - snd->ts_origin) % cycle;
+	if (pos < snd->on_ms * 1000ULL)
+		return 0;
+
+	return ts - pos + cycle;
+}
+
+
+/* slip of a packet that was scheduled at "sched" and sent at "now" */
+static void slip_add(struct sender *snd, uint64_t sched, uint64_t now,
+		     struct histogram *slip)
+{
+	const uint64_t late = now > sched ? now - sched : 0;
+
+	if (!snd->measure)
+		return;
+
+	snd->slip_sum += late;
+	if (late > snd->slip_max)
+		snd->slip_max = late;
+	++snd->slip_count;
+
+	hist_add(slip, late);
+}
+
+
+/*
+ * Send the packets that are due at "now" [us], the start of the tick.
+ * Without GSO this is one packet per tick, as paced before. With GSO
+ * a late sender catches up its backlog, up to SENDER_BURST_MAX.
+ *
+ * How late each packet is compared to its scheduled time is measured
+ * when it is actually sent, so the time spent on the senders before it
+ * in the tick is included, and recorded in the slip histogram.
+ */
+void sender_tick(struct sender *snd, uint64_t now, struct histogram *slip)
+{
+	uint64_t schedv[SENDER_BURST_MAX];
+	unsigned i, j, n = 0, train, burst;
+	uint64_t ts;
+
+	if (!snd || !snd->alloc)
 		return;
 
-	if (now >= snd->ts) {
+	burst = allocation_gso(snd->alloc) ? SENDER_BURST_MAX : 1;
 
-		send_packet(snd);
-		snd->ts += snd->ptime;
+	/* send the packets that are due, with GSO including any backlog */
+	while (now >= snd->ts && n < burst) {
+
+		const uint64_t on = next_on(snd, snd->ts);
+
+		/* silent period, no packets and no sequence numbers */
+		if (on) {
+			snd->ts = on;
+			continue;
+		}
+
+		schedv[n++] = snd->ts;
+		snd->ts += snd->ptime * 1000;
+	}
+
+	/* the tick ended with packets still due */
+	if (now >= snd->ts && snd->measure)
+		++snd->backlog_ticks;
+
+	if (n > 1 && allocation_gso(snd->alloc)) {
+
+		train = max(GSO_MAX_BYTES / snd->psize, 1);
+
+		for (i = 0; i < n; i += train) {
+			unsigned k = min(n - i, train);
+
+			ts = time_usec();
+
+			for (j = i; j < i + k; j++)
+				slip_add(snd, schedv[j], ts, slip);
+
+			send_train(snd, k, ts, NULL);
+		}
+
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+
+		ts = time_usec();
+
+		slip_add(snd, schedv[i], ts, slip);
+		send_packet(snd, ts);
 	}
 }
 
 
-static void destructor(void *arg)
+/*
+ * Flood mode: send until "window" packets are in flight, i.e. sent
+ * after "acked", the highest sequence number received so far. A full
+ * socket buffer stops the burst. If nothing arrived for FLOOD_RESYNC
+ * the packets in flight are considered lost. Returns the number of
+ * packets that were sent.
+ */
+unsigned sender_flood(struct sender *snd, uint32_t acked, unsigned window,
+		      uint64_t now)
 {
-	struct sender *snd = arg;
-	(void)snd;
+	uint32_t base, inflight;
+	unsigned n, sent = 0;
+	int err;
+
+	if (!snd || !snd->alloc || now < snd->ts)
+		return 0;
+
+	if (acked != snd->flood_acked) {
+		snd->flood_acked = acked;
+		snd->ts_flood    = now;
+	}
+	else if (now > snd->ts_flood + FLOOD_RESYNC * 1000) {
+		snd->flood_base = snd->seq;
+		snd->ts_flood   = now;
+	}
+
+	base     = max(acked, snd->flood_base);
+	inflight = snd->seq > base ? snd->seq - base : 0;
+
+	if (inflight >= window)
+		return 0;
+
+	n = min(window - inflight, SENDER_BURST_MAX);
+
+	if (n > 1 && allocation_gso(snd->alloc)) {
+
+		const unsigned train = max(GSO_MAX_BYTES / snd->psize, 1);
+
+		while (sent < n) {
+			unsigned k = min(n - sent, train), m = 0;
+
+			err = send_train(snd, k, time_usec(), &m);
+
+			sent += m;
+			if (err)
+				break;
+		}
+	}
+	else {
+		while (sent < n) {
+
+			err = send_packet(snd, time_usec());
+			if (err)
+				break;
+
+			++sent;
+		}
+	}
+
+	snd->flood_sent += sent;
+
+	return sent;
 }
 
 
-int sender_alloc(struct sender **senderp, struct allocation *alloc,
-		 uint32_t session_cookie, uint32_t alloc_id,
-		 unsigned bitrate, unsigned ptime, size_t psize)
+/*
+ * A packet that was counted as sent failed later, in an asynchronous
+ * datapath. A full socket buffer is a drop, other errors are events.
+ */
+void sender_tx_failed(struct sender *snd, size_t len, int err)
 {
-	struct sender *snd;
-	int err = 0;
+	if (!snd)
+		return;
+
+	if (snd->flood_sent)
+		--snd->flood_sent;
 
-	if (!senderp || !bitrate)
+	if (snd->measure && snd->total_packets) {
+		--snd->total_packets;
+		snd->total_bytes -= min(len, snd->total_bytes);
+	}
+
+	if (is_drop(err)) {
+		if (snd->measure)
+			++snd->tx_drops;
+	}
+	else {
+		events_add(snd->ev, EVENT_TX_ERROR, snd->alloc_id, NULL, NULL,
+			   err, 0, 0);
+	}
+}
+
+
+int sender_init(struct sender *snd, struct allocation *alloc,
+		uint32_t session_cookie, uint32_t alloc_id,
+		unsigned bitrate, unsigned ptime, size_t psize)
+{
+	if (!snd || !bitrate)
 		return EINVAL;
 
 	if (ptime < PACING_INTERVAL_MS) {
@@ -117,9 +353,7 @@ int sender_alloc(struct sender **senderp, struct allocation *alloc,
 		return EINVAL;
 	}
 
-	snd = mem_zalloc(sizeof(*snd), destructor);
-	if (!snd)
-		return ENOMEM;
+	memset(snd, 0, sizeof(*snd));
 
 	snd->alloc          = alloc;
 	snd->session_cookie = session_cookie;
@@ -128,35 +362,76 @@ int sender_alloc(struct sender **senderp, struct allocation *alloc,
 	snd->ptime          = ptime;
 	snd->psize          = psize;
 
-	if (err)
-		mem_deref(snd);
-	else
-		*senderp = snd;
+	return 0;
+}
 
-	return err;
+
+void sender_reset(struct sender *snd)
+{
+	if (!snd)
+		return;
+
+	memset(snd, 0, sizeof(*snd));
 }
 
 
-int sender_start(struct sender *snd)
+/*
+ * Start sending after delay_ms, which is the start offset of a group.
+ * With a warm-up, the counters start with sender_measure_start().
+ */
+int sender_start(struct sender *snd, unsigned delay_ms, bool measure)
 {
 	if (!snd)
 		return EINVAL;
 
-	snd->ts_start = tmr_jiffies();
+	snd->ts_start = tmr_jiffies() + delay_ms;
+	snd->measure  = measure;
+	snd->measured = measure;
 
 	/* random component to smoothe traffic */
-	snd->ts       = tmr_jiffies() + rand_u16() % 100;
+	snd->ts        = time_usec() + (delay_ms + rand_u16() % 100) * 1000;
+	snd->ts_origin = snd->ts;
 
 	return 0;
 }
 
 
+/* end of the measurement window, the sender may still be running */
 void sender_stop(struct sender *snd)
 {
-	if (!snd)
+	if (!snd || !snd->alloc)
 		return;
 
-	snd->ts_stop = tmr_jiffies();
+	/* also a sender that was never measured, e.g. in the warm-up */
+	if (snd->measure || !snd->ts_stop)
+		snd->ts_stop = tmr_jiffies();
+
+	snd->measure = false;
+}
+
+
+/*
+ * Start a new measurement window. Everything counted so far, such as
+ * the warm-up period, is discarded.
+ */
+void sender_measure_start(struct sender *snd)
+{
+	if (!snd || !snd->alloc)
+		return;
+
+	snd->total_bytes   = 0;
+	snd->total_packets = 0;
+	snd->tx_drops      = 0;
+	snd->slip_sum      = 0;
+	snd->slip_max      = 0;
+	snd->slip_count    = 0;
+	snd->backlog_ticks = 0;
+
+	/* a sender with a start offset may not be running yet */
+	snd->ts_start = max(tmr_jiffies(), snd->ts_start);
+	snd->ts_stop  = 0;
+	snd->measure  = true;
+	snd->measured = true;
 }
 
 
@@ -166,14 +441,36 @@ uint64_t sender_get_packets(const struct sender *snd)
 }
 
 
+/* average scheduling slip [us] */
+double sender_get_slip(const struct sender *snd)
+{
+	if (!snd || !snd->slip_count)
+		return .0;
+
+	return (double)snd->slip_sum / (double)snd->slip_count;
+}
+
+
+uint64_t sender_get_drops(const struct sender *snd)
+{
+	return snd ? snd->tx_drops : 0ULL;
+}
+
+
+/* a measurement window was opened, e.g. not stopped in the warm-up */
+bool sender_measured(const struct sender *snd)
+{
+	return snd && snd->measured;
+}
+
+
+/* zero if the sender was never measured, or is not stopped yet */
 double sender_get_bitrate(const struct sender *snd)
 {
 	double duration;
 
-	if (!snd)
+	if (!sender_measured(snd) || snd->ts_stop <= snd->ts_start)
 		return .0;
-	if (!snd->ts_start || !snd->ts_stop)
-		return -1.0;
 
 	duration = snd->ts_stop - snd->ts_start;
 
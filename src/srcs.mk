@@ -10,3 +10,20 @@ SRCS	+= sender.c
 SRCS	+= receiver.c
 SRCS	+= util.c
 SRCS	+= protocol.c
+SRCS	+= stats.c
+SRCS	+= monitor.c
+SRCS	+= relay.c
+SRCS	+= result.c
+SRCS	+= handshake.c
+SRCS	+= scenario.c
+SRCS	+= cluster.c
+SRCS	+= cred.c
+SRCS	+= events.c
+SRCS	+= live.c
+SRCS	+= dump.c
+SRCS	+= stall.c
+SRCS	+= flood.c
+
+ifneq ($(USE_IO_URING),)
+SRCS	+= uring.c
+endif
@@ -0,0 +1,201 @@
+/**
+ * @file stall.c Stalls of the relay, correlated across the streams
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include "turnperf.h"
+
+
+/*
+ * Stalls:
+ *
+ * - a receiver reports a gap between two arrivals that is longer than
+ *   its threshold, when the second packet arrives
+ * - a gap that overlaps the open stall event, within MERGE_SLACK, is
+ *   added to it, otherwise the open event is closed and a new one is
+ *   started. A pause of the server shows up as one event with many
+ *   flows, a problem of one path as events with a single flow
+ * - the last STALL_RING events are kept, and the one with most flows
+ * - streams with an on/off model are silent by design, and not checked
+ */
+
+
+enum {
+	MERGE_SLACK = 20,             /* [ms] */
+	WORST_MAX = 5,                /* streams, in the summary */
+};
+
+
+void stalls_init(struct stalls *st)
+{
+	if (!st)
+		return;
+
+	memset(st, 0, sizeof(*st));
+
+	st->ts_base = tmr_jiffies();
+}
+
+
+static void event_close(struct stalls *st)
+{
+	if (!st->open)
+		return;
+
+	st->ringv[st->total++ % STALL_RING] = st->cur;
+
+	if (st->cur.flows > st->worst.flows)
+		st->worst = st->cur;
+
+	st->open = false;
+}
+
+
+/* a stream received nothing from start to end [ms] */
+void stalls_add(struct stalls *st, uint64_t start, uint64_t end)
+{
+	struct stall *cur;
+	uint64_t gap = end - start;
+
+	if (!st)
+		return;
+
+	cur = &st->cur;
+
+	++st->gaps;
+	st->gap_max = max(st->gap_max, gap);
+
+	if (st->open && start <= cur->end + MERGE_SLACK &&
+	    end + MERGE_SLACK >= cur->start) {
+
+		cur->start   = min(cur->start, start);
+		cur->end     = max(cur->end, end);
+		cur->gap_max = max(cur->gap_max, gap);
+		++cur->flows;
+		return;
+	}
+
+	event_close(st);
+
+	cur->start   = start;
+	cur->end     = end;
+	cur->gap_max = gap;
+	cur->flows   = 1;
+
+	st->open = true;
+}
+
+
+/* close the open event, at the end of the traffic */
+void stalls_flush(struct stalls *st)
+{
+	if (!st)
+		return;
+
+	event_close(st);
+}
+
+
+static void stall_print(const struct stalls *st, const struct stall *ev,
+			unsigned streams)
+{
+	re_printf("%8.3f s  %8llu ms  %8llu ms  %7u (%.1f%%)\n",
+		  (ev->start - st->ts_base) / 1000.0,
+		  (unsigned long long)(ev->end - ev->start),
+		  (unsigned long long)ev->gap_max, ev->flows,
+		  streams ? 100.0 * ev->flows / streams : .0);
+}
+
+
+/* the streams with the most stall time */
+static void worst_print(const struct allocator *allocator)
+{
+	const struct receiver *worstv[WORST_MAX];
+	unsigned i, j, n = 0, stalled = 0, peers;
+
+	for (i = 0; i < allocator_streams(allocator); i++) {
+
+		const struct receiver *recv = &allocator->recvv[i];
+
+		if (!recv->stallc)
+			continue;
+
+		++stalled;
+
+		for (j = n; j > 0; j--) {
+			if (worstv[j - 1]->stall_sum >= recv->stall_sum)
+				break;
+			if (j < WORST_MAX)
+				worstv[j] = worstv[j - 1];
+		}
+
+		if (j < WORST_MAX) {
+			worstv[j] = recv;
+			n = min(n + 1, WORST_MAX);
+		}
+	}
+
+	re_printf("%u of %u streams stalled\n", stalled,
+		  allocator_streams(allocator));
+
+	peers = max(allocator->peers, 1);
+
+	for (i = 0; i < n; i++) {
+
+		const struct receiver *recv = worstv[i];
+
+		re_printf("  stream #%u/%u: %u stalls, %llu ms in total,"
+			  " longest %llu ms\n",
+			  recv->allocid / peers, recv->allocid % peers,
+			  recv->stallc,
+			  (unsigned long long)recv->stall_sum,
+			  (unsigned long long)recv->stall_max);
+	}
+}
+
+
+void stalls_print(const struct allocator *allocator)
+{
+	const struct stalls *st;
+	uint64_t first, i;
+	unsigned streams;
+
+	if (!allocator)
+		return;
+
+	st = &allocator->stalls;
+	if (!st->gaps)
+		return;
+
+	streams = allocator_streams(allocator);
+
+	re_printf("stall summary: %llu events, %llu gaps,"
+		  " longest gap %llu ms\n",
+		  (unsigned long long)st->total,
+		  (unsigned long long)st->gaps,
+		  (unsigned long long)st->gap_max);
+
+	first = st->total > STALL_RING ? st->total - STALL_RING : 0;
+
+	re_printf("%10s  %11s  %11s  %s\n",
+		  "start", "duration", "longest", "flows");
+	re_printf("most flows:\n");
+	stall_print(st, &st->worst, streams);
+
+	re_printf("last %u events:\n", (unsigned)(st->total - first));
+
+	for (i = first; i < st->total; i++)
+		stall_print(st, &st->ringv[i % STALL_RING], streams);
+
+	worst_print(allocator);
+
+	if (monitor_saturated(&allocator->mon)) {
+		re_printf("warning: the client was saturated, stalls can"
+			  " be caused by the client itself\n");
+	}
+
+	re_printf("\n");
+}
@@ -0,0 +1,185 @@
+/**
+ * @file stats.c Statistics helpers
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include "turnperf.h"
+
+
+/*
+ * Histogram:
+ *
+ * - log-linear buckets, 4 sub-buckets per power of two
+ * - relative error of a percentile is below 25%
+ * - fixed size, no allocations when adding values
+ *
+ * Sketch:
+ *
+ * - the first SKETCH_BUCKETS buckets of the histogram, with 32-bit
+ *   counters, small enough to keep one per stream
+ * - larger values are counted in the last bucket
+ */
+
+
+static unsigned bucket_index(uint64_t val)
+{
+	unsigned msb;
+
+	if (val < HIST_SUB)
+		return (unsigned)val;
+
+	msb = 63 - __builtin_clzll(val);
+
+	return (msb - 1) * HIST_SUB + ((val >> (msb - 2)) & (HIST_SUB - 1));
+}
+
+
+static uint64_t bucket_lower(unsigned ix)
+{
+	unsigned msb, sub;
+
+	if (ix < HIST_SUB)
+		return ix;
+
+	msb = ix / HIST_SUB + 1;
+	sub = ix % HIST_SUB;
+
+	return (uint64_t)(HIST_SUB + sub) << (msb - 2);
+}
+
+
+void hist_reset(struct histogram *h)
+{
+	if (!h)
+		return;
+
+	memset(h, 0, sizeof(*h));
+}
+
+
+void hist_add(struct histogram *h, uint64_t val)
+{
+	if (!h)
+		return;
+
+	++h->bucketv[bucket_index(val)];
+	++h->count;
+	h->sum += val;
+
+	if (h->count == 1 || val < h->min)
+		h->min = val;
+	if (val > h->max)
+		h->max = val;
+}
+
+
+void hist_merge(struct histogram *dst, const struct histogram *src)
+{
+	unsigned i;
+
+	if (!dst || !src || !src->count)
+		return;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->bucketv[i] += src->bucketv[i];
+
+	if (!dst->count || src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+
+	dst->count += src->count;
+	dst->sum   += src->sum;
+}
+
+
+/* value below which pct percent of the samples fall */
+uint64_t hist_percentile(const struct histogram *h, double pct)
+{
+	uint64_t rank, n = 0;
+	unsigned i;
+
+	if (!h || !h->count)
+		return 0;
+
+	rank = (uint64_t)(pct / 100.0 * (double)h->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+
+		n += h->bucketv[i];
+
+		if (n >= rank) {
+			uint64_t upper = bucket_lower(i + 1) - 1;
+
+			return min(max(upper, h->min), h->max);
+		}
+	}
+
+	return h->max;
+}
+
+
+double hist_mean(const struct histogram *h)
+{
+	if (!h || !h->count)
+		return .0;
+
+	return (double)h->sum / (double)h->count;
+}
+
+
+/* print histogram summary, values are in microseconds */
+int hist_print(struct re_printf *pf, const struct histogram *h)
+{
+	if (!h || !h->count)
+		return re_hprintf(pf, "(no samples)");
+
+	return re_hprintf(pf, "min=%.3f avg=%.3f p50=%.3f p99=%.3f"
+			  " max=%.3f ms (%llu samples)",
+			  h->min / 1000.0,
+			  hist_mean(h) / 1000.0,
+			  hist_percentile(h, 50) / 1000.0,
+			  hist_percentile(h, 99) / 1000.0,
+			  h->max / 1000.0,
+			  (unsigned long long)h->count);
+}
+
+
+void sketch_add(struct sketch *sk, uint64_t val)
+{
+	if (!sk)
+		return;
+
+	++sk->bucketv[min(bucket_index(val), SKETCH_BUCKETS - 1)];
+	++sk->count;
+}
+
+
+/* upper bound of the bucket with percentile pct */
+uint64_t sketch_percentile(const struct sketch *sk, double pct)
+{
+	uint64_t rank, n = 0;
+	unsigned i;
+
+	if (!sk || !sk->count)
+		return 0;
+
+	rank = (uint64_t)(pct / 100.0 * (double)sk->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+
+	for (i = 0; i < SKETCH_BUCKETS; i++) {
+
+		n += sk->bucketv[i];
+
+		if (n >= rank)
+			break;
+	}
+
+	return bucket_lower(min(i, SKETCH_BUCKETS - 1) + 1) - 1;
+}
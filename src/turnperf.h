@@ -5,10 +5,418 @@
  */
 
 
+#include <sys/time.h>
 #include <time.h>
 
 
 #define PACING_INTERVAL_MS 5
+#define SOCKETS_PER_ALLOC 2            /* TURN socket and first peer */
+#define RELAY_SOCKETS 2                /* relayed socket, TCP connection */
+#define RELAY_CAPACITY 10000           /* allocations of -S, without -a */
+#define FD_RESERVE 64
+#define URING_ENTRIES_MAX 32768        /* limit of the kernel */
+#define URING_BUFFERS_MAX (64 << 20)   /* registered buffers [bytes] */
+#define SENDER_BURST_MAX 64
+#define GSO_MAX_BYTES 65000
+#define SOCKBUF_DEFAULT 524288
+
+
+/*
+ * stats
+ */
+
+#define HIST_SUB 4
+#define HIST_BUCKETS 252
+
+struct histogram {
+	uint64_t bucketv[HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+};
+
+void     hist_reset(struct histogram *h);
+void     hist_add(struct histogram *h, uint64_t val);
+void     hist_merge(struct histogram *dst, const struct histogram *src);
+uint64_t hist_percentile(const struct histogram *h, double pct);
+double   hist_mean(const struct histogram *h);
+int      hist_print(struct re_printf *pf, const struct histogram *h);
+
+#define SKETCH_BUCKETS 96              /* up to 33 seconds [us] */
+
+/* per-stream histogram, coarse and without min/max */
+struct sketch {
+	uint32_t bucketv[SKETCH_BUCKETS];
+	uint32_t count;
+};
+
+void     sketch_add(struct sketch *sk, uint64_t val);
+uint64_t sketch_percentile(const struct sketch *sk, double pct);
+
+
+/*
+ * monitor
+ */
+
+struct monitor {
+	struct histogram lateness;     /* pacing timer lateness [us] */
+	struct histogram tick;         /* pacing tick duration [us] */
+	struct tmr tmr;
+	uint64_t ts_start;             /* [us] */
+	uint64_t ts_stop;
+	uint64_t ts_sample;
+	double cpu_start;              /* [s] */
+	double cpu_stop;
+	double cpu_sample;
+	double cpu_max;                /* [%] */
+	unsigned n_saturated;
+	long maxrss;                   /* [KB] */
+};
+
+void monitor_start(struct monitor *mon);
+void monitor_stop(struct monitor *mon);
+void monitor_tick(struct monitor *mon, uint64_t scheduled,
+		  uint64_t start, uint64_t end);
+bool monitor_saturated(const struct monitor *mon);
+void monitor_print(const struct monitor *mon);
+
+
+/*
+ * events
+ */
+
+#define EVENT_RING 64                  /* last events, kept for the end */
+#define EVENT_SAMPLE 16                /* packet bytes kept per event */
+
+enum event_type {
+	EVENT_FOREIGN = 0,             /* not a turnperf packet */
+	EVENT_DECODE,                  /* turnperf packet, did not decode */
+	EVENT_COOKIE,                  /* from another session */
+	EVENT_ALLOC_ID,                /* for another stream */
+	EVENT_REORDER,                 /* late or out-of-order */
+	EVENT_NOT_READY,               /* data before the allocation */
+	EVENT_PEER_ADDR,               /* peer address changed */
+	EVENT_TX_ERROR,                /* send failed, not a drop */
+	EVENT_MAX
+};
+
+struct event {
+	uint64_t ts;                   /* [ms] */
+	enum event_type type;
+	uint32_t id;                   /* stream or allocation number */
+	int err;
+	uint32_t a, b;                 /* e.g. expected and actual */
+	struct sa src;
+	uint8_t sample[EVENT_SAMPLE];  /* first bytes of the packet */
+	size_t samplec;
+	size_t size;                   /* [bytes] */
+};
+
+/* counted always, logged at a limited rate, the last ones are kept */
+struct events {
+	uint64_t countv[EVENT_MAX];
+	struct event ringv[EVENT_RING];
+	uint64_t total;
+	uint64_t ts_log;               /* start of the log window [ms] */
+	unsigned n_log;                /* logged in this window */
+	uint64_t suppressed;
+	bool deferred;                 /* printed by the live view */
+	uint64_t flushed;              /* events up to here were shown */
+};
+
+void events_add(struct events *ev, enum event_type type, uint32_t id,
+		const struct sa *src, const struct mbuf *mb, int err,
+		uint32_t a, uint32_t b);
+void events_flush(struct events *ev);
+const char *event_name(enum event_type type);
+void events_print(const struct events *ev);
+
+
+/*
+ * stalls
+ */
+
+#define STALL_MS 250                   /* default gap threshold */
+#define STALL_MS_MAX 60000
+#define STALL_PTIMES 3                 /* min threshold, in packet times */
+#define STALL_RING 64                  /* last events, kept for the end */
+
+/* gaps of one or more streams that overlap in time */
+struct stall {
+	uint64_t start;                /* [ms] */
+	uint64_t end;
+	uint64_t gap_max;              /* longest gap of a stream [ms] */
+	unsigned flows;
+};
+
+struct stalls {
+	struct stall cur;              /* open event */
+	bool open;
+	struct stall ringv[STALL_RING];
+	struct stall worst;            /* with the most flows */
+	uint64_t total;                /* closed events */
+	uint64_t gaps;                 /* of all streams */
+	uint64_t gap_max;              /* [ms] */
+	uint64_t ts_base;              /* traffic started [ms] */
+};
+
+struct allocator;
+
+void stalls_init(struct stalls *st);
+void stalls_add(struct stalls *st, uint64_t start, uint64_t end);
+void stalls_flush(struct stalls *st);
+void stalls_print(const struct allocator *allocator);
+
+
+/*
+ * flood
+ */
+
+#define FLOOD_WINDOW_MAX 4096          /* packets in flight per stream */
+#define FLOOD_RESYNC 200               /* no progress, give up [ms] */
+#define FLOOD_STEPS_MAX 16
+
+/* one window size, or the maximum window until the end */
+struct flood_step {
+	unsigned window;
+	uint64_t duration;             /* [ms] */
+	uint64_t sent;
+	uint64_t recv;
+	uint64_t lost;
+	uint64_t lat_sum;              /* [us] */
+};
+
+struct flood_snap {
+	uint64_t sent;
+	uint64_t recv;
+	uint64_t lat_sum;              /* [us] */
+	uint64_t inflight;
+};
+
+struct flood {
+	unsigned window_max;           /* zero is paced traffic */
+	unsigned window;               /* current step */
+	uint64_t ts_step;              /* [ms] */
+	struct flood_snap snap;        /* at the start of the step */
+	struct flood_step stepv[FLOOD_STEPS_MAX];
+	unsigned stepc;
+};
+
+struct result;
+
+void flood_init(struct flood *fl, unsigned window_max);
+void flood_tick(struct allocator *allocator);
+void flood_flush(struct allocator *allocator);
+void flood_get_result(const struct flood *fl, struct result *res);
+void flood_print(const struct allocator *allocator);
+
+
+/*
+ * handshake
+ */
+
+struct ssl_session_st;
+
+struct handshake {
+	bool resume;                   /* offer the last session */
+	struct ssl_session_st *session;
+	unsigned n_sessions;           /* sessions received */
+	struct histogram full;         /* handshake time [us] */
+	struct histogram resumed;      /* handshake time [us] */
+	uint64_t ts_first;             /* [us] */
+	uint64_t ts_last;
+	double cpu_first;              /* [s] */
+	double cpu_last;
+};
+
+int  handshake_init(struct handshake *hs, struct tls *tls, bool resume);
+void handshake_close(struct handshake *hs, struct tls *tls);
+void handshake_print(const struct handshake *hs, const char *name);
+
+
+/*
+ * group
+ */
+
+#define GROUPS_MAX 16
+
+/* allocations with the same workload, that are reported together */
+struct group {
+	char name[32];
+	unsigned count;                /* allocations created so far */
+	struct histogram latency;      /* one-way relay latency [us] */
+
+	/* workload */
+	unsigned num_allocations;
+	int proto;
+	bool secure;
+	char user[64];
+	char pass[64];
+	unsigned bitrate;              /* per allocation [bit/s] */
+	size_t psize;                  /* [bytes] */
+	bool turn_ind;
+	unsigned on_ms;                /* on/off traffic model, */
+	unsigned off_ms;               /* zero off_ms is constant bitrate */
+	unsigned start_ms;             /* traffic start offset */
+};
+
+
+/*
+ * server
+ */
+
+#define SERVERS_MAX 32
+
+/* one TURN server of a cluster, and the allocations it got */
+struct server {
+	struct sa addr;
+	unsigned weight;               /* zero if only reached by redirect */
+	int cw;                        /* current weight, for selection */
+	unsigned allocs;               /* allocations sent to the server */
+	unsigned ok;                   /* established on the server */
+	unsigned failed;
+	unsigned lost;                 /* failed after it was established */
+	unsigned redirects;            /* redirected to another server */
+	unsigned redirected;           /* redirected from another server */
+	struct histogram atime;        /* allocation time [us] */
+};
+
+
+/*
+ * fan-out
+ */
+
+#define PEERS_MAX 128
+#define FANOUT_BUCKETS 8               /* peers 1, 2, 3-4, .. 65-128 */
+
+unsigned fanout_bucket(unsigned peers);
+
+
+/*
+ * result
+ */
+
+struct group_result {
+	const char *name;
+	const char *protocol;
+	unsigned bitrate;              /* requested, per allocation [bit/s] */
+	size_t psize;
+	bool turn_ind;
+	unsigned allocs;
+	uint64_t sent;
+	uint64_t recv;
+	double send_bitrate;           /* total [bit/s] */
+	double recv_bitrate;
+	double pps;                    /* relayed packets per second */
+	struct histogram latency;      /* [us] */
+};
+
+struct server_result {
+	const struct server *srv;
+	uint64_t sent;
+	uint64_t recv;
+	double recv_bitrate;           /* total [bit/s] */
+};
+
+/* estimated IP-level throughput of one transport and TURN framing */
+struct wire_result {
+	const char *protocol;
+	bool turn_ind;                 /* Data indications, or channels */
+	unsigned streams;
+	double send_bitrate;           /* goodput, peers to relay [bit/s] */
+	double send_wire;              /* with UDP/IP headers [bit/s] */
+	double recv_bitrate;           /* goodput, server to client [bit/s] */
+	double recv_wire;              /* with TURN framing, transport */
+};
+
+#define WIRE_MAX 8
+
+struct fanout_result {
+	unsigned lo, hi;               /* peer numbers, from 1 */
+	unsigned streams;
+	uint64_t sent;
+	uint64_t recv;
+	double recv_bitrate;           /* total [bit/s] */
+	struct histogram setup;        /* permission/channel setup [us] */
+};
+
+struct result {
+	/* configuration */
+	const char *server;
+	const char *protocol;
+	const char *software;          /* server software, if known */
+	unsigned num_allocations;
+	unsigned bitrate;              /* requested, per allocation [bit/s] */
+	size_t psize;
+	bool turn_ind;
+	int ind_pct;                   /* A/B split, -1 if not used */
+	bool mixed;                    /* the groups differ, see groupv */
+
+	/* allocations */
+	unsigned allocs_ok;
+	unsigned allocs_failed;
+	double alloc_duration;         /* [ms] */
+	struct histogram atime;        /* allocation time [us] */
+	struct histogram auth;         /* challenge to success [us] */
+
+	/* traffic */
+	uint64_t sent;
+	uint64_t recv;
+	uint64_t txdrop;
+	uint64_t rxdrop;
+	double send_bitrate;           /* total [bit/s] */
+	double recv_bitrate;
+	double send_wire;              /* estimated on the wire [bit/s] */
+	double recv_wire;
+	struct histogram latency;      /* [us] */
+	struct histogram slip;         /* [us] */
+
+	/* per group, only if there is more than one */
+	struct group_result groupv[GROUPS_MAX];
+	unsigned groupc;
+
+	/* per server, only if there is more than one */
+	struct server_result serverv[SERVERS_MAX];
+	unsigned serverc;
+
+	/* on the wire, per transport and TURN framing in use */
+	struct wire_result wirev[WIRE_MAX];
+	unsigned wirec;
+
+	/* counted events of the packet paths */
+	uint64_t eventv[EVENT_MAX];
+
+	/* gaps between arrivals, correlated across the streams */
+	uint64_t stall_events;
+	uint64_t stall_gaps;
+	uint64_t stall_max;            /* longest gap [ms] */
+	unsigned stall_flows;          /* most flows in one event */
+
+	/* flood mode */
+	double flood_max_pps;          /* forwarded */
+	double flood_lossless_pps;     /* before the knee */
+	unsigned flood_knee;           /* window with loss, zero if none */
+
+	/* per peer number, only with more than one peer per allocation */
+	struct fanout_result fanoutv[FANOUT_BUCKETS];
+	unsigned fanoutc;
+	unsigned peers;
+
+	/* TLS/DTLS handshakes */
+	struct histogram hs_full;      /* [us] */
+	struct histogram hs_resumed;   /* [us] */
+
+	/* deallocation */
+	unsigned dealloc_ok;
+	unsigned dealloc_failed;       /* including timeouts */
+	double dealloc_duration;       /* [ms] */
+	struct histogram dealloc;      /* [us] */
+};
+
+int result_write(const char *path, const struct result *res);
+int result_compare(const char *base_path, const char *cur_path,
+		   double max_tput_drop, double max_p99_rise);
 
 
 /*
@@ -18,6 +426,44 @@
 typedef void (allocation_h)(int err, uint16_t scode, const char *reason,
 			    const struct sa *srv,  const struct sa *relay,
 			    void *arg);
+
+#define ALLOC_ERRORS_MAX 16
+
+/* allocation failures with the same errno or STUN error code */
+struct alloc_error {
+	int err;
+	uint16_t scode;
+	char reason[64];
+	unsigned count;
+	unsigned first_sent;           /* ramp position of the first error */
+	unsigned first_ok;
+	uint64_t first_ms;             /* [ms] since the ramp started */
+};
+
+typedef void (dealloc_h)(void *arg);
+
+/* controlled release of all allocations at the end of a run */
+struct dealloc {
+	struct tmr tmr;
+	struct le *le;                 /* next allocation to release */
+	double rate;                   /* [1/s], zero is all at once */
+	double credit;
+	uint64_t ts_start;             /* [us] */
+	uint64_t ts_last;              /* last release or response [us] */
+	uint64_t ts_deadline;
+	unsigned pending;
+	unsigned n_sent;
+	unsigned n_ok;
+	unsigned n_failed;
+	unsigned n_timeout;
+	int last_err;
+	uint16_t last_scode;
+	char last_reason[64];
+	struct histogram latency;      /* [us] */
+	dealloc_h *doneh;
+	void *arg;
+};
+
 struct allocator {
 	struct list allocl;
 	struct tmr tmr;
@@ -25,9 +471,18 @@ struct allocator {
 	unsigned num_allocations;
 	unsigned num_sent;
 	unsigned num_received;
+	unsigned num_failed;           /* gave up, after all retries */
+	unsigned num_lost;             /* failed after it was established */
+	unsigned num_retries;
+	unsigned retry_max;            /* retries per allocation */
+
+	struct alloc_error errorv[ALLOC_ERRORS_MAX];
+	unsigned errorc;
+	unsigned errors_other;
 
 	bool server_info;
 	bool server_auth;
+	struct histogram auth;         /* challenge to success [us] */
 	char server_software[256];
 	struct sa mapped_addr;
 	uint32_t lifetime;
@@ -37,41 +492,264 @@ struct allocator {
 	time_t traf_start_time;
 
 	struct tmr tmr_pace;
+
+	/*
+	 * hot per-packet state, one stream per peer of an allocation,
+	 * indexed by allocation number * peers + peer number
+	 */
+	struct sender *senderv;
+	struct receiver *recvv;
+	unsigned arena_size;
+	unsigned peers;                /* per allocation, zero is one */
+	struct histogram fanout_setup[FANOUT_BUCKETS];
+	const struct sa *laddrv;       /* local addresses for the peers */
+	unsigned laddrc;
+	bool dump;                     /* keep per-stream latency sketches */
+	struct sketch *sketchv;
+
+	struct uring *uring;           /* optional peer send datapath */
+	bool gso;                      /* send packet trains with UDP GSO */
+	int sockbuf;                   /* UDP socket buffer size [bytes] */
+
+	struct monitor mon;
+	struct events events;
+	struct stalls stalls;
+	uint32_t stall_ms;             /* gap threshold, zero is off */
+	bool warmup;                   /* measure only after the warm-up */
+	unsigned flood_window;         /* unpaced, max packets in flight */
+	struct flood flood;
+	bool live_view;                /* top view instead of the spinner */
+	struct live *live;
+	uint64_t ts_pace;              /* next pacing tick is due [us] */
+	struct histogram slip;         /* sender scheduling slip [us] */
+	unsigned bitrate;              /* requested bitrate [bit/s] */
+	struct dealloc dealloc;
+	struct handshake hs_tls;       /* TCP, one per SSL_CTX */
+	struct handshake hs_dtls;      /* UDP */
+
+	/* there is at least one group */
+	struct group groupv[GROUPS_MAX];
+	unsigned groupc;
+
+	/* the servers that allocations are spread over */
+	struct server serverv[SERVERS_MAX];
+	unsigned serverc;
+	bool weighted;                 /* by weight, or round-robin */
 };
 
 struct allocation;
+struct sender;
+struct receiver;
+struct uring;
 
-int allocation_create(struct allocator *allocator, unsigned ix, int proto,
-		      const struct sa *srv,
+int allocation_create(struct allocator *allocator, unsigned ix,
+		      unsigned group, unsigned server, int proto,
+		      const struct sa *srv, const struct sa *laddr,
 		      const char *username, const char *password,
 		      struct tls *tls, bool turn_ind,
 		      allocation_h *alloch, void *arg);
-int allocation_tx(struct allocation *alloc, struct mbuf *mb);
+int allocation_create_direct(struct allocation **allocp,
+			     struct allocator *allocator, unsigned ix,
+			     const struct sa *dst);
+int allocation_tx(struct allocation *alloc, unsigned peer, struct mbuf *mb);
+int allocation_tx_train(struct allocation *alloc, unsigned peer,
+			struct mbuf *mb, size_t segsz, unsigned *sentp);
+bool allocation_gso(const struct allocation *alloc);
 
 
+int  allocator_arena_alloc(struct allocator *allocator);
+int  allocator_group_add(struct allocator *allocator, const char *name,
+			 const struct group *cfg);
 void allocator_reset(struct allocator *allocator);
-int  allocator_start_senders(struct allocator *allocator, unsigned bitrate,
-			     size_t psize);
+unsigned allocator_streams(const struct allocator *allocator);
+int  allocator_server_add(struct allocator *allocator, const struct sa *addr,
+			  unsigned weight, unsigned *ixp);
+unsigned allocator_server_next(struct allocator *allocator);
+int  allocator_start_senders(struct allocator *allocator);
 void allocator_stop_senders(struct allocator *allocator);
+void allocator_measure_start(struct allocator *allocator);
+void allocator_measure_stop(struct allocator *allocator);
+int  allocator_dealloc_start(struct allocator *allocator, double rate,
+			     dealloc_h *doneh, void *arg);
+void allocator_dealloc_print(const struct allocator *allocator);
+void allocator_check_senders(struct allocator *allocator, uint64_t now);
+void allocator_count_error(struct allocator *allocator, int err,
+			   uint16_t scode, const char *reason);
 void allocator_print_statistics(const struct allocator *allocator);
 void allocator_show_summary(const struct allocator *allocator);
 void allocator_traffic_summary(struct allocator *allocator);
+void allocator_get_result(const struct allocator *allocator,
+			  struct result *res);
+int  allocator_dump(const struct allocator *allocator, const char *path);
+
+
+/*
+ * cluster
+ */
+
+struct cluster;
+
+typedef void (cluster_h)(int err, void *arg);
+
+int cluster_parse(struct allocator *allocator, const char *str,
+		  uint16_t dport);
+int cluster_discover(struct cluster **clp, struct dnsc *dnsc,
+		     struct allocator *allocator, const char *usage,
+		     const char *proto, const char *host, uint16_t port,
+		     uint16_t dport, cluster_h *h, void *arg);
+
+
+/*
+ * live view
+ */
+
+#define LIVE_TOP 5                     /* worst streams per metric */
+#define LIVE_BUCKETS 5
+
+struct live;
+
+int  live_alloc(struct live **livep, unsigned streams);
+void live_scan(struct live *live, const struct allocator *allocator);
+void live_print(struct live *live, struct allocator *allocator,
+		uint64_t elapsed);
+
+
+/*
+ * dump
+ */
+
+enum dump_state {
+	DUMP_PENDING = 0,              /* not established at the end */
+	DUMP_OK,
+	DUMP_FAILED,                   /* gave up, after all retries */
+	DUMP_LOST,                     /* failed after it was established */
+	DUMP_STATE_MAX
+};
+
+/* one stream of an allocation, at the end of a run */
+struct dump_record {
+	unsigned ix;                   /* allocation number */
+	unsigned peer;
+	unsigned group;
+	const char *group_name;
+	enum dump_state state;
+	int err;
+	uint16_t scode;
+	int proto;
+	bool secure;
+	bool turn_ind;
+	struct sa srv;
+	struct sa relay;
+	double atime;                  /* Allocate request to success [ms] */
+	double auth;                   /* challenge to success [ms] */
+	double setup;                  /* permission or channel [ms] */
+	unsigned retries;
+	unsigned redirects;
+	uint64_t sent;                 /* in the measurement window */
+	uint64_t recv;
+	uint64_t lost;
+	uint64_t dups;
+	uint64_t reordered;
+	uint64_t txdrop;
+	double send_bitrate;           /* [bit/s] */
+	double recv_bitrate;
+	double lat_avg;                /* [ms] */
+	double lat_p50;
+	double lat_p99;
+	double lat_max;
+};
+
+struct dump;
+
+int dump_open(struct dump **dp, const char *path);
+int dump_write(struct dump *d, const struct dump_record *rec);
+int dump_close(struct dump *d);
+
+
+/*
+ * credentials
+ */
+
+#define CRED_TTL 86400                 /* TURN REST lifetime [s] */
+
+struct creds;
+
+int creds_alloc(struct creds **credsp, const char *path, const char *secret,
+		uint32_t ttl);
+unsigned creds_count(const struct creds *creds);
+int creds_get(const struct creds *creds, unsigned n, const char *user,
+	      const char *pass, char *ubuf, size_t usz, char *pbuf,
+	      size_t psz);
+
+
+/*
+ * scenario
+ */
+
+int scenario_load(struct allocator *allocator, const char *path,
+		  const struct group *def);
 
 
 /*
  * sender
  */
 
-struct sender;
+/* note: lives in an array owned by the allocator, pacing state first */
+struct sender {
+	uint64_t ts;               /* running timestamp [us] */
+	unsigned ptime;
+	uint32_t seq;
+	struct allocation *alloc;  /* pointer, NULL if not in use */
+	uint32_t session_cookie;
+	uint32_t alloc_id;         /* stream number */
+	unsigned peer;             /* peer socket of the allocation */
+	size_t psize;
+	struct events *ev;         /* shared, optional */
 
-int      sender_alloc(struct sender **senderp, struct allocation *alloc,
-		      uint32_t session_cookie, uint32_t alloc_id,
-		      unsigned bitrate, unsigned ptime, size_t psize);
-int      sender_start(struct sender *snd);
+	uint64_t total_bytes;
+	uint64_t total_packets;
+	uint64_t tx_drops;         /* socket buffer full on send */
+	bool measure;              /* inside the measurement window */
+	bool measured;             /* a measurement window was opened */
+
+	unsigned bitrate;          /* target bitrate [bit/s] */
+	unsigned on_ms;            /* on/off model, off_ms=0 is CBR */
+	unsigned off_ms;
+	uint64_t ts_origin;        /* first packet, start of the model [us] */
+	uint64_t ts_start;
+	uint64_t ts_stop;
+
+	/* pacing accuracy */
+	uint64_t slip_sum;         /* [us] */
+	uint64_t slip_max;         /* [us] */
+	uint64_t slip_count;
+	uint64_t backlog_ticks;
+
+	/* flood mode, also outside of the measurement window */
+	uint32_t flood_acked;      /* highest sequence number received */
+	uint32_t flood_base;       /* older packets are given up */
+	uint64_t ts_flood;         /* last progress [us] */
+	uint64_t flood_sent;
+};
+
+int      sender_init(struct sender *snd, struct allocation *alloc,
+		     uint32_t session_cookie, uint32_t alloc_id,
+		     unsigned bitrate, unsigned ptime, size_t psize);
+void     sender_reset(struct sender *snd);
+int      sender_start(struct sender *snd, unsigned delay_ms,
+		      bool measure);
 void     sender_stop(struct sender *snd);
-void     sender_tick(struct sender *snd, uint64_t now);
+void     sender_measure_start(struct sender *snd);
+void     sender_tick(struct sender *snd, uint64_t now,
+		     struct histogram *slip);
+unsigned sender_flood(struct sender *snd, uint32_t acked, unsigned window,
+		      uint64_t now);
+void     sender_tx_failed(struct sender *snd, size_t len, int err);
 uint64_t sender_get_packets(const struct sender *snd);
+uint64_t sender_get_drops(const struct sender *snd);
+double   sender_get_slip(const struct sender *snd);
 double   sender_get_bitrate(const struct sender *snd);
+bool     sender_measured(const struct sender *snd);
 
 
 /*
@@ -86,21 +764,51 @@ struct receiver {
 	uint64_t total_bytes;
 	uint64_t total_packets;
 	uint32_t last_seq;
+	uint32_t max_seq;          /* highest received, also late ones */
+	uint64_t seq_map;          /* bit n: max_seq - n was received */
+	uint32_t seq_lo;           /* measurement window */
+	uint32_t seq_hi;
+
+	struct histogram *lat;     /* shared latency histogram [us] */
+	uint64_t lat_sum;          /* [us] */
+	uint64_t lat_max;          /* [us] */
+	struct events *ev;         /* shared, optional */
+	struct sketch *sk;         /* own latency sketch, optional */
+	uint64_t dups;             /* sequence number received before */
+	uint64_t reordered;        /* older than the last */
+
+	/* gaps between arrivals, also outside of the measurement window */
+	struct stalls *stalls;     /* shared, optional */
+	uint32_t stall_min;        /* gap threshold [ms], zero is off */
+	uint64_t ts_arrival;       /* last packet [ms] */
+	unsigned stallc;
+	uint64_t stall_sum;        /* [ms] */
+	uint64_t stall_max;        /* [ms] */
+
+	/* all packets, also outside of the measurement window */
+	uint64_t live_packets;
+	uint64_t live_lat_sum;     /* [us] */
 };
 
 void receiver_init(struct receiver *recv,
-		   uint32_t exp_cookie, uint32_t exp_allocid);
+		   uint32_t exp_cookie, uint32_t exp_allocid,
+		   struct histogram *lat, struct events *ev);
+void receiver_window_start(struct receiver *recv, uint32_t seq);
+void receiver_window_stop(struct receiver *recv, uint32_t seq);
 int  receiver_recv(struct receiver *recv, const struct sa *src,
 		   struct mbuf *mb);
 void receiver_print(const struct receiver *recv);
+void receiver_stall_flush(struct receiver *recv, uint64_t now);
 double receiver_get_bitrate(const struct receiver *recv);
+double receiver_get_latency(const struct receiver *recv);
+double receiver_get_pps(const struct receiver *recv);
 
 
 /*
  * protocol
  */
 
-#define HDR_SIZE 20
+#define HDR_SIZE 28
 #define PATTERN 0xa5
 
 struct hdr {
@@ -108,17 +816,42 @@ struct hdr {
 	uint32_t alloc_id;
 	uint32_t seq;
 	uint32_t payload_len;
+	uint64_t ts;               /* send time [us] */
 
 	uint8_t payload[256];
 };
 
 int  protocol_encode(struct mbuf *mb,
 		     uint32_t session_cookie, uint32_t alloc_id,
-		     uint32_t seq, size_t payload_len, uint8_t pattern);
+		     uint32_t seq, uint64_t ts, size_t payload_len,
+		     uint8_t pattern);
 int  protocol_decode(struct hdr *hdr, struct mbuf *mb);
+int  protocol_peek_id(const struct mbuf *mb, uint32_t *alloc_id);
 void protocol_packet_dump(const struct hdr *hdr);
 
 
+/*
+ * io_uring
+ */
+
+int  uring_alloc(struct uring **urp, unsigned entries, size_t bufsz);
+int  uring_send(struct uring *ur, int fd, const uint8_t *data, size_t len,
+		struct sender *snd);
+int  uring_submit(struct uring *ur);
+void uring_print_stats(const struct uring *ur);
+
+
+/*
+ * relay
+ */
+
+struct relay;
+
+int  relay_alloc(struct relay **relayp, const struct sa *laddr);
+const struct sa *relay_laddr(const struct relay *relay);
+void relay_print_stats(const struct relay *relay);
+
+
 /*
  * util
  */
@@ -127,3 +860,12 @@ int  dns_init(struct dnsc **dnsc);
 const char *protocol_name(int proto, bool secure);
 unsigned calculate_psize(unsigned bitrate, unsigned ptime);
 unsigned calculate_ptime(unsigned bitrate, size_t psize);
+int  laddr_pool_parse(struct sa **addrvp, unsigned *addrcp, const char *str);
+int  fd_limit_raise(unsigned *limitp, unsigned want);
+unsigned ephemeral_port_count(void);
+bool udp_gso_supported(void);
+uint64_t time_usec(void);
+
+typedef int (tcp_frame_h)(struct mbuf *mb, void *arg);
+int  tcp_reassemble(struct mbuf **mbp, struct mbuf *mb_pkt,
+		    tcp_frame_h *frameh, void *arg);
@@ -0,0 +1,354 @@
+/**
+ * @file uring.c io_uring datapath for the peer senders (Linux only)
+ *
+ * Copyright (C) 2010 - 2015 Creytiv.com
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <string.h>
+#include <linux/io_uring.h>
+#include <re.h>
+#include "turnperf.h"
+
+
+/*
+ * io_uring:
+ *
+ * - one ring shared by all senders
+ * - packets are copied into a registered buffer and queued as
+ *   WRITE_FIXED on the connected peer socket
+ * - the queue is submitted once per pacing tick, usually with one
+ *   syscall. What the kernel did not take stays queued for the next one
+ * - if all buffer slots are in flight, the packet is not queued and the
+ *   caller sends it on the poll path
+ * - a failed completion is reported to the sender of the packet, which
+ *   counted it as sent when it was queued
+ */
+
+
+/* the packet in a buffer slot, until its completion */
+struct slot {
+	struct sender *snd;        /* optional */
+	size_t len;
+};
+
+
+struct uring {
+	int fd;
+
+	/* submission queue */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+
+	/* completion queue */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_sz;
+	size_t cq_sz;
+	size_t sqes_sz;
+
+	/* registered buffers, one slot per ring entry */
+	uint8_t *bufv;
+	size_t bufsz;
+	unsigned *freev;           /* stack of free buffer slots */
+	unsigned freec;
+	struct slot *slotv;
+
+	unsigned entries;
+	unsigned pending;          /* queued, but not submitted */
+
+	uint64_t n_submit;         /* number of io_uring_enter calls */
+	uint64_t n_sent;
+	uint64_t n_err;
+	uint64_t n_busy;           /* no free slot, sent on the poll path */
+};
+
+
+static void destructor(void *arg)
+{
+	struct uring *ur = arg;
+
+	if (ur->sqes)
+		munmap(ur->sqes, ur->sqes_sz);
+	if (ur->cq_ptr && ur->cq_ptr != ur->sq_ptr)
+		munmap(ur->cq_ptr, ur->cq_sz);
+	if (ur->sq_ptr)
+		munmap(ur->sq_ptr, ur->sq_sz);
+	if (ur->fd >= 0)
+		(void)close(ur->fd);
+
+	mem_deref(ur->bufv);
+	mem_deref(ur->freev);
+	mem_deref(ur->slotv);
+}
+
+
+/* submit up to "pending" entries, the rest stays pending */
+static int sys_enter(struct uring *ur)
+{
+	long ret;
+
+	ret = syscall(__NR_io_uring_enter, ur->fd, ur->pending, 0, 0,
+		      NULL, 0);
+	++ur->n_submit;
+
+	if (ret < 0)
+		return errno;
+
+	ur->pending -= min((unsigned)ret, ur->pending);
+
+	return 0;
+}
+
+
+static void reap(struct uring *ur)
+{
+	unsigned head = *ur->cq_head;
+
+	while (head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE)) {
+
+		const struct io_uring_cqe *cqe;
+		const struct slot *sl;
+
+		cqe = &ur->cqes[head & *ur->cq_mask];
+		sl  = &ur->slotv[cqe->user_data];
+
+		if (cqe->res < 0) {
+			++ur->n_err;
+			sender_tx_failed(sl->snd, sl->len, -cqe->res);
+		}
+		else {
+			++ur->n_sent;
+		}
+
+		ur->freev[ur->freec++] = (unsigned)cqe->user_data;
+
+		++head;
+	}
+
+	__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+int uring_alloc(struct uring **urp, unsigned entries, size_t bufsz)
+{
+	struct io_uring_params p;
+	struct uring *ur;
+	struct iovec iov;
+	unsigned i;
+	int err = 0;
+
+	if (!urp || !entries || !bufsz)
+		return EINVAL;
+
+	ur = mem_zalloc(sizeof(*ur), destructor);
+	if (!ur)
+		return ENOMEM;
+
+	ur->fd = -1;
+
+	memset(&p, 0, sizeof(p));
+
+	ur->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (ur->fd < 0) {
+		err = errno;
+		re_fprintf(stderr, "io_uring_setup: %m\n", err);
+		goto out;
+	}
+
+	ur->entries = p.sq_entries;
+	ur->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ur->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->cq_sz > ur->sq_sz)
+			ur->sq_sz = ur->cq_sz;
+		ur->cq_sz = ur->sq_sz;
+	}
+
+	ur->sq_ptr = mmap(NULL, ur->sq_sz, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ur->fd,
+			  IORING_OFF_SQ_RING);
+	if (ur->sq_ptr == MAP_FAILED) {
+		ur->sq_ptr = NULL;
+		err = errno;
+		goto out;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ur->cq_ptr = ur->sq_ptr;
+	}
+	else {
+		ur->cq_ptr = mmap(NULL, ur->cq_sz, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, ur->fd,
+				  IORING_OFF_CQ_RING);
+		if (ur->cq_ptr == MAP_FAILED) {
+			ur->cq_ptr = NULL;
+			err = errno;
+			goto out;
+		}
+	}
+
+	ur->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = mmap(NULL, ur->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED) {
+		ur->sqes = NULL;
+		err = errno;
+		goto out;
+	}
+
+	ur->sq_head  = (unsigned *)((uint8_t *)ur->sq_ptr + p.sq_off.head);
+	ur->sq_tail  = (unsigned *)((uint8_t *)ur->sq_ptr + p.sq_off.tail);
+	ur->sq_mask  = (unsigned *)((uint8_t *)ur->sq_ptr +
+				    p.sq_off.ring_mask);
+	ur->sq_array = (unsigned *)((uint8_t *)ur->sq_ptr + p.sq_off.array);
+
+	ur->cq_head  = (unsigned *)((uint8_t *)ur->cq_ptr + p.cq_off.head);
+	ur->cq_tail  = (unsigned *)((uint8_t *)ur->cq_ptr + p.cq_off.tail);
+	ur->cq_mask  = (unsigned *)((uint8_t *)ur->cq_ptr +
+				    p.cq_off.ring_mask);
+	ur->cqes     = (struct io_uring_cqe *)
+		((uint8_t *)ur->cq_ptr + p.cq_off.cqes);
+
+	/* one registered buffer slot per submission entry */
+	ur->bufsz = bufsz;
+	ur->bufv  = mem_zalloc(ur->entries * bufsz, NULL);
+	ur->freev = mem_zalloc(ur->entries * sizeof(*ur->freev), NULL);
+	ur->slotv = mem_zalloc(ur->entries * sizeof(*ur->slotv), NULL);
+	if (!ur->bufv || !ur->freev || !ur->slotv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < ur->entries; i++)
+		ur->freev[ur->freec++] = ur->entries - 1 - i;
+
+	iov.iov_base = ur->bufv;
+	iov.iov_len  = ur->entries * bufsz;
+
+	if (0 > syscall(__NR_io_uring_register, ur->fd,
+			IORING_REGISTER_BUFFERS, &iov, 1)) {
+		err = errno;
+		re_fprintf(stderr, "io_uring_register: %m\n", err);
+		goto out;
+	}
+
+ out:
+	if (err)
+		mem_deref(ur);
+	else
+		*urp = ur;
+
+	return err;
+}
+
+
+int uring_submit(struct uring *ur)
+{
+	int err = 0;
+
+	if (!ur)
+		return EINVAL;
+
+	while (ur->pending) {
+
+		const unsigned pending = ur->pending;
+
+		err = sys_enter(ur);
+		if (err)
+			break;
+
+		/* the kernel is busy, try again with the next tick */
+		if (ur->pending == pending)
+			break;
+	}
+
+	reap(ur);
+
+	return err;
+}
+
+
+/*
+ * Queue one datagram on a connected UDP socket. The data is copied
+ * into a registered buffer, so the caller can re-use its buffer. If
+ * the send fails later, it is reported to the sender "snd". Returns
+ * EBUSY if no buffer slot is free, the packet was not queued then.
+ */
+int uring_send(struct uring *ur, int fd, const uint8_t *data, size_t len,
+	       struct sender *snd)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, slot;
+	uint8_t *buf;
+
+	if (!ur || fd < 0 || !data)
+		return EINVAL;
+
+	if (len > ur->bufsz)
+		return EMSGSIZE;
+
+	/* all buffers busy, collect the completions without waiting */
+	if (!ur->freec) {
+
+		(void)uring_submit(ur);
+
+		if (!ur->freec) {
+			++ur->n_busy;
+			return EBUSY;
+		}
+	}
+
+	slot = ur->freev[--ur->freec];
+	buf  = ur->bufv + slot * ur->bufsz;
+
+	memcpy(buf, data, len);
+
+	ur->slotv[slot].snd = snd;
+	ur->slotv[slot].len = len;
+
+	tail = *ur->sq_tail;
+	sqe  = &ur->sqes[tail & *ur->sq_mask];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode    = IORING_OP_WRITE_FIXED;
+	sqe->fd        = fd;
+	sqe->addr      = (uint64_t)(uintptr_t)buf;
+	sqe->len       = (uint32_t)len;
+	sqe->buf_index = 0;
+	sqe->user_data = slot;
+
+	ur->sq_array[tail & *ur->sq_mask] = tail & *ur->sq_mask;
+
+	__atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	++ur->pending;
+
+	return 0;
+}
+
+
+void uring_print_stats(const struct uring *ur)
+{
+	if (!ur)
+		return;
+
+	re_printf("io_uring: %llu packets sent in %llu syscalls"
+		  " (%llu errors, %llu on the poll path)\n",
+		  (unsigned long long)ur->n_sent,
+		  (unsigned long long)ur->n_submit,
+		  (unsigned long long)ur->n_err,
+		  (unsigned long long)ur->n_busy);
+}
@@ -4,10 +4,21 @@
  * Copyright (C) 2010 - 2015 Creytiv.com
  */
 
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/udp.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
 #include <re.h>
 #include "turnperf.h"
 
 
+enum {
+	LADDR_MAX = 65536,
+};
+
+
 int dns_init(struct dnsc **dnsc)
 {
 	struct sa nsv[8];
@@ -59,3 +70,279 @@ unsigned calculate_ptime(unsigned bitrate, size_t psize)
 {
 	return (8 * 1000) * (unsigned)psize / bitrate;
 }
+
+
+static int laddr_append(struct sa **addrvp, unsigned *addrcp,
+			const struct sa *sa)
+{
+	struct sa *addrv;
+
+	if (*addrcp >= LADDR_MAX) {
+		re_fprintf(stderr, "too many local addresses (max %u)\n",
+			   LADDR_MAX);
+		return E2BIG;
+	}
+
+	if (*addrvp)
+		addrv = mem_realloc(*addrvp, (*addrcp + 1) * sizeof(*addrv));
+	else
+		addrv = mem_zalloc(sizeof(*addrv), NULL);
+	if (!addrv)
+		return ENOMEM;
+
+	addrv[(*addrcp)++] = *sa;
+	*addrvp = addrv;
+
+	return 0;
+}
+
+
+/*
+ * Parse a comma-separated list of local addresses, where each entry
+ * is either a single IPv4/IPv6 address or an IPv4 CIDR-block.
+ *
+ * Example: "127.0.0.2,127.0.0.3" or "10.0.0.0/24"
+ */
+int laddr_pool_parse(struct sa **addrvp, unsigned *addrcp, const char *str)
+{
+	struct pl pl, item;
+	int err = 0;
+
+	if (!addrvp || !addrcp || !str)
+		return EINVAL;
+
+	pl_set_str(&pl, str);
+
+	while (0 == re_regex(pl.p, pl.l, "[^,]+", &item)) {
+
+		struct pl addr, bits;
+		struct sa sa;
+
+		if (re_regex(item.p, item.l, "[^/]+/[0-9]+", &addr, &bits)) {
+			addr = item;
+			bits.l = 0;
+		}
+
+		err = sa_set(&sa, &addr, 0);
+		if (err) {
+			re_fprintf(stderr, "invalid local address '%r'\n",
+				   &addr);
+			break;
+		}
+
+		if (bits.l) {
+			uint32_t prefix = pl_u32(&bits);
+			uint32_t base, n, i;
+
+			if (sa_af(&sa) != AF_INET || prefix > 32) {
+				re_fprintf(stderr, "invalid CIDR-block '%r'\n",
+					   &item);
+				err = EINVAL;
+				break;
+			}
+
+			n = prefix ? (uint32_t)1 << (32 - prefix) : 0;
+			if (!n || n > LADDR_MAX) {
+				re_fprintf(stderr, "CIDR-block '%r' is too"
+					   " large\n", &item);
+				err = E2BIG;
+				break;
+			}
+
+			base = sa_in(&sa) & ~(n - 1);
+
+			/* skip network and broadcast address */
+			for (i = (n > 2); i < n - (n > 2); i++) {
+
+				sa_set_in(&sa, base + i, 0);
+
+				err = laddr_append(addrvp, addrcp, &sa);
+				if (err)
+					break;
+			}
+		}
+		else {
+			err = laddr_append(addrvp, addrcp, &sa);
+		}
+		if (err)
+			break;
+
+		pl.l -= item.p + item.l - pl.p;
+		pl.p  = item.p + item.l;
+	}
+
+	return err;
+}
+
+
+/*
+ * Raise the soft limit of open files to at least "want", or as far
+ * as the hard limit allows. The resulting limit is returned.
+ */
+int fd_limit_raise(unsigned *limitp, unsigned want)
+{
+	struct rlimit rlim;
+
+	if (!limitp)
+		return EINVAL;
+
+	if (0 != getrlimit(RLIMIT_NOFILE, &rlim))
+		return errno;
+
+	if (rlim.rlim_cur != RLIM_INFINITY && rlim.rlim_cur < want) {
+
+		rlim.rlim_cur = want;
+
+		if (rlim.rlim_max != RLIM_INFINITY && rlim.rlim_max < want)
+			rlim.rlim_cur = rlim.rlim_max;
+
+		if (0 != setrlimit(RLIMIT_NOFILE, &rlim))
+			return errno;
+	}
+
+	*limitp = (rlim.rlim_cur == RLIM_INFINITY || rlim.rlim_cur > want)
+		? want : (unsigned)rlim.rlim_cur;
+
+	return 0;
+}
+
+
+/*
+ * Number of ephemeral ports the kernel hands out per local address,
+ * or 0 if unknown
+ */
+unsigned ephemeral_port_count(void)
+{
+	unsigned lo = 0, hi = 0;
+	FILE *f;
+
+	f = fopen("/proc/sys/net/ipv4/ip_local_port_range", "r");
+	if (!f)
+		return 0;
+
+	if (2 != fscanf(f, "%u %u", &lo, &hi) || hi < lo)
+		lo = hi = 0;
+
+	fclose(f);
+
+	return hi ? hi - lo + 1 : 0;
+}
+
+
+/* check if the kernel supports UDP Generic Segmentation Offload */
+bool udp_gso_supported(void)
+{
+#ifdef UDP_SEGMENT
+	int val = 1200;
+	bool ok;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (fd < 0)
+		return false;
+
+	ok = 0 == setsockopt(fd, SOL_UDP, UDP_SEGMENT, &val, sizeof(val));
+
+	(void)close(fd);
+
+	return ok;
+#else
+	return false;
+#endif
+}
+
+
+/* monotonic time in microseconds */
+uint64_t time_usec(void)
+{
+	struct timespec ts;
+
+	if (0 != clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/*
+ * Re-assemble a TCP stream of STUN and ChannelData messages, and call
+ * the frame handler once for every complete message. Incomplete data
+ * is kept in *mbp until the next segment arrives.
+ */
+int tcp_reassemble(struct mbuf **mbp, struct mbuf *mb_pkt,
+		   tcp_frame_h *frameh, void *arg)
+{
+	struct mbuf *mb;
+	int err = 0;
+
+	if (!mbp || !mb_pkt || !frameh)
+		return EINVAL;
+
+	/* re-assembly of fragments */
+	if (*mbp) {
+		size_t pos;
+
+		pos = (*mbp)->pos;
+
+		(*mbp)->pos = (*mbp)->end;
+
+		err = mbuf_write_mem(*mbp,
+				     mbuf_buf(mb_pkt), mbuf_get_left(mb_pkt));
+		if (err)
+			return err;
+
+		(*mbp)->pos = pos;
+	}
+	else {
+		*mbp = mem_ref(mb_pkt);
+	}
+
+	mb = *mbp;
+
+	for (;;) {
+
+		size_t len, pos, end;
+		uint16_t typ;
+
+		if (mbuf_get_left(mb) < 4)
+			break;
+
+		typ = ntohs(mbuf_read_u16(mb));
+		len = ntohs(mbuf_read_u16(mb));
+
+		if (typ < 0x4000)
+			len += STUN_HEADER_SIZE;
+		else if (typ < 0x8000)
+			len += 4;
+		else
+			return EBADMSG;
+
+		mb->pos -= 4;
+
+		if (mbuf_get_left(mb) < len)
+			break;
+
+		pos = mb->pos;
+		end = mb->end;
+
+		mb->end = pos + len;
+
+		err = frameh(mb, arg);
+		if (err)
+			return err;
+
+		/* 4 byte alignment */
+		while (len & 0x03)
+			++len;
+
+		mb->pos = pos + len;
+		mb->end = end;
+
+		if (mb->pos >= mb->end) {
+			*mbp = mem_deref(*mbp);
+			break;
+		}
+	}
+
+	return 0;
+}